@@ -0,0 +1,394 @@
+#include "backlog.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/event_groups.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "nvs.h"
+
+#include "../spiffs/spiffs.h"
+#include "../mqtt/mqtt.h"
+#include "../mqtt/outbox.h"
+
+static const char *TAG = "backlog";
+
+#define BACKLOG_CONNECTED_BIT BIT0
+#define BACKLOG_DONE_BIT BIT1
+#define BACKLOG_AGE_BIT BIT2
+
+// On-flash record: the magic marks slots that were completely written
+typedef struct {
+    uint32_t magic;
+    sample_t sample;
+} backlog_record_t;
+
+static SemaphoreHandle_t lock = NULL;
+static EventGroupHandle_t events = NULL;
+static TaskHandle_t drain_task = NULL;
+
+static uint32_t read_index = 0;     // First record not yet acknowledged by the broker
+static uint32_t write_index = 0;    // Number of record slots, in the file or staged
+
+// Write-behind buffer: records are written to SPIFFS in whole pages
+static uint8_t stage[BACKLOG_STAGE_SIZE + sizeof(backlog_record_t)];
+static size_t stage_len = 0;
+static uint32_t file_bytes = 0;
+static esp_timer_handle_t age_timer = NULL;
+static backlog_stats_t stats;
+static volatile uint32_t done_ticket = 0;
+static volatile bool done_acked = false;
+
+static void save_read_index(void)
+{
+    nvs_handle_t nvs;
+    if (nvs_open(BACKLOG_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to open NVS, read cursor not saved");
+        return;
+    }
+    nvs_set_u32(nvs, "rd", read_index);
+    nvs_commit(nvs);
+    nvs_close(nvs);
+}
+
+static void load_read_index(void)
+{
+    nvs_handle_t nvs;
+    read_index = 0;
+    if (nvs_open(BACKLOG_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK)
+        return;
+    nvs_get_u32(nvs, "rd", &read_index);
+    nvs_close(nvs);
+}
+
+/*
+ * @brief Appends the first n staged bytes to the file. Called with the lock held.
+ */
+static esp_err_t stage_write(size_t n)
+{
+    int64_t start = esp_timer_get_time();
+    spiffsWriteBegin();
+    FILE* f = fopen(BACKLOG_FILE_PATH, "ab");
+    if (f == NULL)
+    {
+        spiffsWriteEnd(false);
+        ESP_LOGE(TAG, "Failed to open backlog for writing");
+        return ESP_FAIL;
+    }
+    size_t written = fwrite(stage, 1, n, f);
+    bool closed = fclose(f) == 0;
+    spiffsWriteEnd(written == n && closed);
+
+    uint32_t elapsed = esp_timer_get_time() - start;
+    stats.writes++;
+    stats.bytes += written;
+    stats.write_last_us = elapsed;
+    if (elapsed > stats.write_max_us)
+        stats.write_max_us = elapsed;
+
+    // Bytes that did not make it stay staged for the next attempt
+    memmove(stage, stage + written, stage_len - written);
+    stage_len -= written;
+    file_bytes += written;
+    return written == n ? ESP_OK : ESP_FAIL;
+}
+
+/*
+ * @brief Writes records staged for longer than CONFIG_BACKLOG_STAGE_MAX_AGE_S. Runs in the
+ *        drain task: a SPIFFS write can stall for a garbage collection.
+ */
+static void age_flush(void)
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (stage_len > 0)
+    {
+        stats.age_flushes++;
+        stage_write(stage_len);
+    }
+    xSemaphoreGive(lock);
+}
+
+static void callback_age(void *arg)
+{
+    xEventGroupSetBits(events, BACKLOG_AGE_BIT);
+}
+
+static void shutdown_handler(void)
+{
+    // Never wait long during a restart: a task may hold the lock forever
+    if (xSemaphoreTake(lock, pdMS_TO_TICKS(100)) != pdTRUE)
+        return;
+    if (stage_len > 0)
+        stage_write(stage_len);
+    xSemaphoreGive(lock);
+}
+
+/*
+ * @brief Reads up to max records starting at the read cursor and encodes the valid ones
+ *        as a multi-line InfluxDB line protocol message.
+ *
+ * @return Number of record slots consumed (valid or not), 0 when the backlog is empty.
+ */
+static int read_batch(char* buf, size_t len, int max, int* out_len)
+{
+    backlog_record_t record;
+    int consumed = 0, pos = 0;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    FILE* f = fopen(BACKLOG_FILE_PATH, "rb");
+    if (f == NULL || fseek(f, (long)read_index * sizeof(record), SEEK_SET) != 0)
+    {
+        if (f != NULL)
+            fclose(f);
+        xSemaphoreGive(lock);
+        *out_len = 0;
+        return 0;
+    }
+
+    while (consumed < max && fread(&record, sizeof(record), 1, f) == 1)
+    {
+        if (record.magic == BACKLOG_RECORD_MAGIC)
+        {
+            int n = payload_encode_line(&record.sample, buf + pos, len - pos);
+            if (n < 0 || (size_t)(pos + n + 1) >= len)
+                break;
+            pos += n;
+            buf[pos++] = '\n';
+        }
+        consumed++;
+    }
+    fclose(f);
+    xSemaphoreGive(lock);
+
+    *out_len = pos > 0 ? pos - 1 : 0; // drop the trailing newline
+    return consumed;
+}
+
+/*
+ * @brief Moves the read cursor past acknowledged records. Once everything is drained the
+ *        file is removed so the next outage starts from an empty queue.
+ */
+static void advance(int consumed)
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    read_index += consumed;
+    if (read_index >= write_index)
+    {
+        spiffsWriteBegin();
+        spiffsWriteEnd(remove(BACKLOG_FILE_PATH) == 0 || errno == ENOENT);
+        read_index = write_index = 0;
+        file_bytes = 0;
+    }
+    save_read_index();
+    xSemaphoreGive(lock);
+}
+
+static void on_done(uint32_t ticket, bool acked, void *ctx)
+{
+    done_acked = acked;
+    done_ticket = ticket;
+    xEventGroupSetBits(events, BACKLOG_DONE_BIT);
+}
+
+static void backlog_drain_task(void *arg)
+{
+    static char batch[OUTBOX_SLOT_SIZE];
+
+    while (1)
+    {
+        EventBits_t bits = xEventGroupWaitBits(events, BACKLOG_CONNECTED_BIT | BACKLOG_AGE_BIT,
+                                               pdFALSE, pdFALSE, portMAX_DELAY);
+        if (bits & BACKLOG_AGE_BIT)
+        {
+            xEventGroupClearBits(events, BACKLOG_AGE_BIT);
+            age_flush();
+        }
+        if (!(bits & BACKLOG_CONNECTED_BIT))
+            continue;
+
+        // Staged records are only readable once in the file
+        backlog_flush();
+
+        int len;
+        int consumed = read_batch(batch, sizeof(batch), CONFIG_BACKLOG_BATCH_SIZE, &len);
+        if (consumed == 0)
+        {
+            xEventGroupClearBits(events, BACKLOG_CONNECTED_BIT);
+            continue;
+        }
+
+        if (len > 0)
+        {
+            xEventGroupClearBits(events, BACKLOG_DONE_BIT);
+            uint32_t ticket = outbox_publish(TELEMETRY_LINE_TOPIC, batch, len, portMAX_DELAY, on_done, NULL);
+            if (ticket == 0)
+            {
+                vTaskDelay(CONFIG_BACKLOG_BATCH_INTERVAL_MS / portTICK_PERIOD_MS);
+                continue;
+            }
+
+            // The cursor only moves once the broker has acknowledged the batch
+            while (done_ticket != ticket)
+                xEventGroupWaitBits(events, BACKLOG_DONE_BIT, pdTRUE, pdTRUE, portMAX_DELAY);
+            if (!done_acked)
+            {
+                ESP_LOGW(TAG, "Batch at record %" PRIu32 " not acknowledged, will replay", read_index);
+                continue;
+            }
+        }
+
+        advance(consumed);
+        ESP_LOGI(TAG, "Drained %d records, %" PRIu32 " pending", consumed, backlog_pending());
+
+        // Rate limit so live samples keep flowing during a long drain
+        vTaskDelay(CONFIG_BACKLOG_BATCH_INTERVAL_MS / portTICK_PERIOD_MS);
+    }
+}
+
+/*
+ * @brief Appends a sample to the durable queue. Called while the broker is unreachable.
+ *
+ *  The record is staged in RAM. Once BACKLOG_STAGE_SIZE bytes are staged they are written in
+ *  one go, cut so the file ends on a SPIFFS page boundary; the rest waits for the next write.
+ *  Staged records are lost on power loss, for at most CONFIG_BACKLOG_STAGE_MAX_AGE_S.
+ */
+esp_err_t backlog_push(const sample_t* sample)
+{
+    backlog_record_t record = {
+        .magic = BACKLOG_RECORD_MAGIC,
+        .sample = *sample,
+    };
+    esp_err_t err = ESP_OK;
+
+    if (lock == NULL)
+        return ESP_ERR_INVALID_STATE;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (stage_len + sizeof(record) > sizeof(stage))
+    {
+        // Earlier writes kept failing: make room the slow way
+        if ((err = stage_write(stage_len)) != ESP_OK)
+        {
+            xSemaphoreGive(lock);
+            return err;
+        }
+    }
+
+    memcpy(stage + stage_len, &record, sizeof(record));
+    stage_len += sizeof(record);
+    write_index++;
+    stats.samples++;
+
+    if (stage_len >= BACKLOG_STAGE_SIZE)
+        err = stage_write(stage_len - (file_bytes + stage_len) % BACKLOG_SPIFFS_DATA_PAGE);
+
+    if (stage_len > 0 && !esp_timer_is_active(age_timer))
+        esp_timer_start_once(age_timer, (uint64_t)CONFIG_BACKLOG_STAGE_MAX_AGE_S * 1000000);
+    xSemaphoreGive(lock);
+
+    return err;
+}
+
+/*
+ * @brief Writes every staged record to SPIFFS. Call before sleeping or when the supply is
+ *        about to fail; restarts are covered by a shutdown handler.
+ */
+esp_err_t backlog_flush(void)
+{
+    if (lock == NULL)
+        return ESP_ERR_INVALID_STATE;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    esp_err_t err = stage_len > 0 ? stage_write(stage_len) : ESP_OK;
+    xSemaphoreGive(lock);
+    return err;
+}
+
+void backlog_get_stats(backlog_stats_t* out)
+{
+    if (lock == NULL)
+    {
+        memset(out, 0, sizeof(*out));
+        return;
+    }
+    xSemaphoreTake(lock, portMAX_DELAY);
+    *out = stats;
+    xSemaphoreGive(lock);
+}
+
+uint32_t backlog_pending(void)
+{
+    return write_index - read_index;
+}
+
+void backlog_notify_connected(void)
+{
+    if (events != NULL && backlog_pending() > 0)
+        xEventGroupSetBits(events, BACKLOG_CONNECTED_BIT);
+}
+
+void backlog_notify_disconnected(void)
+{
+    if (events != NULL)
+        xEventGroupClearBits(events, BACKLOG_CONNECTED_BIT);
+}
+
+/*
+ * @brief Recovers the queue state from SPIFFS and NVS and starts the drain task.
+ *
+ *  Must run after init_spiffs(). Writes may stop mid-record, so a power cut can leave the
+ *  head of a record without its tail: that slot is zeroed and skipped on replay thanks to its
+ *  missing magic.
+ */
+esp_err_t backlog_init(void)
+{
+    lock = xSemaphoreCreateMutex();
+    events = xEventGroupCreate();
+    if (lock == NULL || events == NULL)
+        return ESP_ERR_NO_MEM;
+
+    load_read_index();
+
+    FILE* f = fopen(BACKLOG_FILE_PATH, "r+b");
+    if (f != NULL)
+    {
+        fseek(f, 0, SEEK_END);
+        long size = ftell(f);
+        long tail = size % sizeof(backlog_record_t);
+        if (tail != 0)
+        {
+            static const uint8_t zeros[sizeof(backlog_record_t)] = {0};
+            spiffsWriteBegin();
+            fseek(f, size - tail, SEEK_SET);
+            bool ok = fwrite(zeros, sizeof(zeros), 1, f) == 1;
+            spiffsWriteEnd(fflush(f) == 0 && ok);
+            size += sizeof(backlog_record_t) - tail;
+        }
+        fclose(f);
+        write_index = size / sizeof(backlog_record_t);
+        file_bytes = size;
+    }
+
+    if (read_index > write_index)
+        read_index = write_index;
+
+    ESP_LOGI(TAG, "%" PRIu32 " records pending", backlog_pending());
+
+    const esp_timer_create_args_t age_timer_args = {
+        .callback = &callback_age,
+        .name = "backlog_age"};
+    ESP_ERROR_CHECK(esp_timer_create(&age_timer_args, &age_timer));
+    esp_register_shutdown_handler(shutdown_handler);
+
+    xTaskCreate(backlog_drain_task, "backlog", 4096, NULL, tskIDLE_PRIORITY + 1, &drain_task);
+
+    if (mqtt_is_connected())
+        backlog_notify_connected();
+    return ESP_OK;
+}
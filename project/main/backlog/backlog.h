@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "../payload/payload.h"
+
+#define BACKLOG_FILE_PATH "/spiffs/backlog.bin"
+#define BACKLOG_NVS_NAMESPACE "backlog"
+#define BACKLOG_RECORD_MAGIC 0x53414D50 // "SAMP"
+
+// Payload bytes of a SPIFFS page, which starts with a 5 byte spiffs_page_header
+#define BACKLOG_SPIFFS_DATA_PAGE (CONFIG_SPIFFS_PAGE_SIZE - 5)
+#define BACKLOG_STAGE_SIZE (CONFIG_BACKLOG_STAGE_PAGES * BACKLOG_SPIFFS_DATA_PAGE)
+
+typedef struct {
+    uint32_t samples;           // Records pushed
+    uint32_t writes;            // fopen/fwrite/fclose cycles on SPIFFS
+    uint32_t bytes;             // Bytes written to SPIFFS
+    uint32_t age_flushes;       // Writes forced by CONFIG_BACKLOG_STAGE_MAX_AGE_S
+    uint32_t write_last_us;     // Blocking time of the SPIFFS writes
+    uint32_t write_max_us;
+} backlog_stats_t;
+
+esp_err_t backlog_init(void);
+esp_err_t backlog_push(const sample_t* sample);
+esp_err_t backlog_flush(void);
+void backlog_get_stats(backlog_stats_t* out);
+uint32_t backlog_pending(void);
+void backlog_notify_connected(void);
+void backlog_notify_disconnected(void);
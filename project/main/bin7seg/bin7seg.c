@@ -71,3 +71,14 @@ void displayStatus(char* status)
     gpio_set_level(G, (segment & 0b1000000));
     active_display = !active_display;
 }
+
+void displayBlank()
+{
+    gpio_set_level(A, 0);
+    gpio_set_level(B, 0);
+    gpio_set_level(C, 0);
+    gpio_set_level(D, 0);
+    gpio_set_level(E, 0);
+    gpio_set_level(F, 0);
+    gpio_set_level(G, 0);
+}
@@ -19,4 +19,5 @@
 char* getWeatherState(int Z);
 int char2seg(char c);
 void configure_io_ports();
-void displayStatus(char* status);
\ No newline at end of file
+void displayStatus(char* status);
+void displayBlank();
\ No newline at end of file
@@ -0,0 +1,206 @@
+#include "display_pm.h"
+#include "bin7seg.h"
+
+#include <string.h>
+#include <time.h>
+#include "esp_log.h"
+#include "../metrics/metrics.h"
+
+static const char *TAG = "display_pm";
+
+static esp_timer_handle_t mux_timer = NULL;     // multiplexes the two digits
+static esp_timer_handle_t blank_timer = NULL;   // ends the lit part of a multiplex period
+static esp_timer_handle_t idle_timer = NULL;    // switches the display off after inactivity
+
+static const char* display_text = NULL;
+static display_mode_t display_mode;
+static int brightness = 100;
+static bool display_on = false;
+static int64_t idle_deadline_us = 0;            // esp_timer time at which idle_timer fires
+
+static metrics_timer_t mux_watch = {.name = "display", .period_us = DISPLAY_MUX_PERIOD_US};
+
+/*
+ * @brief Returns true while the local time is inside the configured off-hours window.
+ *
+ *  The window is [CONFIG_DISPLAY_OFF_HOUR_START, CONFIG_DISPLAY_OFF_HOUR_END) and may wrap
+ *  midnight. Equal bounds disable the schedule, and so does a clock that was never synced.
+ */
+static bool in_off_hours(void)
+{
+    int start = CONFIG_DISPLAY_OFF_HOUR_START, end = CONFIG_DISPLAY_OFF_HOUR_END;
+    if (start == end)
+        return false;
+
+    time_t now;
+    struct tm timeinfo;
+    time(&now);
+    localtime_r(&now, &timeinfo);
+    if (timeinfo.tm_year < (2016 - 1900))
+        return false;
+
+    if (start < end)
+        return timeinfo.tm_hour >= start && timeinfo.tm_hour < end;
+    return timeinfo.tm_hour >= start || timeinfo.tm_hour < end;
+}
+
+static void callback_blank(void *arg)
+{
+    displayBlank();
+}
+
+static void callback_mux(void *arg)
+{
+    static int iter = 0, timer = 0;
+    char substring[2];
+
+    metrics_timer_check(&mux_watch);
+    if (timer++ == DISPLAY_SCROLL_PERIODS)
+    {
+        timer = 0;
+        iter++;
+    }
+    int str_len = strlen(display_text);
+    iter %= str_len;
+    substring[0] = display_text[iter];
+    substring[1] = display_text[(iter + 1) % str_len];
+    displayStatus(substring);
+
+    // Dimming: light the digit for only part of the period
+    if (brightness < 100)
+    {
+        esp_timer_stop(blank_timer);
+        esp_timer_start_once(blank_timer, DISPLAY_MUX_PERIOD_US * brightness / 100);
+    }
+}
+
+static void callback_idle(void *arg)
+{
+    ESP_LOGI(TAG, "Idle timeout, switching display off");
+    display_pm_off();
+}
+
+static void display_pm_on(void)
+{
+    if (display_on)
+        return;
+    metrics_timer_reset(&mux_watch);
+    ESP_ERROR_CHECK(esp_timer_start_periodic(mux_timer, DISPLAY_MUX_PERIOD_US));
+    display_on = true;
+}
+
+/*
+ * @brief Stops every display timer and blanks the segments.
+ *
+ *  With no periodic timer armed the esp_timer task stays idle and the SoC can enter light sleep.
+ */
+void display_pm_off(void)
+{
+    if (esp_timer_is_active(idle_timer))
+        esp_timer_stop(idle_timer);
+    if (!display_on)
+        return;
+    esp_timer_stop(mux_timer);
+    esp_timer_stop(blank_timer);
+    displayBlank();
+    display_on = false;
+}
+
+bool display_pm_is_on(void)
+{
+    return display_on;
+}
+
+/*
+ * @brief Lights the display for the given number of seconds, regardless of the mode.
+ *
+ *  Ignored inside the off-hours window. In DISPLAY_MODE_ALWAYS_ON the display stays on.
+ *  Never brings a later switch-off forward: the display stays on until the later deadline.
+ */
+void display_pm_show(int seconds)
+{
+    if (in_off_hours())
+        return;
+
+    display_pm_on();
+    if (display_mode == DISPLAY_MODE_ALWAYS_ON)
+        return;
+
+    int64_t deadline = esp_timer_get_time() + (int64_t)seconds * 1000000;
+    if (esp_timer_is_active(idle_timer))
+    {
+        if (deadline <= idle_deadline_us)
+            return;
+        esp_timer_stop(idle_timer);
+    }
+    idle_deadline_us = deadline;
+    ESP_ERROR_CHECK(esp_timer_start_once(idle_timer, (uint64_t)seconds * 1000000));
+}
+
+/*
+ * @brief Applies the off-hours schedule. Meant to be called periodically (e.g. on every sample).
+ */
+void display_pm_update(void)
+{
+    if (in_off_hours())
+        display_pm_off();
+    else if (display_mode == DISPLAY_MODE_ALWAYS_ON)
+        display_pm_on();
+}
+
+void display_pm_set_mode(display_mode_t mode)
+{
+    display_mode = mode;
+    switch (mode)
+    {
+    case DISPLAY_MODE_ALWAYS_ON:
+        if (esp_timer_is_active(idle_timer))
+            esp_timer_stop(idle_timer);
+        display_pm_update();
+        break;
+    case DISPLAY_MODE_AUTO_OFF:
+        display_pm_show(CONFIG_DISPLAY_IDLE_TIMEOUT_S);
+        break;
+    case DISPLAY_MODE_ON_DEMAND:
+        display_pm_off();
+        break;
+    }
+}
+
+void display_pm_set_brightness(int percent)
+{
+    if (percent < 1)
+        percent = 1;
+    else if (percent > 100)
+        percent = 100;
+    brightness = percent;
+}
+
+void display_pm_init(const char* text)
+{
+    display_text = text;
+
+    const esp_timer_create_args_t mux_timer_args = {
+        .callback = &callback_mux,
+        .name = "display"};
+    const esp_timer_create_args_t blank_timer_args = {
+        .callback = &callback_blank,
+        .name = "display_blank"};
+    const esp_timer_create_args_t idle_timer_args = {
+        .callback = &callback_idle,
+        .name = "display_idle"};
+
+    ESP_ERROR_CHECK(esp_timer_create(&mux_timer_args, &mux_timer));
+    ESP_ERROR_CHECK(esp_timer_create(&blank_timer_args, &blank_timer));
+    ESP_ERROR_CHECK(esp_timer_create(&idle_timer_args, &idle_timer));
+    metrics_timer_register(&mux_watch);
+
+    display_pm_set_brightness(CONFIG_DISPLAY_BRIGHTNESS);
+#if CONFIG_DISPLAY_MODE_AUTO_OFF
+    display_pm_set_mode(DISPLAY_MODE_AUTO_OFF);
+#elif CONFIG_DISPLAY_MODE_ON_DEMAND
+    display_pm_set_mode(DISPLAY_MODE_ON_DEMAND);
+#else
+    display_pm_set_mode(DISPLAY_MODE_ALWAYS_ON);
+#endif
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdbool.h>
+#include "esp_timer.h"
+
+#define DISPLAY_MUX_PERIOD_US 10000 // 100 Hz, each digit is lit every other period
+#define DISPLAY_SCROLL_PERIODS 100  // multiplex periods between scroll steps (1 s)
+
+typedef enum {
+    DISPLAY_MODE_ALWAYS_ON,     // multiplex forever (previous behaviour)
+    DISPLAY_MODE_AUTO_OFF,      // switch off after CONFIG_DISPLAY_IDLE_TIMEOUT_S without activity
+    DISPLAY_MODE_ON_DEMAND,     // dark until display_pm_show() is called
+} display_mode_t;
+
+void display_pm_init(const char* text);
+void display_pm_set_mode(display_mode_t mode);
+void display_pm_set_brightness(int percent);
+void display_pm_show(int seconds);
+void display_pm_update(void);
+void display_pm_off(void);
+bool display_pm_is_on(void);
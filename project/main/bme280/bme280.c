@@ -1,7 +1,9 @@
 #include "bme280.h"
 
 // ESP Macros
-#define CHECK(x) do { esp_err_t err; if ((err = ESP_ERROR_CHECK_WITHOUT_ABORT(x)) != ESP_OK) return err; } while (0)
+#define CHECK(x) do { esp_err_t err; if ((err = ESP_ERROR_CHECK_WITHOUT_ABORT(x)) != ESP_OK) { errorCount++; return err; } } while (0)
+
+static uint32_t errorCount = 0; // Failed I2C transactions since boot
 
 // Global Variables
 /**
@@ -476,4 +478,12 @@ esp_err_t bme280_read_mode(i2c_master_dev_handle_t sensorHandle, uint8_t* mode)
     *mode = rxBuf[0] & 0x3;
 
     return ESP_OK;
+}
+
+/**
+ * \brief Returns the number of failed I2C transactions since boot.
+ */
+uint32_t bme280_get_error_count()
+{
+    return errorCount;
 }
\ No newline at end of file
@@ -263,4 +263,9 @@ esp_err_t bme280_read_id(i2c_master_dev_handle_t sensorHandle, uint8_t* id);
  */
 esp_err_t bme280_read_mode(i2c_master_dev_handle_t sensorHandle, uint8_t* mode);
 
+/**
+ * \brief Returns the number of failed I2C transactions since boot.
+ */
+uint32_t bme280_get_error_count();
+
 #endif // __TEMP_SENSOR_BME280_H__INCLUDED__
\ No newline at end of file
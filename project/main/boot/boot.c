@@ -0,0 +1,87 @@
+#include "boot.h"
+
+#include <stdio.h>
+#include <inttypes.h>
+#include "freertos/event_groups.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+static const char *TAG = "boot";
+
+static const char *names[BOOT_PHASE_COUNT] = {
+    [BOOT_PHASE_NVS] = "nvs",
+    [BOOT_PHASE_SENSOR] = "sensor",
+    [BOOT_PHASE_FIRST_SAMPLE] = "first_sample",
+    [BOOT_PHASE_STORAGE] = "storage",
+    [BOOT_PHASE_WIFI_INIT] = "wifi_init",
+    [BOOT_PHASE_WIFI_ASSOCIATED] = "wifi_associated",
+    [BOOT_PHASE_WIFI_CONNECTED] = "wifi_connected",
+    [BOOT_PHASE_MQTT_CONNECTED] = "mqtt_connected",
+    [BOOT_PHASE_FIRST_PUBLISH] = "first_publish",
+    [BOOT_PHASE_TIME_SYNCED] = "time_synced",
+};
+
+static EventGroupHandle_t phases = NULL;
+static int64_t reached_us[BOOT_PHASE_COUNT];     // esp_timer time, 0 while not reached
+
+/*
+ * @brief Creates the phase event group. First thing in app_main(), before any stage starts.
+ */
+void boot_init(void)
+{
+    phases = xEventGroupCreate();
+}
+
+/*
+ * @brief Records the first time a phase is reached and releases the stages waiting for it.
+ *        Later calls for the same phase cost one load, so hot paths may call it.
+ */
+void boot_mark(boot_phase_t phase)
+{
+    if (reached_us[phase] != 0 || phases == NULL)
+        return;
+    reached_us[phase] = esp_timer_get_time();
+    xEventGroupSetBits(phases, 1 << phase);
+    ESP_LOGI(TAG, "%s at %" PRId64 " ms", names[phase], reached_us[phase] / 1000);
+
+    if (phase == BOOT_PHASE_FIRST_PUBLISH && reached_us[phase] > CONFIG_BOOT_FIRST_PUBLISH_BUDGET_MS * 1000LL)
+        ESP_LOGW(TAG, "First publish %" PRId64 " ms after reset, budget is %d ms",
+                 reached_us[phase] / 1000, CONFIG_BOOT_FIRST_PUBLISH_BUDGET_MS);
+}
+
+/*
+ * @brief Blocks until a phase is reached. Returns false on timeout.
+ */
+bool boot_wait(boot_phase_t phase, TickType_t timeout)
+{
+    return xEventGroupWaitBits(phases, 1 << phase, pdFALSE, pdTRUE, timeout) & (1 << phase);
+}
+
+/*
+ * @brief Time since reset at which a phase was reached, -1 while it is not.
+ */
+int64_t boot_phase_us(boot_phase_t phase)
+{
+    return reached_us[phase] != 0 ? reached_us[phase] : -1;
+}
+
+/*
+ * @brief Formats the timeline as one "boot" line protocol line, one field per phase
+ *        reached, in milliseconds since reset. Returns the length, 0 if nothing was reached.
+ */
+int boot_format(char *buf, int size)
+{
+    int len = snprintf(buf, size, "boot ");
+    int first = len;
+
+    for (int i = 0; i < BOOT_PHASE_COUNT && len < size; i++)
+    {
+        if (reached_us[i] == 0)
+            continue;
+        len += snprintf(buf + len, size - len, "%s%s_ms=%" PRId64 "i",
+                        len > first ? "," : "", names[i], reached_us[i] / 1000);
+    }
+    if (len >= size || len == first)
+        return 0;
+    return len;
+}
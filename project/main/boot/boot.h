@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_err.h"
+
+// Boot milestones, in the order they are expected. Each doubles as a dependency other
+// stages can wait for with boot_wait().
+typedef enum {
+    BOOT_PHASE_NVS,             // NVS ready
+    BOOT_PHASE_SENSOR,          // BME280 and display configured
+    BOOT_PHASE_FIRST_SAMPLE,    // First sample taken, held in RAM until storage is up
+    BOOT_PHASE_STORAGE,         // SPIFFS, history and backlog mounted
+    BOOT_PHASE_WIFI_INIT,       // Netif, event loop and Wi-Fi driver up
+    BOOT_PHASE_WIFI_ASSOCIATED, // Joined the access point
+    BOOT_PHASE_WIFI_CONNECTED,  // Got an IP address
+    BOOT_PHASE_MQTT_CONNECTED,  // Broker session established
+    BOOT_PHASE_FIRST_PUBLISH,   // First message handed to the broker
+    BOOT_PHASE_TIME_SYNCED,     // SNTP set the clock
+    BOOT_PHASE_COUNT,
+} boot_phase_t;
+
+void boot_init(void);
+void boot_mark(boot_phase_t phase);
+bool boot_wait(boot_phase_t phase, TickType_t timeout);
+int64_t boot_phase_us(boot_phase_t phase);
+int boot_format(char *buf, int size);
@@ -0,0 +1,231 @@
+#include "history.h"
+
+#include <inttypes.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_system.h"
+
+#include "../ringlog/ringlog.h"
+#include "../tscodec/tscodec.h"
+
+static const char *TAG = "history";
+
+static const esp_partition_t *partition = NULL;
+static SemaphoreHandle_t lock = NULL;
+static ringlog_t ring;
+
+#if CONFIG_HISTORY_COMPRESSED
+#define HISTORY_RECORD_SIZE (TSCODEC_BLOCK_SIZE + 1)
+
+// The block being filled lives in RTC memory so a software reset, panic or watchdog does
+// not lose the samples it holds; only a power loss does
+static RTC_NOINIT_ATTR uint32_t open_magic;
+static RTC_NOINIT_ATTR tscodec_block_t open_block;
+#else
+#define HISTORY_RECORD_SIZE (TSCODEC_RECORD_SIZE + 1)
+#endif
+
+static int flash_read(void *ctx, uint32_t offset, void *dst, uint32_t len)
+{
+    return esp_partition_read(ctx, offset, dst, len) == ESP_OK ? 0 : -1;
+}
+
+static int flash_write(void *ctx, uint32_t offset, const void *src, uint32_t len)
+{
+    return esp_partition_write(ctx, offset, src, len) == ESP_OK ? 0 : -1;
+}
+
+static int flash_erase(void *ctx, uint32_t offset, uint32_t len)
+{
+    return esp_partition_erase_range(ctx, offset, len) == ESP_OK ? 0 : -1;
+}
+
+static esp_err_t to_esp_err(int err)
+{
+    switch (err)
+    {
+    case RINGLOG_OK:          return ESP_OK;
+    case RINGLOG_ERR_RANGE:   return ESP_ERR_NOT_FOUND;
+    case RINGLOG_ERR_CRC:     return ESP_ERR_INVALID_CRC;
+    case RINGLOG_ERR_INVALID: return ESP_ERR_INVALID_SIZE;
+    default:                  return ESP_FAIL;
+    }
+}
+
+#if CONFIG_HISTORY_COMPRESSED
+/*
+ * @brief Keeps the open block of the previous run if RTC memory survived the reset and the
+ *        block still decodes.
+ */
+static void restore_open_block(void)
+{
+    if (esp_reset_reason() != ESP_RST_POWERON && esp_reset_reason() != ESP_RST_BROWNOUT &&
+        open_magic == HISTORY_RTC_MAGIC && open_block.len <= TSCODEC_BLOCK_SIZE &&
+        tscodec_block_decode(open_block.data, open_block.len, NULL, 0) == open_block.count)
+    {
+        ESP_LOGI(TAG, "Recovered %d samples from RTC memory", open_block.count);
+        return;
+    }
+    tscodec_block_init(&open_block);
+    open_magic = HISTORY_RTC_MAGIC;
+}
+
+// Called with the lock held
+static int write_open_block(void)
+{
+    if (open_block.count == 0)
+        return RINGLOG_OK;
+
+    int err = ringlog_append(&ring, open_block.data);
+    ESP_LOGI(TAG, "Wrote block of %d samples, %d bytes", open_block.count, open_block.len);
+    tscodec_block_init(&open_block);
+    return err;
+}
+#endif
+
+/*
+ * @brief Mounts the sample log kept on the raw "history" partition.
+ */
+esp_err_t history_init(void)
+{
+    partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY,
+                                         HISTORY_PARTITION_LABEL);
+    if (partition == NULL)
+    {
+        ESP_LOGE(TAG, "No \"" HISTORY_PARTITION_LABEL "\" partition");
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    lock = xSemaphoreCreateMutex();
+
+    const ringlog_flash_t flash = {
+        .ctx = (void *)partition,
+        .size = partition->size,
+        .read = flash_read,
+        .write = flash_write,
+        .erase = flash_erase,
+    };
+    int err = ringlog_mount(&ring, &flash, HISTORY_RECORD_SIZE);
+    if (err != RINGLOG_OK)
+    {
+        ESP_LOGE(TAG, "Failed to mount the log (%d)", err);
+        partition = NULL;
+        return to_esp_err(err);
+    }
+
+#if CONFIG_HISTORY_COMPRESSED
+    restore_open_block();
+#endif
+
+    ESP_LOGI(TAG, "%" PRIu32 " of %" PRIu32 " records in use", ringlog_count(&ring), ringlog_capacity(&ring));
+    return ESP_OK;
+}
+
+/*
+ * @brief Adds a sample. In compressed mode it is encoded into the open block, which is only
+ *        written to flash once full, so most calls do not touch the flash.
+ */
+esp_err_t history_append(const sample_t* sample)
+{
+    if (partition == NULL)
+        return ESP_ERR_INVALID_STATE;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+#if CONFIG_HISTORY_COMPRESSED
+    int err = RINGLOG_OK;
+    if (tscodec_block_add(&open_block, sample) != 0)
+    {
+        err = write_open_block();
+        tscodec_block_add(&open_block, sample);
+    }
+#else
+    uint8_t record[TSCODEC_RECORD_SIZE];
+    tscodec_pack_record(sample, record);
+    int err = ringlog_append(&ring, record);
+#endif
+    xSemaphoreGive(lock);
+
+    if (err != RINGLOG_OK)
+        ESP_LOGE(TAG, "Failed to append sample %" PRIu32 " (%d)", sample->seq, err);
+    return to_esp_err(err);
+}
+
+/*
+ * @brief Writes the open block to flash even if it is not full.
+ */
+esp_err_t history_flush(void)
+{
+    if (partition == NULL)
+        return ESP_ERR_INVALID_STATE;
+
+#if CONFIG_HISTORY_COMPRESSED
+    xSemaphoreTake(lock, portMAX_DELAY);
+    int err = write_open_block();
+    xSemaphoreGive(lock);
+    return to_esp_err(err);
+#else
+    return ESP_OK;
+#endif
+}
+
+/*
+ * @brief Number of readable positions: flash records, plus the open block if it holds samples.
+ */
+uint32_t history_records(void)
+{
+    if (partition == NULL)
+        return 0;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    uint32_t count = ringlog_count(&ring);
+#if CONFIG_HISTORY_COMPRESSED
+    if (open_block.count > 0)
+        count++;
+#endif
+    xSemaphoreGive(lock);
+    return count;
+}
+
+/*
+ * @brief Reads the samples of a position, 0 being the oldest kept. A fixed record holds one
+ *        sample, a block up to TSCODEC_BLOCK_MAX_SAMPLES. ESP_ERR_INVALID_CRC marks a record
+ *        torn by a power loss, which is to be skipped.
+ */
+esp_err_t history_read(uint32_t position, sample_t* samples, int max, int* count)
+{
+    if (partition == NULL)
+        return ESP_ERR_INVALID_STATE;
+
+    int err;
+    *count = 0;
+    xSemaphoreTake(lock, portMAX_DELAY);
+#if CONFIG_HISTORY_COMPRESSED
+    static uint8_t block[TSCODEC_BLOCK_SIZE];
+    if (position == ringlog_count(&ring) && open_block.count > 0)
+    {
+        *count = tscodec_block_decode(open_block.data, open_block.len, samples, max);
+        err = RINGLOG_OK;
+    }
+    else if ((err = ringlog_read(&ring, position, block)) == RINGLOG_OK)
+    {
+        *count = tscodec_block_decode(block, sizeof(block), samples, max);
+        if (*count < 0)
+        {
+            *count = 0;
+            err = RINGLOG_ERR_CRC;
+        }
+    }
+#else
+    uint8_t record[TSCODEC_RECORD_SIZE];
+    if ((err = ringlog_read(&ring, position, record)) == RINGLOG_OK && max > 0)
+    {
+        tscodec_unpack_record(record, samples);
+        *count = 1;
+    }
+#endif
+    xSemaphoreGive(lock);
+    return to_esp_err(err);
+}
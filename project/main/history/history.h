@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "../payload/payload.h"
+
+#define HISTORY_PARTITION_LABEL "history"
+#define HISTORY_RTC_MAGIC 0x48495354 // "HIST"
+
+esp_err_t history_init(void);
+esp_err_t history_append(const sample_t* sample);
+esp_err_t history_flush(void);
+uint32_t history_records(void);
+esp_err_t history_read(uint32_t position, sample_t* samples, int max, int* count);
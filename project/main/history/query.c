@@ -0,0 +1,253 @@
+#include "query.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+
+#include "history.h"
+#include "../mqtt/mqtt.h"
+#include "../mqtt/outbox.h"
+#include "../tscodec/tscodec.h"
+
+static const char *TAG = "history_query";
+
+typedef struct {
+    int64_t from;
+    int64_t to;
+    char id[HISTORY_QUERY_ID_LEN];
+} history_query_t;
+
+#if CONFIG_HISTORY_COMPRESSED
+#define POSITION_SAMPLES TSCODEC_BLOCK_MAX_SAMPLES
+#else
+#define POSITION_SAMPLES 1
+#endif
+
+static QueueHandle_t queue = NULL;
+static TaskHandle_t query_task = NULL;
+static volatile uint32_t done_ticket = 0;
+static volatile bool done_acked = false;
+
+static sample_t samples[POSITION_SAMPLES];
+static char chunk[OUTBOX_SLOT_SIZE];
+
+/*
+ * @brief Queues a request received on HISTORY_QUERY_TOPIC. Called from the MQTT event
+ *        handler, so it only parses.
+ */
+esp_err_t history_query_request(const char* data, int len)
+{
+    char text[64];
+    history_query_t query = { .id = "" };
+
+    if (queue == NULL)
+        return ESP_ERR_INVALID_STATE;
+    if (len <= 0 || len >= (int)sizeof(text))
+        return ESP_ERR_INVALID_ARG;
+    memcpy(text, data, len);
+    text[len] = '\0';
+
+    // The id is used as a tag value, so only plain characters (HISTORY_QUERY_ID_LEN - 1 of them)
+    if (sscanf(text, "%" SCNd64 " %" SCNd64 " %15[A-Za-z0-9_-]", &query.from, &query.to, query.id) < 2 ||
+        query.from > query.to)
+    {
+        ESP_LOGW(TAG, "Ignoring malformed query \"%s\"", text);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (xQueueSend(queue, &query, 0) != pdTRUE)
+    {
+        ESP_LOGW(TAG, "%d queries pending, dropping \"%s\"", HISTORY_QUERY_QUEUE_LEN, text);
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+/*
+ * @brief Timestamp of the first sample of the first readable position in [*position, end).
+ *        Positions torn by a power loss are skipped. Returns false when none is readable.
+ */
+static bool first_timestamp(uint32_t* position, uint32_t end, int64_t* timestamp)
+{
+    for (; *position < end; (*position)++)
+    {
+        int count;
+        if (history_read(*position, samples, 1, &count) == ESP_OK && count > 0)
+        {
+            *timestamp = samples[0].timestamp;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * @brief Binary search for the last position starting at or before `from`, the first one
+ *        that can hold samples of the range. Positions are appended in time order, so this
+ *        reads log2(records) positions, one sample each.
+ */
+static uint32_t locate(int64_t from, uint32_t records)
+{
+    uint32_t lo = 0, hi = records;
+
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        uint32_t probe = mid;
+        int64_t timestamp;
+
+        if (first_timestamp(&probe, hi, &timestamp) && timestamp <= from)
+            lo = probe + 1;
+        else
+            hi = mid;
+    }
+    return lo > 0 ? lo - 1 : 0;
+}
+
+static void on_done(uint32_t ticket, bool acked, void *ctx)
+{
+    done_acked = acked;
+    done_ticket = ticket;
+    xTaskNotifyGive(query_task);
+}
+
+/*
+ * @brief Publishes one reply chunk and waits for the broker to acknowledge it, so a query
+ *        holds one outbox slot at most and never reads ahead of what the link carries.
+ */
+static bool send_chunk(const char* data, int len)
+{
+    if (!mqtt_is_connected())
+        return false;
+
+    uint32_t ticket = outbox_publish(HISTORY_REPLY_TOPIC, data, len, portMAX_DELAY, on_done, NULL);
+    if (ticket == 0)
+        return false;
+
+    while (done_ticket != ticket)
+    {
+        // The outbox keeps retrying across a reconnect; the requester asks again instead
+        if (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(1000)) == 0 && !mqtt_is_connected())
+            return false;
+    }
+    if (!done_acked)
+        return false;
+
+    vTaskDelay(pdMS_TO_TICKS(CONFIG_HISTORY_QUERY_CHUNK_INTERVAL_MS));
+    return true;
+}
+
+/*
+ * @brief Streams the samples of [from, to] as line protocol chunks of up to OUTBOX_SLOT_SIZE
+ *        bytes, then a status line.
+ *
+ *  The resume point is the timestamp after the last sample sent, positions only cache it:
+ *  when the number of records changes (a block written, the oldest sector recycled) the
+ *  position is looked up again.
+ */
+static void run_query(const history_query_t* query)
+{
+    int64_t next = query->from;
+    uint32_t records = history_records();
+    uint32_t position = locate(next, records);
+    uint32_t sent = 0, chunks = 0, bytes = 0;
+    int len = 0;
+    bool done = false;
+
+    ESP_LOGI(TAG, "Query %s: %" PRId64 " to %" PRId64 " from position %" PRIu32 " of %" PRIu32,
+             query->id, query->from, query->to, position, records);
+
+    while (!done && position < records)
+    {
+        int count;
+        esp_err_t err = history_read(position++, samples, POSITION_SAMPLES, &count);
+        if (err == ESP_ERR_NOT_FOUND)
+            break;
+        if (err != ESP_OK)
+            continue;
+
+        for (int i = 0; i < count && !done; i++)
+        {
+            if (samples[i].timestamp < next)
+                continue;
+            if (samples[i].timestamp > query->to)
+            {
+                done = true;
+                break;
+            }
+
+            int n = payload_encode_line(&samples[i], chunk + len, sizeof(chunk) - len);
+            if (n < 0 || len + n + 1 > (int)sizeof(chunk))
+            {
+                // Full: send what is there and start the next chunk with this sample
+                if (len == 0 || !send_chunk(chunk, len - 1))
+                {
+                    ESP_LOGW(TAG, "Query %s aborted after %" PRIu32 " samples", query->id, sent);
+                    return;
+                }
+                chunks++;
+                bytes += len - 1;
+                len = 0;
+                n = payload_encode_line(&samples[i], chunk, sizeof(chunk));
+                if (n < 0)
+                    continue;
+            }
+            len += n;
+            chunk[len++] = '\n';
+            next = samples[i].timestamp + 1;
+            sent++;
+        }
+
+        uint32_t now = history_records();
+        if (now != records)
+        {
+            records = now;
+            position = locate(next, records);
+        }
+    }
+
+    if (len > 0)
+    {
+        if (!send_chunk(chunk, len - 1))
+        {
+            ESP_LOGW(TAG, "Query %s aborted after %" PRIu32 " samples", query->id, sent);
+            return;
+        }
+        chunks++;
+        bytes += len - 1;
+    }
+
+    len = snprintf(chunk, sizeof(chunk), "history_query%s%s samples=%" PRIu32 "i,chunks=%" PRIu32 "i"
+                   ",bytes=%" PRIu32 "i,from=%" PRId64 "i,to=%" PRId64 "i",
+                   query->id[0] ? ",id=" : "", query->id, sent, chunks, bytes, query->from, query->to);
+    send_chunk(chunk, len);
+    ESP_LOGI(TAG, "Query %s: %" PRIu32 " samples in %" PRIu32 " chunks", query->id, sent, chunks);
+}
+
+static void history_query_task(void *arg)
+{
+    history_query_t query;
+
+    while (1)
+    {
+        if (xQueueReceive(queue, &query, portMAX_DELAY) == pdTRUE)
+            run_query(&query);
+    }
+}
+
+/*
+ * @brief Starts the task answering range queries. Requests arriving before are refused.
+ */
+esp_err_t history_query_init(void)
+{
+    queue = xQueueCreate(HISTORY_QUERY_QUEUE_LEN, sizeof(history_query_t));
+    if (queue == NULL)
+        return ESP_ERR_NO_MEM;
+    if (xTaskCreate(history_query_task, "history_query", 4096, NULL, tskIDLE_PRIORITY + 1, &query_task) != pdPASS)
+        return ESP_ERR_NO_MEM;
+    return ESP_OK;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+
+// Request: "<from ms> <to ms> [id]", epoch milliseconds, both ends included
+#define HISTORY_QUERY_TOPIC "history/query"
+// Reply: line protocol chunks of weather samples, then one history_query status line
+#define HISTORY_REPLY_TOPIC "history/reply"
+#define HISTORY_QUERY_QUEUE_LEN 4
+#define HISTORY_QUERY_ID_LEN 16
+
+esp_err_t history_query_init(void);
+esp_err_t history_query_request(const char* data, int len);
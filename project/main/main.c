@@ -2,10 +2,22 @@
 #include "esp_timer.h"
 #include "wifi/wifi.h"
 #include "mqtt/mqtt.h"
+#include "mqtt/outbox.h"
+#include "mqtt/publisher.h"
 #include "forecast/forecast.h"
 #include "bin7seg/bin7seg.h"
+#include "bin7seg/display_pm.h"
 #include "sntp/sntp.h"
 #include "spiffs/spiffs.h"
+#include "payload/payload.h"
+#include "backlog/backlog.h"
+#include "history/history.h"
+#include "history/query.h"
+#include "metrics/metrics.h"
+#include "boot/boot.h"
+#include "radio/radio.h"
+#include "freertos/queue.h"
+#include "nvs_flash.h"
 #include <string.h>
 
 #define SPIFFS_FILE_PATH "/spiffs/data.txt"
@@ -26,11 +38,20 @@
         }                                                       \
     } while (0)
 
+#define SENSOR_PERIOD_US 60000000 // 1 min
+
+#define TOPIC(t) t, sizeof(t) - 1
+
 #define publish(topic, x)                                       \
     do                                                          \
     {                                                           \
-        snprintf(aux, 7, "%5.2f", x);                           \
-        mqtt_publish(topic, aux);                               \
+        publisher_buf_t *buf = publisher_get();                 \
+        if (buf == NULL) {                                      \
+            ESP_LOGW("MAIN", "No publish buffer for " topic);   \
+            break;                                              \
+        }                                                       \
+        int n = snprintf(buf->data, PUBLISHER_BUF_SIZE, "%.2f", x); \
+        publisher_send(buf, TOPIC(topic), n, 0);                \
     } while (0)
 
 
@@ -42,8 +63,42 @@ i2c_master_dev_handle_t sensorHandle;   // I2C device handle
 bme280_comp_data_t sensorData;          // Sensor data
 char forecastData[40];                  // Forecast data
 char forecastToDisplay[7];              // Forecast to display
+int forecastCode = 0;                   // Zambretti index of the last forecast
+sample_t sample;                        // Last sample, stamped at acquisition
+metrics_timer_t sensorWatch = {.name = "sensor", .period_us = SENSOR_PERIOD_US};
 FILE* f;                                // File pointer
 
+#define PENDING_SAMPLES 64             // Samples held until the clock is synced
+#define REPORT_PRINT 0x01             // report_task() notification bits
+#define REPORT_STORE 0x02
+#define REPORT_PUBLISH 0x04
+#define REPORT_SAMPLE 0x08
+#define SAMPLE_QUEUE_LEN 4             // Samples waiting for report_task() to store them
+
+// Samples taken before the first SNTP sync, with their esp_timer acquisition time
+static sample_t pending[PENDING_SAMPLES];
+static int64_t pendingUs[PENDING_SAMPLES];
+static int pendingCount = 0;
+
+// A sample handed from the sensor callback to report_task()
+typedef struct {
+    sample_t sample;
+    int64_t acquiredUs;
+} acquired_t;
+
+static TaskHandle_t reportTask = NULL;
+static QueueHandle_t sampleQueue = NULL;        // Samples on their way to history and the broker
+#if CONFIG_RADIO_BATCH_SAMPLES > 1
+static QueueHandle_t batchQueue = NULL;        // Samples waiting for the next transmit window
+#endif
+static esp_timer_handle_t sensorTimer = NULL;
+static int64_t sensorPeriodUs = SENSOR_PERIOD_US;   // In esp_timer time, drift corrected
+
+static const char* sampleTime(const sample_t* s)
+{
+    return s->timestamp >= 0 ? getTimestamp(s->timestamp) : "  clock not synced ";
+}
+
 void print_data()
 {
     printf("\033[H\033[J"); // Clear the screen
@@ -54,7 +109,7 @@ void print_data()
           \r| Humidity   :%35.2f %%RH |\n\
           \r| Forecast   :%39s |\n\
           \r+-----------------------------------------------------+\n", 
-            getTimestamp(),
+            sampleTime(&sample),
             sensorData.temperature, sensorData.pressure, sensorData.humidity,
             forecastData
           );
@@ -63,55 +118,217 @@ void print_data()
 
 void fprint_data()
 {
+    spiffsWriteBegin();
     f = fopen(SPIFFS_FILE_PATH, "w");
     if (f == NULL) {
+        spiffsWriteEnd(false);
         ESP_LOGE("SPIFFS", "Failed to open file for writing");
         return;
     }
 
     // print is done this way as spiffs is not real-time with the printf
     // it is also done this way to reduce space usage
-    fprintf(f, "TS:%s\n\
+    int printed = fprintf(f, "TS:%s\n\
               \rT:%8.2f\t *C\n\
               \rP:%8.2f\thPa\n\
               \rH:%8.2f\t%%RH\n\
               \rF:%s\n", 
-                getTimestamp(),
+                sampleTime(&sample),
                 sensorData.temperature, sensorData.pressure, sensorData.humidity,
                 forecastData
            );
-    fclose(f);
+    bool closed = fclose(f) == 0;
+    spiffsWriteEnd(printed > 0 && closed);
+}
+
+static void publish_batch(void);
+static void process_samples(void);
+
+/*
+ * @brief Console dashboard, SPIFFS snapshot, sample storage and publishes, done here rather
+ *        than in the esp_timer task where the display multiplexing runs.
+ */
+static void report_task(void *arg)
+{
+    uint32_t requests;
+
+    while (1)
+    {
+        xTaskNotifyWait(0, UINT32_MAX, &requests, portMAX_DELAY);
+        if (requests & REPORT_PRINT)
+            print_data();
+        if (requests & REPORT_STORE)
+        {
+            fprint_data();
+            ESP_LOGI("MAIN", "SPIFFS USED %d", spiffsUsedSpace());
+        }
+        if (requests & REPORT_SAMPLE)
+            process_samples();
+        if (requests & REPORT_PUBLISH)
+            publish_batch();
+    }
+}
+
+void post_data(const sample_t* s)
+{
+#if CONFIG_TELEMETRY_FORMAT_TOPICS
+    publish(TEMP_TOPIC, s->temperature);
+    publish(PRESS_TOPIC, s->pressure);
+    publish(HUM_TOPIC, s->humidity);
+    if (publisher_send_copy(TOPIC(FORECAST_TOPIC), forecastData, strlen(forecastData), 0) != ESP_OK)
+        ESP_LOGW("MAIN", "No publish buffer for " FORECAST_TOPIC);
+#else
+#if CONFIG_TELEMETRY_FORMAT_CBOR
+    const payload_format_t format = PAYLOAD_FORMAT_CBOR;
+#else
+    const payload_format_t format = PAYLOAD_FORMAT_LINE;
+#endif
+    uint8_t payload[PAYLOAD_MAX_LEN];
+    int len = payload_encode(format, s, payload, sizeof(payload));
+    if (len < 0) {
+        ESP_LOGE("MAIN", "Sample %" PRIu32 " does not fit the payload buffer", s->seq);
+        return;
+    }
+    const char *topic = payload_topic(format);
+    // Runs in report_task: a QoS 1 publish goes out on the socket. A sample that cannot be
+    // queued goes to the backlog
+#if CONFIG_MQTT_TELEMETRY_QOS1
+    if (outbox_publish(topic, (char*)payload, len, 0, NULL, NULL) == 0)
+        backlog_push(s);
+#else
+    if (publisher_send_copy(topic, strlen(topic), payload, len, 0) != ESP_OK)
+        backlog_push(s);
+#endif
+#endif
 }
 
-void post_data()
+/*
+ * @brief Publishes the samples held for this transmit window. Runs in report_task, below the
+ *        publisher task, so each message is moved on before the next takes a buffer.
+ */
+static void publish_batch(void)
 {
-    char aux[7];
-    publish(TEMP_TOPIC, sensorData.temperature);
-    publish(PRESS_TOPIC, sensorData.pressure);
-    publish(HUM_TOPIC, sensorData.humidity);
-    mqtt_publish(FORECAST_TOPIC, forecastData);
+#if CONFIG_RADIO_BATCH_SAMPLES > 1
+    sample_t s;
+    while (xQueueReceive(batchQueue, &s, 0) == pdTRUE)
+    {
+        // The connection may have dropped since the sample was queued
+        if (mqtt_is_connected())
+            post_data(&s);
+        else
+            backlog_push(&s);
+    }
+#endif
 }
 
-void flush_data()
+void flush_data(const sample_t* s)
 {
     static int iter = 0;
 
     if (mqtt_is_connected())
-        post_data();
+    {
+#if CONFIG_RADIO_BATCH_SAMPLES > 1
+        // Published CONFIG_RADIO_BATCH_SAMPLES at a time, in one radio window
+        if (xQueueSend(batchQueue, s, 0) != pdTRUE)
+            backlog_push(s);
+        else if (uxQueueMessagesWaiting(batchQueue) >= CONFIG_RADIO_BATCH_SAMPLES)
+            xTaskNotify(reportTask, REPORT_PUBLISH, eSetBits);
+#else
+        post_data(s);
+#endif
+    }
 
     else if (spiffsUsedSpace() < 90){
+        // Every sample is queued so the series can be replayed on reconnect
+        backlog_push(s);
+
         if (++iter == MINUTES_BETWEEN_STORING_DATA){
-            fprint_data();
+            xTaskNotify(reportTask, REPORT_STORE, eSetBits);
             iter = 0;
-            ESP_LOGI("MAIN", "SPIFFS USED %d", spiffsUsedSpace());
         }
     }
 }
 
+/*
+ * @brief Sends a dated sample down the usual paths: history, then live publish or backlog.
+ */
+static void store_sample(const sample_t* s)
+{
+    // Every sample goes to the on-flash history, connected or not
+    history_append(s);
+    flush_data(s);
+}
+
+/*
+ * @brief Dates and stores the samples held while the clock was unknown, oldest first, so
+ *        history stays in time order.
+ */
+static void release_pending(void)
+{
+    for (int i = 0; i < pendingCount; i++)
+    {
+        pending[i].timestamp = clockToEpochMs(pendingUs[i]);
+        store_sample(&pending[i]);
+    }
+    if (pendingCount > 0)
+        ESP_LOGI("MAIN", "Dated %d samples taken before the clock was synced", pendingCount);
+    pendingCount = 0;
+}
+
+/*
+ * @brief Holds a sample until its acquisition time can be converted to epoch time. When
+ *        the clock stays unknown for PENDING_SAMPLES periods, the oldest is stored with the
+ *        unsynced system time instead, as before timestamps were taken at acquisition.
+ */
+static void hold_sample(const sample_t* s, int64_t acquiredUs)
+{
+    if (pendingCount == PENDING_SAMPLES)
+    {
+        pending[0].timestamp = getEpochMs() - (esp_timer_get_time() - pendingUs[0]) / 1000;
+        store_sample(&pending[0]);
+        memmove(pending, pending + 1, (PENDING_SAMPLES - 1) * sizeof(pending[0]));
+        memmove(pendingUs, pendingUs + 1, (PENDING_SAMPLES - 1) * sizeof(pendingUs[0]));
+        pendingCount--;
+    }
+    pending[pendingCount] = *s;
+    pendingUs[pendingCount++] = acquiredUs;
+}
+
+/*
+ * @brief Dates and stores the samples queued by the sensor callback. Runs in report_task,
+ *        so the ring log append (and its sector erase) and the publish never hold up the
+ *        esp_timer task.
+ */
+static void process_samples(void)
+{
+    acquired_t a;
+
+    while (xQueueReceive(sampleQueue, &a, 0) == pdTRUE)
+    {
+        // The first sample of a boot is taken before the flash is mounted
+        if (a.sample.timestamp < 0 || !boot_wait(BOOT_PHASE_STORAGE, 0))
+        {
+            hold_sample(&a.sample, a.acquiredUs);
+        }
+        else
+        {
+            release_pending();
+            store_sample(&a.sample);
+        }
+    }
+
+    // Held only until storage was up, with the clock kept across the reset
+    if (pendingCount > 0 && boot_wait(BOOT_PHASE_STORAGE, 0) && clockToEpochMs(esp_timer_get_time()) >= 0)
+        release_pending();
+}
+
 static void callback_sensor(void *arg)
 {
     static int sensorReadIteration = 0; 
     static int forecastReady = 1;   // Flag to indicate if the forecast is ready to be computed
+    static uint32_t seq = 0;        // Sample sequence number
+
+    metrics_timer_check(&sensorWatch);
 
     CHECK(bme280_set_mode(sensorHandle, MODE_FORCED));
 
@@ -124,6 +341,7 @@ static void callback_sensor(void *arg)
     vTaskDelay(10 / portTICK_PERIOD_MS); // Wait for the sensor to have the new data
 
     CHECK(bme280_read_data(sensorHandle, &sensorData));
+    int64_t acquiredUs = esp_timer_get_time();
 
     if (forecastReady)
     {
@@ -134,29 +352,42 @@ static void callback_sensor(void *arg)
                                              forecastIndex), 40); 
         
         memcpy(forecastToDisplay, getWeatherState(*forecastIndex), 7);
+        forecastCode = *forecastIndex;
         
         forecastReady = 0;
+
+        // New forecast: light the display for a while in on-demand mode
+        display_pm_show(CONFIG_DISPLAY_SHOW_DURATION_S);
     }
 
-    print_data();
+    display_pm_update();
 
-    flush_data();
-}
+    // Stamped with the acquisition time; -1 until the clock is synced
+    sample.timestamp = clockToEpochMs(acquiredUs);
+    sample.seq = seq++;
+    sample.temperature = sensorData.temperature;
+    sample.pressure = sensorData.pressure;
+    sample.humidity = sensorData.humidity;
+    sample.forecast = forecastCode;
 
-static void callback_display(void *arg)
-{
-    static int iter = 0, timer = 0;
-    char substring[2];
-    if (timer++ == 100)
+    acquired_t a = {.sample = sample, .acquiredUs = acquiredUs};
+    if (xQueueSend(sampleQueue, &a, 0) == pdTRUE)
+        xTaskNotify(reportTask, REPORT_SAMPLE | REPORT_PRINT, eSetBits);
+    else
     {
-        timer = 0;
-        iter++;
+        ESP_LOGW("MAIN", "Sample queue full, sample %" PRIu32 " lost", sample.seq);
+        xTaskNotify(reportTask, REPORT_PRINT, eSetBits);
+    }
+    boot_mark(BOOT_PHASE_FIRST_SAMPLE);
+
+    // Keep one sample per wall clock minute as the drift estimate improves
+    int64_t period = clockLocalPeriodUs(SENSOR_PERIOD_US);
+    if (period != sensorPeriodUs && sensorTimer != NULL)
+    {
+        esp_timer_restart(sensorTimer, period);
+        sensorPeriodUs = period;
+        sensorWatch.period_us = period;
     }
-    int str_len = strlen(forecastToDisplay);
-    iter %= str_len;
-    substring[0] = forecastToDisplay[iter];
-    substring[1] = forecastToDisplay[(iter + 1) % str_len];
-    displayStatus(substring);
 }
 
 void start_timers()
@@ -164,35 +395,99 @@ void start_timers()
     const esp_timer_create_args_t periodic_timer_args_sensor = {
         .callback = &callback_sensor,
         .name = "sensor"};
-    esp_timer_handle_t periodic_timer_sensor;
-
-    const esp_timer_create_args_t periodic_timer_args_display = {
-        .callback = &callback_display,
-        .name = "display"};
-    esp_timer_handle_t periodic_timer_display;
 
-    ESP_ERROR_CHECK(esp_timer_create(&periodic_timer_args_sensor, &periodic_timer_sensor));
-    ESP_ERROR_CHECK(esp_timer_create(&periodic_timer_args_display, &periodic_timer_display));
-    ESP_ERROR_CHECK(esp_timer_start_periodic(periodic_timer_sensor, 60000000)); // 1 min
-    ESP_ERROR_CHECK(esp_timer_start_periodic(periodic_timer_display, 10000)); // 10 ms
+    ESP_ERROR_CHECK(esp_timer_create(&periodic_timer_args_sensor, &sensorTimer));
+    ESP_ERROR_CHECK(esp_timer_start_periodic(sensorTimer, SENSOR_PERIOD_US));
+    metrics_timer_register(&sensorWatch);
 }
 
-void app_main(void)
+/*
+ * @brief Network stage, run in its own task so nothing on the sampling path waits for it.
+ *        Wi-Fi association, the MQTT session and SNTP proceed concurrently: the MQTT and
+ *        SNTP clients both start on their own once the station has an address.
+ */
+static void network_task(void *arg)
 {
     wifi_init();
-    wifi_start();
+    radio_init(SENSOR_PERIOD_US / 1000000 * CONFIG_RADIO_BATCH_SAMPLES);
+    boot_mark(BOOT_PHASE_WIFI_INIT);
+
+    // The MQTT event handler feeds the backlog and the history queries
+    boot_wait(BOOT_PHASE_STORAGE, portMAX_DELAY);
     mqtt_init();
     time_init();
-    init_spiffs(f, SPIFFS_FILE_PATH);
 
+    wifi_start();
+
+    vTaskDelete(NULL);
+}
+
+/*
+ * @brief Sensor stage, ahead of storage so the first sample does not wait for SPIFFS and
+ *        the history partition to mount. Returns false if the BME280 cannot be used.
+ */
+static bool init_sensor(void)
+{
     configure_io_ports();
 
     setupDisplayOnStart();
 
     // Configure the sensor
-    CHECK(bme280_init(&busHandle, &sensorHandle, SENSOR_ADDR, SDA_PIN, SCL_PIN, CLK_SPEED_HZ));
+    if (ESP_ERROR_CHECK_WITHOUT_ABORT(bme280_init(&busHandle, &sensorHandle, SENSOR_ADDR, SDA_PIN, SCL_PIN, CLK_SPEED_HZ)) != ESP_OK ||
+        ESP_ERROR_CHECK_WITHOUT_ABORT(bme280_default_setup(sensorHandle)) != ESP_OK)
+        return false;
+
+    display_pm_init(forecastToDisplay);
+    boot_mark(BOOT_PHASE_SENSOR);
+    return true;
+}
+
+static void init_nvs(void)
+{
+    esp_err_t ret = nvs_flash_init();
+    if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND)
+    {
+        ESP_ERROR_CHECK(nvs_flash_erase());
+        ret = nvs_flash_init();
+    }
+    ESP_ERROR_CHECK(ret);
+    boot_mark(BOOT_PHASE_NVS);
+}
+
+void app_main(void)
+{
+    boot_init();
+    init_nvs();
+
+    xTaskCreate(network_task, "boot_network", 4096, NULL, tskIDLE_PRIORITY + 2, NULL);
+
+    bool sensorReady = init_sensor();
+
+#if CONFIG_RADIO_BATCH_SAMPLES > 1
+    batchQueue = xQueueCreate(2 * CONFIG_RADIO_BATCH_SAMPLES, sizeof(sample_t));
+#endif
+    sampleQueue = xQueueCreate(SAMPLE_QUEUE_LEN, sizeof(acquired_t));
+    // QoS 1 publishes write to the socket, through TLS when enabled
+    xTaskCreate(report_task, "report", 4096, NULL, tskIDLE_PRIORITY + 1, &reportTask);
+
+    // First sample now rather than one period after boot; it stays in RAM until storage is up
+    if (sensorReady)
+        callback_sensor(NULL);
+
+    // Local stages: only flash, bounded time
+    init_spiffs(f, SPIFFS_FILE_PATH);
+    history_init();
+    history_query_init();
+    backlog_init();
+    boot_mark(BOOT_PHASE_STORAGE);
+
+    // The first sample was held for storage: report_task stores it now if the clock is
+    // already dated, otherwise with the first sample after the SNTP sync
+    xTaskNotify(reportTask, REPORT_SAMPLE, eSetBits);
 
-    CHECK(bme280_default_setup(sensorHandle));
+    metrics_init();
+    ota_init();
 
-    start_timers();
+    if (sensorReady)
+        start_timers();
 }
@@ -0,0 +1,264 @@
+#include "metrics.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "esp_heap_caps.h"
+#include "esp_spiffs.h"
+
+#include "../mqtt/mqtt.h"
+#include "../mqtt/outbox.h"
+#include "../mqtt/publisher.h"
+#include "../mqtt/reconnect.h"
+#include "../wifi/wifi.h"
+#include "../bme280/bme280.h"
+#include "../backlog/backlog.h"
+#include "../spiffs/spiffs.h"
+#include "../boot/boot.h"
+#include "../sntp/sntp.h"
+#include "../radio/radio.h"
+
+#define METRICS_MAX_TASKS 20
+
+static const char *TAG = "metrics";
+
+static char buf[METRICS_BUF_SIZE];
+static metrics_timer_t *timers[METRICS_MAX_TIMERS];
+static int timer_count = 0;
+
+#if CONFIG_FREERTOS_USE_TRACE_FACILITY
+static TaskStatus_t tasks[METRICS_MAX_TASKS];
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+// Run time counters of the previous collection, to report the share of the last interval
+typedef struct {
+    UBaseType_t number;
+    uint32_t runtime;
+} task_runtime_t;
+static task_runtime_t prev_tasks[METRICS_MAX_TASKS], cur_tasks[METRICS_MAX_TASKS];
+static int prev_count = 0;
+static uint32_t prev_total = 0;
+#endif
+#endif
+
+/*
+ * @brief Registers a timer so its overrun count is part of the metrics message.
+ */
+void metrics_timer_register(metrics_timer_t *timer)
+{
+    if (timer_count < METRICS_MAX_TIMERS)
+        timers[timer_count++] = timer;
+    else
+        ESP_LOGW(TAG, "No room to watch timer %s", timer->name);
+}
+
+/*
+ * @brief Call first thing in the timer callback. Costs one esp_timer_get_time().
+ */
+void metrics_timer_check(metrics_timer_t *timer)
+{
+    int64_t now = esp_timer_get_time();
+    if (timer->last_us != 0 && now - timer->last_us > timer->period_us + timer->period_us / 2)
+        timer->overruns++;
+    timer->last_us = now;
+}
+
+/*
+ * @brief Forgets the previous run, e.g. when the timer is restarted after being stopped.
+ */
+void metrics_timer_reset(metrics_timer_t *timer)
+{
+    timer->last_us = 0;
+}
+
+/*
+ * @brief Appends to the buffer, keeping *len at the end of what fit.
+ */
+static void append(char *out, int size, int *len, const char *fmt, ...)
+{
+    if (*len >= size)
+        return;
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(out + *len, size - *len, fmt, args);
+    va_end(args);
+    if (n < 0 || n >= size - *len) {
+        // Drop the truncated line so the message stays valid line protocol
+        while (*len > 0 && out[*len - 1] != '\n')
+            (*len)--;
+        out[*len] = '\0';
+        *len = size;
+        return;
+    }
+    *len += n;
+}
+
+/*
+ * @brief Copies a tag value escaping the characters line protocol reserves.
+ */
+static const char *escape_tag(const char *in, char *out, int size)
+{
+    int j = 0;
+    for (int i = 0; in[i] != '\0' && j < size - 2; i++) {
+        if (in[i] == ' ' || in[i] == ',' || in[i] == '=')
+            out[j++] = '\\';
+        out[j++] = in[i];
+    }
+    out[j] = '\0';
+    return out;
+}
+
+static void collect_tasks(char *out, int size, int *len)
+{
+#if CONFIG_FREERTOS_USE_TRACE_FACILITY
+    char name[2 * configMAX_TASK_NAME_LEN];
+    uint32_t total = 0;
+    UBaseType_t count = uxTaskGetSystemState(tasks, METRICS_MAX_TASKS, &total);
+    if (count == 0) {
+        ESP_LOGW(TAG, "More than %d tasks, skipping task metrics", METRICS_MAX_TASKS);
+        return;
+    }
+
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+    uint32_t elapsed = total - prev_total;
+#endif
+    for (UBaseType_t i = 0; i < count; i++) {
+        append(out, size, len, "task,name=%s stack_free=%" PRIu32 "i",
+               escape_tag(tasks[i].pcTaskName, name, sizeof(name)),
+               (uint32_t)tasks[i].usStackHighWaterMark);
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+        uint32_t runtime = tasks[i].ulRunTimeCounter;
+        uint32_t previous = 0;
+        for (int j = 0; j < prev_count; j++) {
+            if (prev_tasks[j].number == tasks[i].xTaskNumber) {
+                previous = prev_tasks[j].runtime;
+                break;
+            }
+        }
+        // First collection: share since boot
+        if (prev_total != 0 && elapsed != 0)
+            append(out, size, len, ",cpu=%.2f", 100.0f * (runtime - previous) / elapsed);
+        else if (total != 0)
+            append(out, size, len, ",cpu=%.2f", 100.0f * runtime / total);
+        cur_tasks[i].number = tasks[i].xTaskNumber;
+        cur_tasks[i].runtime = runtime;
+#endif
+        append(out, size, len, "\n");
+    }
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+    memcpy(prev_tasks, cur_tasks, count * sizeof(task_runtime_t));
+    prev_count = count;
+    prev_total = total;
+#endif
+#endif
+}
+
+/*
+ * @brief Formats the metrics as InfluxDB line protocol, one line per measurement.
+ *
+ *  Timestamps are left to Telegraf. Returns the message length.
+ */
+int metrics_collect(char *out, int size)
+{
+    int len = 0;
+    size_t spiffs_total = 0, spiffs_used = 0;
+    esp_spiffs_info(NULL, &spiffs_total, &spiffs_used);
+
+    outbox_stats_t outbox;
+    outbox_get_stats(&outbox);
+    publisher_stats_t publisher;
+    publisher_get_stats(&publisher);
+    reconnect_stats_t reconnect;
+    reconnect_get_stats(&reconnect);
+    backlog_stats_t backlog;
+    backlog_get_stats(&backlog);
+
+    append(out, size, &len,
+           "health free_heap=%" PRIu32 "i,min_free_heap=%" PRIu32 "i,uptime_s=%" PRId64 "i"
+           ",rssi=%di,wifi_reconnects=%" PRIu32 "i,i2c_errors=%" PRIu32 "i"
+           ",spiffs_used=%ui,spiffs_total=%ui,spiffs_mount_us=%" PRIu32 "i"
+           ",mqtt_outbox_bytes=%di,mqtt_reconnects=%" PRIu32 "i"
+           ",outbox_inflight=%" PRIu32 "i,outbox_dropped=%" PRIu32 "i"
+           ",publisher_exhausted=%" PRIu32 "i,publisher_failures=%" PRIu32 "i"
+           ",backlog_pending=%" PRIu32 "i,backlog_samples=%" PRIu32 "i,backlog_writes=%" PRIu32 "i"
+           ",backlog_bytes=%" PRIu32 "i,backlog_write_max_us=%" PRIu32 "i\n",
+           esp_get_free_heap_size(), esp_get_minimum_free_heap_size(),
+           esp_timer_get_time() / 1000000,
+           wifi_get_rssi(), wifi_get_reconnect_count(), bme280_get_error_count(),
+           (unsigned)spiffs_used, (unsigned)spiffs_total, spiffsMountTimeUs(),
+           mqtt_outbox_size(), reconnect.reconnects,
+           outbox.occupancy, outbox.dropped,
+           publisher.pool_exhausted, publisher.send_failures,
+           backlog_pending(), backlog.samples, backlog.writes,
+           backlog.bytes, backlog.write_max_us);
+
+    clock_stats_t clock;
+    clockGetStats(&clock);
+    append(out, size, &len,
+           "clock syncs=%" PRIu32 "i,poll_s=%" PRIu32 "i,drift_ppb=%" PRId32 "i,residual_us=%" PRId64 "i\n",
+           clock.syncs, clock.pollIntervalS, clock.driftPpb, clock.lastResidualUs);
+
+    wifi_connect_stats_t wifi;
+    wifi_get_connect_stats(&wifi);
+    append(out, size, &len,
+           "wifi connect_ms=%" PRIu32 "i,assoc_to_ip_ms=%" PRIu32 "i,fast=%s,fast_fallbacks=%" PRIu32 "i\n",
+           wifi.connect_ms, wifi.assoc_to_ip_ms, wifi.fast ? "true" : "false", wifi.fast_fallbacks);
+
+    radio_stats_t radio;
+    radio_get_stats(&radio);
+    append(out, size, &len,
+           "radio windows=%" PRIu32 "i,window_last_ms=%" PRIu32 "i,window_max_ms=%" PRIu32 "i"
+           ",cut_short=%" PRIu32 "i,on_ms_per_hour=%" PRIu32 "i,listen_interval=%" PRIu32 "i\n",
+           radio.windows, radio.window_last_ms, radio.window_max_ms,
+           radio.cut_short, radio.on_ms_per_hour, radio.listen_interval);
+
+    for (int i = 0; i < timer_count; i++)
+        append(out, size, &len, "timer,name=%s overruns=%" PRIu32 "i\n",
+               timers[i]->name, timers[i]->overruns);
+
+    // The boot timeline is sent again only when it gained phases
+    static int boot_len = 0;
+    char boot[256];
+    int n = boot_format(boot, sizeof(boot));
+    if (n != boot_len)
+    {
+        append(out, size, &len, "%s\n", boot);
+        boot_len = n;
+    }
+
+    collect_tasks(out, size, &len);
+
+    return len < size ? len : (int)strlen(out);
+}
+
+static void metrics_task(void *arg)
+{
+    TickType_t last_wake = xTaskGetTickCount();
+
+    while (1)
+    {
+        vTaskDelayUntil(&last_wake, pdMS_TO_TICKS(CONFIG_METRICS_INTERVAL_S * 1000));
+
+        // Ride along with the next telemetry window rather than wake the radio for this
+        radio_wait_window(pdMS_TO_TICKS(CONFIG_METRICS_INTERVAL_S * 1000));
+        if (!mqtt_is_connected())
+            continue;
+
+        int64_t start = esp_timer_get_time();
+        int len = metrics_collect(buf, sizeof(buf));
+        ESP_LOGD(TAG, "Collected %d bytes in %" PRId64 " us", len, esp_timer_get_time() - start);
+
+        if (mqtt_enqueue_qos(METRICS_TOPIC, buf, len, 0) < 0)
+            ESP_LOGW(TAG, "Failed to queue metrics");
+    }
+}
+
+void metrics_init(void)
+{
+    xTaskCreate(metrics_task, "metrics", 3072, NULL, tskIDLE_PRIORITY + 1, NULL);
+}
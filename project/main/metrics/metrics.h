@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+
+#define METRICS_TOPIC "health"
+#define METRICS_BUF_SIZE 2048
+#define METRICS_MAX_TIMERS 4
+
+// Watches one periodic esp_timer callback: a run that starts more than 1.5 periods after
+// the previous one means the esp_timer task was held up by another callback.
+typedef struct {
+    const char *name;
+    int64_t period_us;
+    int64_t last_us;        // Start of the previous run, 0 when unknown
+    uint32_t overruns;
+} metrics_timer_t;
+
+void metrics_init(void);
+void metrics_timer_register(metrics_timer_t *timer);
+void metrics_timer_check(metrics_timer_t *timer);
+void metrics_timer_reset(metrics_timer_t *timer);
+int metrics_collect(char *buf, int size);
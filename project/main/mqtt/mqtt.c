@@ -1,8 +1,56 @@
 #include "mqtt.h"
+#include "outbox.h"
+#include "publisher.h"
+#include "reconnect.h"
+#include "station.h"
+#include "../tls/tls_session.h"
+#include "../backlog/backlog.h"
+#include "../history/query.h"
+#include "../boot/boot.h"
+#include "../radio/radio.h"
+
+#include "nvs.h"
 
 static const char *TAG = "mqtt";
 
 static bool connected = false;
+static int subscriptions_saved = -1;    // MQTT_SUBSCRIPTIONS_VERSION the session holds, -1 unread
+static int last_subscribe_id = -1;      // SUBACK that completes the subscription set
+
+#if CONFIG_MQTT5_TOPIC_ALIAS
+#include "freertos/semphr.h"
+
+/*
+ * MQTT 5 topic aliases: the first publish to a topic on a connection carries the topic and
+ * an alias, later ones an empty topic and only the 2-byte alias. Aliases are assigned in
+ * order of first use and only last for the connection.
+ */
+typedef struct {
+    char topic[64];
+    bool announced;     // Topic already sent with its alias on this connection
+} topic_alias_t;
+
+static topic_alias_t aliases[CONFIG_MQTT5_TOPIC_ALIAS_MAX];
+static int alias_count = 0;
+static bool aliases_refused = false;    // The broker accepts fewer aliases than configured
+static int64_t alias_bytes_saved = 0;
+// Publish properties are consumed by the next publish, so setting and publishing must not interleave
+static SemaphoreHandle_t alias_lock = NULL;
+
+static void alias_reset(void)
+{
+    xSemaphoreTake(alias_lock, portMAX_DELAY);
+    for (int i = 0; i < alias_count; i++)
+        aliases[i].announced = false;
+    aliases_refused = false;
+    xSemaphoreGive(alias_lock);
+}
+
+int64_t mqtt_alias_bytes_saved(void)
+{
+    return alias_bytes_saved;
+}
+#endif
 
 bool mqtt_is_connected() {
     return connected;
@@ -12,6 +60,68 @@ void set_connected(bool status) {
     connected = status;
 }
 
+/*
+ * @brief Subscribes to a topic as is, outside the station namespace.
+ */
+static int subscribe_global(esp_mqtt_client_handle_t client, const char *topic, int qos)
+{
+    int msg_id = esp_mqtt_client_subscribe(client, topic, qos);
+    ESP_LOGI(TAG, "sent subscribe to %s, msg_id=%d", topic, msg_id);
+    return msg_id;
+}
+
+/*
+ * @brief Subscribes to a message kind in this station's topic namespace.
+ */
+static int subscribe(esp_mqtt_client_handle_t client, const char *name, int qos)
+{
+    char topic[STATION_TOPIC_LEN];
+    if (station_topic(name, topic, sizeof(topic)) < 0)
+        return -1;
+    return subscribe_global(client, topic, qos);
+}
+
+/*
+ * @brief The subscription set version stored with the persistent session, 0 if none.
+ */
+static int subscriptions_version(void)
+{
+    if (subscriptions_saved < 0)
+    {
+        nvs_handle_t nvs;
+        uint8_t version = 0;
+        if (nvs_open(MQTT_NVS_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK)
+        {
+            nvs_get_u8(nvs, "subs", &version);
+            nvs_close(nvs);
+        }
+        subscriptions_saved = version;
+    }
+    return subscriptions_saved;
+}
+
+static void subscriptions_save(void)
+{
+    nvs_handle_t nvs;
+    if (subscriptions_version() == MQTT_SUBSCRIPTIONS_VERSION ||
+        nvs_open(MQTT_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK)
+        return;
+    nvs_set_u8(nvs, "subs", MQTT_SUBSCRIPTIONS_VERSION);
+    nvs_commit(nvs);
+    nvs_close(nvs);
+    subscriptions_saved = MQTT_SUBSCRIPTIONS_VERSION;
+}
+
+static void subscribe_all(esp_mqtt_client_handle_t client)
+{
+    subscribe(client, OTA_TOPIC, 0);
+    last_subscribe_id = subscribe(client, HISTORY_QUERY_TOPIC, 1);
+#if CONFIG_MQTT_STATION_TOPICS
+    // Fleet-wide rollouts still reach every station
+    last_subscribe_id = subscribe_global(client, OTA_TOPIC, 0);
+#endif
+}
+
 void log_error_if_nonzero(const char *message, int error_code)
 {
     if (error_code != 0)
@@ -35,49 +145,70 @@ void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event
     ESP_LOGD(TAG, "Event dispatched from event loop base=%s, event_id=%" PRIi32 "", base, event_id);
     esp_mqtt_event_handle_t event = event_data;
     esp_mqtt_client_handle_t client = event->client;
-    int msg_id;
     switch ((esp_mqtt_event_id_t)event_id)
     {
     case MQTT_EVENT_CONNECTED:
         ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
         set_connected(true);
-        msg_id = esp_mqtt_client_publish(client, "/topic/qos1", "data_3", 0, 1, 0);
-        msg_id = esp_mqtt_client_subscribe(client, "/topic/qos0", 0);
-        msg_id = esp_mqtt_client_subscribe(client, "/topic/qos1", 1);
-        msg_id = esp_mqtt_client_unsubscribe(client, "/topic/qos1");
-        msg_id = esp_mqtt_client_subscribe(client, "ota", 0);
-        ESP_LOGI(TAG, "sent subscribe successful, msg_id=%d", msg_id);
+        boot_mark(BOOT_PHASE_MQTT_CONNECTED);
+        reconnect_on_connected();
+#if CONFIG_MQTT5_TOPIC_ALIAS
+        alias_reset();
+#endif
+        // A persistent session keeps its subscriptions, unless it predates the current set
+        if (!event->session_present || subscriptions_version() != MQTT_SUBSCRIPTIONS_VERSION)
+            subscribe_all(client);
+        outbox_on_connection_changed();
+        // Not from this handler: publishing here could deadlock with producers
+        outbox_schedule_poll();
+        backlog_notify_connected();
         break;
     case MQTT_EVENT_DISCONNECTED:
         ESP_LOGI(TAG, "MQTT_EVENT_DISCONNECTED");
         set_connected(false);
+        outbox_on_connection_changed();
+        backlog_notify_disconnected();
+        reconnect_on_disconnected();
+#if CONFIG_MQTT5_TOPIC_ALIAS
+        ESP_LOGI(TAG, "Topic aliases saved %" PRId64 " bytes so far", alias_bytes_saved);
+#endif
         break;
     case MQTT_EVENT_SUBSCRIBED:
         ESP_LOGI(TAG, "MQTT_EVENT_SUBSCRIBED, msg_id=%d", event->msg_id);
-        msg_id = esp_mqtt_client_publish(client, "/topic/qos0", "data", 0, 0, 0);
-        ESP_LOGI(TAG, "sent publish successful, msg_id=%d", msg_id);
+        if (event->msg_id == last_subscribe_id)
+        {
+            last_subscribe_id = -1;
+            subscriptions_save();
+        }
         break;
     case MQTT_EVENT_UNSUBSCRIBED:
         ESP_LOGI(TAG, "MQTT_EVENT_UNSUBSCRIBED, msg_id=%d", event->msg_id);
         break;
     case MQTT_EVENT_PUBLISHED:
         ESP_LOGI(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+        outbox_on_published(event->msg_id);
         break;
     case MQTT_EVENT_DATA:
         ESP_LOGI(TAG, "MQTT_EVENT_DATA");
         printf("TOPIC=%.*s\r\n", event->topic_len, event->topic);
         printf("DATA=%.*s\r\n", event->data_len, event->data);
 
-        if (!strncmp((event->topic), "ota", event->topic_len))
+        if (station_topic_is(event->topic, event->topic_len, OTA_TOPIC) ||
+            (event->topic_len == strlen(OTA_TOPIC) && !strncmp(event->topic, OTA_TOPIC, event->topic_len)))
         {
             char url[event->data_len+1];
             memcpy(url, event->data, event->data_len);
             url[event->data_len] = '\0';
             ota_update(url);
         }
+        else if (station_topic_is(event->topic, event->topic_len, HISTORY_QUERY_TOPIC))
+        {
+            history_query_request(event->data, event->data_len);
+        }
         break;
     case MQTT_EVENT_ERROR:
         ESP_LOGI(TAG, "MQTT_EVENT_ERROR");
+        reconnect_on_error(event);
         if (event->error_handle->error_type == MQTT_ERROR_TYPE_TCP_TRANSPORT)
         {
             log_error_if_nonzero("reported from esp-tls", event->error_handle->esp_tls_last_esp_err);
@@ -94,19 +225,143 @@ void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event
 
 esp_mqtt_client_handle_t client = NULL;
 
+// Kept for the lifetime of the client, the reconnect supervisor updates the broker address
+static esp_mqtt_client_config_t mqtt_cfg;
+
 void mqtt_init(void)
 {
-    esp_mqtt_client_config_t mqtt_cfg = {
-        .broker.address.uri = CONFIG_BROKER_URL,
-    };
+    station_init();
+    reconnect_init(&mqtt_cfg);
+    mqtt_cfg.session.keepalive = radio_keepalive_s();
+#if CONFIG_TLS_SESSION_RESUMPTION
+    if (mqtt_cfg.broker.address.transport == MQTT_TRANSPORT_OVER_SSL)
+        mqtt_cfg.network.transport = tls_session_transport_new(mqtt_cfg.broker.verification.common_name);
+#endif
+
+#if CONFIG_MQTT5_TOPIC_ALIAS
+    mqtt_cfg.session.protocol_ver = MQTT_PROTOCOL_V_5;
+    alias_lock = xSemaphoreCreateMutex();
+#endif
 
+    outbox_init();
+    publisher_init();
     client = esp_mqtt_client_init(&mqtt_cfg);
     /* The last argument may be used to pass data to the event handler, in this example mqtt_event_handler */
     esp_mqtt_client_register_event(client, ESP_EVENT_ANY_ID, mqtt_event_handler, NULL);
+    reconnect_start(client);
     esp_mqtt_client_start(client);
 }
 
+/*
+ * @brief Hands a message to esp-mqtt: either sends it now (blocking on the socket) or stores
+ *        it in the client outbox for the MQTT task to send.
+ */
+static int client_send(const char *topic, const char *data, int len, int qos, bool enqueue)
+{
+    if (enqueue)
+        return esp_mqtt_client_enqueue(client, topic, data, len, qos, 0, true);
+    return esp_mqtt_client_publish(client, topic, data, len, qos, 0);
+}
+
+/*
+ * @brief Single publish path: puts the topic in the station namespace, applies topic aliases
+ *        in MQTT 5 mode and feeds the reconnect metrics. Must not be called from
+ *        mqtt_event_handler().
+ *
+ * @return The message id (0 for QoS 0), or -1 on failure.
+ */
+static int publish(const char *name, const char *data, int len, int qos, bool enqueue)
+{
+    int msg_id;
+    char topic[STATION_TOPIC_LEN];
+
+    if (station_topic(name, topic, sizeof(topic)) < 0)
+    {
+        ESP_LOGE(TAG, "Topic %s too long for station %s", name, station_id());
+        return -1;
+    }
+    radio_wake();
+
+#if CONFIG_MQTT5_TOPIC_ALIAS
+    xSemaphoreTake(alias_lock, portMAX_DELAY);
+
+    int alias = 0;
+    while (alias < alias_count && strcmp(aliases[alias].topic, topic))
+        alias++;
+    if (alias == alias_count && alias_count < CONFIG_MQTT5_TOPIC_ALIAS_MAX && strlen(topic) < sizeof(aliases[0].topic))
+        strcpy(aliases[alias_count++].topic, topic);
+
+    // Only for messages sent right away: esp-mqtt keeps QoS 1 and enqueued messages in its
+    // outbox and may resend them on a later connection, where the alias is undefined
+    if (alias < alias_count && !aliases_refused && qos == 0 && !enqueue)
+    {
+        esp_mqtt5_publish_property_config_t property = {
+            .topic_alias = alias + 1,
+        };
+        bool announced = aliases[alias].announced;
+
+        esp_mqtt5_client_set_publish_property(client, &property);
+        msg_id = client_send(announced ? "" : topic, data, len, qos, enqueue);
+        if (msg_id >= 0)
+        {
+            // The alias property costs 3 bytes, the topic string 2 + its length
+            alias_bytes_saved += announced ? (int)strlen(topic) - 3 : -3;
+            aliases[alias].announced = true;
+            xSemaphoreGive(alias_lock);
+            reconnect_on_publish(msg_id);
+            boot_mark(BOOT_PHASE_FIRST_PUBLISH);
+            return msg_id;
+        }
+        if (connected)
+        {
+            ESP_LOGW(TAG, "Topic alias %d refused, publishing full topics on this connection", alias + 1);
+            aliases_refused = true;
+        }
+        // Do not leave the alias pending for the next publish
+        esp_mqtt5_publish_property_config_t no_alias = { 0 };
+        esp_mqtt5_client_set_publish_property(client, &no_alias);
+    }
+    msg_id = client_send(topic, data, len, qos, enqueue);
+    xSemaphoreGive(alias_lock);
+#else
+    msg_id = client_send(topic, data, len, qos, enqueue);
+#endif
+
+    reconnect_on_publish(msg_id);
+    if (msg_id >= 0)
+        boot_mark(BOOT_PHASE_FIRST_PUBLISH);
+    return msg_id;
+}
+
+int mqtt_publish_qos(const char *topic, const char *data, int len, int qos)
+{
+    return publish(topic, data, len, qos, false);
+}
+
+/*
+ * @brief Like mqtt_publish_qos() but only stores the message in the esp-mqtt outbox; the
+ *        MQTT task sends it. Never waits for the socket.
+ */
+int mqtt_enqueue_qos(const char *topic, const char *data, int len, int qos)
+{
+    return publish(topic, data, len, qos, true);
+}
+
+/*
+ * @brief Bytes held in the esp-mqtt outbox (messages queued or awaiting acknowledgement).
+ */
+int mqtt_outbox_size(void)
+{
+    return client ? esp_mqtt_client_get_outbox_size(client) : 0;
+}
+
 void mqtt_publish(char *topic, char *data)
 {
-    esp_mqtt_client_publish(client, topic, data, 0, 0, 0);
+    mqtt_publish_qos(topic, data, strlen(data), 0);
 }
+
+void mqtt_publish_raw(const char *topic, const char *data, int len)
+{
+    mqtt_publish_qos(topic, data, len, 0);
+}
+
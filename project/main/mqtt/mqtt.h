@@ -20,6 +20,18 @@
 #define HUM_TOPIC "humidity"
 #define FORECAST_TOPIC "forecast"
 
+#define MQTT_NVS_NAMESPACE "mqtt"
+// Bump when the subscribed topics change, so a persistent session made by an older firmware
+// is subscribed to the new set
+#define MQTT_SUBSCRIPTIONS_VERSION 1
+
 void mqtt_init(void);
 void mqtt_publish(char *topic, char *data);
+void mqtt_publish_raw(const char *topic, const char *data, int len);
+int mqtt_publish_qos(const char *topic, const char *data, int len, int qos);
+int mqtt_enqueue_qos(const char *topic, const char *data, int len, int qos);
+int mqtt_outbox_size(void);
+#if CONFIG_MQTT5_TOPIC_ALIAS
+int64_t mqtt_alias_bytes_saved(void);
+#endif
 bool mqtt_is_connected();
\ No newline at end of file
@@ -0,0 +1,273 @@
+#include "outbox.h"
+#include "mqtt.h"
+#include "publisher.h"
+
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+
+static const char *TAG = "outbox";
+
+typedef struct {
+    bool in_use;
+    uint32_t ticket;            // Stable id handed to the producer, survives retries
+    bool sending;               // A publish call for this slot is in progress
+    int msg_id;                 // MQTT packet id once esp-mqtt accepted the message, -1 until then
+    int64_t sent_us;
+    int retries;                // Publishes esp-mqtt refused
+    outbox_done_cb_t done;
+    void *ctx;
+    int len;
+    char topic[OUTBOX_TOPIC_LEN];
+    char data[OUTBOX_SLOT_SIZE];
+} outbox_slot_t;
+
+static outbox_slot_t slots[OUTBOX_WINDOW];
+static outbox_stats_t stats;
+static uint32_t next_ticket = 1;
+
+// PUBACKs that arrived before the producer stored the msg_id returned by publish. Only
+// recorded while a publish call is in progress, so stale acks cannot complete a later slot.
+#define OUTBOX_EARLY_ACKS 4
+static int early_acks[OUTBOX_EARLY_ACKS];
+static int sends_in_progress;
+
+static StaticSemaphore_t lock_buffer;
+static SemaphoreHandle_t lock;          // Guards slots and stats, never held across a publish
+static StaticSemaphore_t free_buffer;
+static SemaphoreHandle_t free_slots;    // Counts free slots, producers block on it
+
+static bool take_early_ack(int msg_id)
+{
+    for (int i = 0; i < OUTBOX_EARLY_ACKS; i++)
+    {
+        if (early_acks[i] == msg_id)
+        {
+            early_acks[i] = -1;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void clear_early_acks(void)
+{
+    for (int i = 0; i < OUTBOX_EARLY_ACKS; i++)
+        early_acks[i] = -1;
+}
+
+/*
+ * @brief Frees an acknowledged slot and updates the latency statistics. Takes the lock.
+ */
+static void complete(outbox_slot_t *slot)
+{
+    uint32_t latency = esp_timer_get_time() - slot->sent_us;
+    outbox_done_cb_t done = slot->done;
+    void *ctx = slot->ctx;
+    uint32_t ticket = slot->ticket;
+
+    stats.acked++;
+    stats.occupancy--;
+    stats.ack_latency_last_us = latency;
+    if (latency > stats.ack_latency_max_us)
+        stats.ack_latency_max_us = latency;
+    stats.ack_latency_avg_us = stats.ack_latency_avg_us ? stats.ack_latency_avg_us - stats.ack_latency_avg_us / 8 + latency / 8 : latency;
+    slot->in_use = false;
+    xSemaphoreGive(lock);
+    xSemaphoreGive(free_slots);
+
+    if (done != NULL)
+        done(ticket, true, ctx);
+    xSemaphoreTake(lock, portMAX_DELAY);
+}
+
+/*
+ * @brief Sends (or re-sends) the message held in a reserved slot.
+ */
+static void send(outbox_slot_t *slot)
+{
+    int msg_id = mqtt_is_connected() ? mqtt_publish_qos(slot->topic, slot->data, slot->len, 1) : -1;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    slot->sent_us = esp_timer_get_time();
+    slot->msg_id = msg_id;
+    slot->sending = false;
+    if (msg_id > 0 && take_early_ack(msg_id))
+        complete(slot);
+    if (--sends_in_progress == 0)
+        clear_early_acks();
+    xSemaphoreGive(lock);
+}
+
+/*
+ * @brief Publishes with QoS 1 through the bounded in-flight window.
+ *
+ *  The payload is copied into a static slot, so nothing is allocated per message. When the
+ *  window is full the caller blocks for at most `wait` ticks, then the publish is refused.
+ *
+ * @return A ticket passed back to `done`, or 0 if the window stayed full or the message is too large.
+ */
+uint32_t outbox_publish(const char *topic, const char *data, int len, TickType_t wait,
+                        outbox_done_cb_t done, void *ctx)
+{
+    if (len > OUTBOX_SLOT_SIZE || strlen(topic) >= OUTBOX_TOPIC_LEN)
+        return 0;
+
+    outbox_poll();
+    if (xSemaphoreTake(free_slots, wait) != pdTRUE)
+    {
+        xSemaphoreTake(lock, portMAX_DELAY);
+        stats.rejected++;
+        xSemaphoreGive(lock);
+        return 0;
+    }
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    outbox_slot_t *slot = NULL;
+    for (int i = 0; i < OUTBOX_WINDOW && slot == NULL; i++)
+        if (!slots[i].in_use)
+            slot = &slots[i];
+
+    if (next_ticket == 0)
+        next_ticket = 1;
+    slot->in_use = true;
+    slot->ticket = next_ticket++;
+    slot->sending = true;
+    slot->msg_id = -1;
+    slot->retries = 0;
+    slot->done = done;
+    slot->ctx = ctx;
+    slot->len = len;
+    strcpy(slot->topic, topic);
+    memcpy(slot->data, data, len);
+    uint32_t ticket = slot->ticket;
+    sends_in_progress++;
+
+    stats.published++;
+    if (++stats.occupancy > stats.peak_occupancy)
+        stats.peak_occupancy = stats.occupancy;
+    xSemaphoreGive(lock);
+
+    send(slot);
+    return ticket;
+}
+
+/*
+ * @brief Matches a PUBACK to its slot. Called from the MQTT event handler.
+ */
+void outbox_on_published(int msg_id)
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    for (int i = 0; i < OUTBOX_WINDOW; i++)
+    {
+        if (slots[i].in_use && slots[i].msg_id == msg_id)
+        {
+            complete(&slots[i]);
+            xSemaphoreGive(lock);
+            return;
+        }
+    }
+
+    // The producer may not have stored this msg_id yet
+    for (int i = 0; i < OUTBOX_EARLY_ACKS && sends_in_progress > 0; i++)
+    {
+        if (early_acks[i] == -1)
+        {
+            early_acks[i] = msg_id;
+            break;
+        }
+    }
+    xSemaphoreGive(lock);
+}
+
+/*
+ * @brief Forgets PUBACKs held for in-progress publishes. Called on connect and disconnect:
+ *        packet ids from another connection never belong to a pending publish.
+ */
+void outbox_on_connection_changed(void)
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    clear_early_acks();
+    xSemaphoreGive(lock);
+}
+
+/*
+ * @brief Re-publishes messages esp-mqtt refused, and drops those out of retries or whose
+ *        ack is overdue.
+ *
+ *  A message esp-mqtt accepted is never published again: esp-mqtt retransmits it from its
+ *  own outbox, including after a reconnect, and a second publish would queue a duplicate.
+ *  Does nothing while disconnected, so an outage does not burn retries. Cheap enough to
+ *  call on every publish and on every (re)connect.
+ */
+void outbox_poll(void)
+{
+    int64_t now = esp_timer_get_time();
+
+    if (!mqtt_is_connected())
+        return;
+
+    for (int i = 0; i < OUTBOX_WINDOW; i++)
+    {
+        outbox_slot_t *slot = &slots[i];
+
+        xSemaphoreTake(lock, portMAX_DELAY);
+        bool refused = slot->in_use && !slot->sending && slot->msg_id == -1;
+        bool overdue = slot->in_use && !slot->sending && slot->msg_id != -1 &&
+                       now - slot->sent_us > (int64_t)CONFIG_MQTT_OUTBOX_ACK_TIMEOUT_MS * 1000;
+        if (!refused && !overdue)
+        {
+            xSemaphoreGive(lock);
+            continue;
+        }
+
+        if (overdue || slot->retries >= CONFIG_MQTT_OUTBOX_MAX_RETRIES)
+        {
+            outbox_done_cb_t done = slot->done;
+            void *ctx = slot->ctx;
+            uint32_t ticket = slot->ticket;
+
+            if (overdue)
+                ESP_LOGW(TAG, "Dropping message to %s, msg_id=%d not acknowledged", slot->topic, slot->msg_id);
+            else
+                ESP_LOGW(TAG, "Dropping message to %s after %d retries", slot->topic, slot->retries);
+            slot->in_use = false;
+            stats.dropped++;
+            stats.occupancy--;
+            xSemaphoreGive(lock);
+            xSemaphoreGive(free_slots);
+            if (done != NULL)
+                done(ticket, false, ctx);
+            continue;
+        }
+
+        slot->retries++;
+        slot->sending = true;
+        sends_in_progress++;
+        stats.retries++;
+        xSemaphoreGive(lock);
+        send(slot);
+    }
+}
+
+/*
+ * @brief Runs outbox_poll() shortly from the publisher task. For contexts that must not
+ *        publish themselves, such as the MQTT event handler.
+ */
+void outbox_schedule_poll(void)
+{
+    publisher_request_outbox_poll();
+}
+
+void outbox_get_stats(outbox_stats_t *out)
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    *out = stats;
+    xSemaphoreGive(lock);
+}
+
+void outbox_init(void)
+{
+    lock = xSemaphoreCreateMutexStatic(&lock_buffer);
+    free_slots = xSemaphoreCreateCountingStatic(OUTBOX_WINDOW, OUTBOX_WINDOW, &free_buffer);
+    clear_early_acks();
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_err.h"
+
+#define OUTBOX_WINDOW CONFIG_MQTT_OUTBOX_WINDOW
+#define OUTBOX_SLOT_SIZE CONFIG_MQTT_OUTBOX_SLOT_SIZE
+#define OUTBOX_TOPIC_LEN 64
+
+// Called once per message, from the MQTT task on ack or from the caller of outbox_poll() on drop
+typedef void (*outbox_done_cb_t)(uint32_t ticket, bool acked, void *ctx);
+
+typedef struct {
+    uint32_t occupancy;         // Messages currently in flight
+    uint32_t peak_occupancy;    // Highest occupancy seen
+    uint32_t published;         // Messages accepted into the window
+    uint32_t acked;             // Messages acknowledged by the broker
+    uint32_t retries;           // Re-publishes after esp-mqtt refused a message
+    uint32_t dropped;           // Messages out of retries or not acknowledged in time
+    uint32_t rejected;          // Publishes refused because the window stayed full
+    uint32_t ack_latency_last_us;
+    uint32_t ack_latency_max_us;
+    uint32_t ack_latency_avg_us; // Exponential moving average, 1/8 weight
+} outbox_stats_t;
+
+void outbox_init(void);
+uint32_t outbox_publish(const char *topic, const char *data, int len, TickType_t wait,
+                        outbox_done_cb_t done, void *ctx);
+void outbox_on_published(int msg_id);
+void outbox_on_connection_changed(void);
+void outbox_poll(void);
+void outbox_schedule_poll(void);
+void outbox_get_stats(outbox_stats_t *stats);
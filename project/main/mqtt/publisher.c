@@ -0,0 +1,167 @@
+#include "publisher.h"
+#include "mqtt.h"
+#include "outbox.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+
+static const char *TAG = "publisher";
+
+static publisher_buf_t pool[PUBLISHER_POOL_SIZE];
+
+// Both queues hold buffer pointers: free buffers, and buffers waiting to be sent. The send
+// queue has one extra entry for a NULL request to poll the QoS 1 outbox.
+static StaticQueue_t free_queue_buffer, send_queue_buffer;
+static uint8_t free_queue_storage[PUBLISHER_POOL_SIZE * sizeof(publisher_buf_t *)];
+static uint8_t send_queue_storage[(PUBLISHER_POOL_SIZE + 1) * sizeof(publisher_buf_t *)];
+static QueueHandle_t free_queue = NULL, send_queue = NULL;
+static volatile bool poll_pending = false;
+
+static publisher_stats_t stats;
+
+/*
+ * @brief Hands queued buffers to esp-mqtt. Runs in its own task so producers never wait on
+ *        the client lock, which the MQTT task holds during network I/O.
+ *
+ *  QoS 0 messages are sent right away, which is what lets them carry an MQTT 5 topic alias;
+ *  QoS 1 messages go to the esp-mqtt outbox, which resends them after a reconnect.
+ */
+static void publisher_task(void *arg)
+{
+    publisher_buf_t *buf;
+
+    while (1)
+    {
+        xQueueReceive(send_queue, &buf, portMAX_DELAY);
+
+        if (buf == NULL)
+        {
+            poll_pending = false;
+            outbox_poll();
+            continue;
+        }
+
+        // topic is NUL-terminated by publisher_send(), topic_len is kept for the caller's sake
+        int msg_id = -1;
+        if (mqtt_is_connected())
+            msg_id = buf->qos == 0 ? mqtt_publish_qos(buf->topic, buf->data, buf->len, 0)
+                                   : mqtt_enqueue_qos(buf->topic, buf->data, buf->len, buf->qos);
+        if (msg_id < 0)
+        {
+            stats.send_failures++;
+            ESP_LOGW(TAG, "Failed to send message to %s", buf->topic);
+        }
+        else
+            stats.sent++;
+
+        xQueueSend(free_queue, &buf, 0);
+    }
+}
+
+/*
+ * @brief Takes a buffer from the pool without waiting.
+ *
+ * @return The buffer, or NULL when every buffer is in use.
+ */
+publisher_buf_t *publisher_get(void)
+{
+    publisher_buf_t *buf = NULL;
+    if (free_queue == NULL || xQueueReceive(free_queue, &buf, 0) != pdTRUE)
+    {
+        stats.pool_exhausted++;
+        return NULL;
+    }
+    return buf;
+}
+
+/*
+ * @brief Queues a buffer filled by the producer. Constant time: never blocks.
+ *
+ *  The buffer always returns to the pool, whether or not the message is accepted.
+ *
+ * @return ESP_OK, ESP_ERR_INVALID_SIZE if the topic or payload do not fit.
+ */
+esp_err_t publisher_send(publisher_buf_t *buf, const char *topic, size_t topic_len, size_t len, int qos)
+{
+    if (topic_len >= PUBLISHER_TOPIC_LEN || len > PUBLISHER_BUF_SIZE)
+    {
+        xQueueSend(free_queue, &buf, 0);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    memcpy(buf->topic, topic, topic_len);
+    buf->topic[topic_len] = '\0';
+    buf->topic_len = topic_len;
+    buf->len = len;
+    buf->qos = qos;
+
+    // Cannot fail: there are as many queue slots as buffers
+    xQueueSend(send_queue, &buf, 0);
+    stats.enqueued++;
+
+    UBaseType_t depth = uxQueueMessagesWaiting(send_queue);
+    if (depth > stats.queue_peak)
+        stats.queue_peak = depth;
+    return ESP_OK;
+}
+
+/*
+ * @brief Convenience for payloads that already exist elsewhere.
+ *
+ * @return ESP_OK, ESP_ERR_NO_MEM when the pool is exhausted, ESP_ERR_INVALID_SIZE.
+ */
+esp_err_t publisher_send_copy(const char *topic, size_t topic_len, const void *data, size_t len, int qos)
+{
+    if (len > PUBLISHER_BUF_SIZE)
+        return ESP_ERR_INVALID_SIZE;
+
+    publisher_buf_t *buf = publisher_get();
+    if (buf == NULL)
+        return ESP_ERR_NO_MEM;
+    memcpy(buf->data, data, len);
+    return publisher_send(buf, topic, topic_len, len, qos);
+}
+
+/*
+ * @brief Has the publisher task run outbox_poll(). For contexts that must not publish
+ *        themselves, such as the MQTT event handler. Never blocks.
+ */
+void publisher_request_outbox_poll(void)
+{
+    if (send_queue == NULL || poll_pending)
+        return;
+    poll_pending = true;
+    publisher_buf_t *request = NULL;
+    // Cannot fail: the extra queue slot is only ever taken by this request
+    xQueueSend(send_queue, &request, 0);
+}
+
+void publisher_get_stats(publisher_stats_t *out)
+{
+    *out = stats;
+}
+
+/*
+ * @brief Messages queued but not yet handed to esp-mqtt.
+ */
+uint32_t publisher_pending(void)
+{
+    if (send_queue == NULL)
+        return 0;
+    UBaseType_t waiting = uxQueueMessagesWaiting(send_queue);
+    return poll_pending && waiting > 0 ? waiting - 1 : waiting;
+}
+
+void publisher_init(void)
+{
+    free_queue = xQueueCreateStatic(PUBLISHER_POOL_SIZE, sizeof(publisher_buf_t *), free_queue_storage, &free_queue_buffer);
+    send_queue = xQueueCreateStatic(PUBLISHER_POOL_SIZE + 1, sizeof(publisher_buf_t *), send_queue_storage, &send_queue_buffer);
+    for (int i = 0; i < PUBLISHER_POOL_SIZE; i++)
+    {
+        publisher_buf_t *buf = &pool[i];
+        xQueueSend(free_queue, &buf, 0);
+    }
+    // Outbox polls publish synchronously, through TLS when enabled
+    xTaskCreate(publisher_task, "publisher", 4096, NULL, tskIDLE_PRIORITY + 3, NULL);
+}
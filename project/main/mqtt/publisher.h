@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+#define PUBLISHER_POOL_SIZE CONFIG_MQTT_PUBLISHER_POOL_SIZE
+#define PUBLISHER_BUF_SIZE 160
+#define PUBLISHER_TOPIC_LEN 64
+
+// A preallocated message: the producer formats straight into data
+typedef struct {
+    char topic[PUBLISHER_TOPIC_LEN];
+    char data[PUBLISHER_BUF_SIZE];
+    uint16_t topic_len;
+    uint16_t len;
+    uint8_t qos;
+} publisher_buf_t;
+
+typedef struct {
+    uint32_t enqueued;          // Messages accepted from producers
+    uint32_t sent;              // Messages sent (QoS 0) or handed to the esp-mqtt outbox
+    uint32_t pool_exhausted;    // publisher_get() found no free buffer
+    uint32_t send_failures;     // esp-mqtt refused the message or offline
+    uint32_t queue_peak;        // Deepest the queue has been
+} publisher_stats_t;
+
+void publisher_init(void);
+publisher_buf_t *publisher_get(void);
+esp_err_t publisher_send(publisher_buf_t *buf, const char *topic, size_t topic_len, size_t len, int qos);
+esp_err_t publisher_send_copy(const char *topic, size_t topic_len, const void *data, size_t len, int qos);
+void publisher_get_stats(publisher_stats_t *stats);
+uint32_t publisher_pending(void);
+void publisher_request_outbox_poll(void);
@@ -0,0 +1,243 @@
+#include "reconnect.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "nvs.h"
+#include "lwip/netdb.h"
+#include "lwip/inet.h"
+
+static const char *TAG = "reconnect";
+
+#define RECONNECT_NOTIFY_RECONNECT BIT0
+#define RECONNECT_NOTIFY_RESOLVE BIT1
+
+static esp_mqtt_client_handle_t client = NULL;
+static esp_mqtt_client_config_t *config = NULL;
+static TaskHandle_t supervisor = NULL;
+
+static char broker_host[64];        // Host name from CONFIG_BROKER_URL
+static char broker_ip[16];          // Cached IPv4 address of broker_host
+static bool dns_cacheable = false;  // False for URLs the cache does not handle (ws, wss)
+static volatile bool dns_stale = false;
+
+static reconnect_stats_t stats;
+static int64_t disconnected_us = 0; // Start of the current outage, 0 while connected
+static volatile bool awaiting_publish = false;
+
+/*
+ * @brief Splits CONFIG_BROKER_URL (mqtt[s]://host[:port]) into the hostname/port/transport
+ *        fields so the client can be pointed at a cached address instead of the name.
+ */
+static bool parse_broker_url(const char *url, esp_mqtt_client_config_t *cfg)
+{
+    const char *host;
+    if (!strncmp(url, "mqtt://", 7))
+    {
+        cfg->broker.address.transport = MQTT_TRANSPORT_OVER_TCP;
+        cfg->broker.address.port = 1883;
+        host = url + 7;
+    }
+    else if (!strncmp(url, "mqtts://", 8))
+    {
+        cfg->broker.address.transport = MQTT_TRANSPORT_OVER_SSL;
+        cfg->broker.address.port = 8883;
+        host = url + 8;
+    }
+    else
+        return false;
+
+    size_t len = strcspn(host, ":/");
+    if (len == 0 || len >= sizeof(broker_host))
+        return false;
+    memcpy(broker_host, host, len);
+    broker_host[len] = '\0';
+    if (host[len] == ':')
+        cfg->broker.address.port = atoi(host + len + 1);
+    return true;
+}
+
+static void load_cached_ip(void)
+{
+    nvs_handle_t nvs;
+    char host[sizeof(broker_host)];
+    size_t host_len = sizeof(host), ip_len = sizeof(broker_ip);
+
+    broker_ip[0] = '\0';
+    if (nvs_open(RECONNECT_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK)
+        return;
+    // The cached address is only valid for the host it was resolved from
+    if (nvs_get_str(nvs, "host", host, &host_len) != ESP_OK || strcmp(host, broker_host) ||
+        nvs_get_str(nvs, "ip", broker_ip, &ip_len) != ESP_OK)
+        broker_ip[0] = '\0';
+    nvs_close(nvs);
+}
+
+static void save_cached_ip(void)
+{
+    nvs_handle_t nvs;
+    if (nvs_open(RECONNECT_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK)
+        return;
+    nvs_set_str(nvs, "host", broker_host);
+    nvs_set_str(nvs, "ip", broker_ip);
+    nvs_commit(nvs);
+    nvs_close(nvs);
+}
+
+/*
+ * @brief Resolves broker_host into broker_ip. Blocking, only called from the supervisor task.
+ */
+static bool resolve_broker(void)
+{
+    struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *res = NULL;
+
+    stats.dns_lookups++;
+    if (getaddrinfo(broker_host, NULL, &hints, &res) != 0 || res == NULL)
+    {
+        ESP_LOGW(TAG, "Failed to resolve %s", broker_host);
+        return false;
+    }
+    struct in_addr addr = ((struct sockaddr_in *)res->ai_addr)->sin_addr;
+    inet_ntoa_r(addr, broker_ip, sizeof(broker_ip));
+    freeaddrinfo(res);
+
+    ESP_LOGI(TAG, "Resolved %s to %s", broker_host, broker_ip);
+    save_cached_ip();
+    return true;
+}
+
+/*
+ * @brief Full-jitter exponential backoff: uniform in [0, min(max, base * 2^attempt)].
+ */
+static uint32_t backoff_ms(uint32_t attempt)
+{
+    uint32_t ceiling = CONFIG_MQTT_BACKOFF_MAX_MS;
+    if (attempt < 16 && ((uint32_t)CONFIG_MQTT_BACKOFF_BASE_MS << attempt) < ceiling)
+        ceiling = CONFIG_MQTT_BACKOFF_BASE_MS << attempt;
+    return esp_random() % (ceiling + 1);
+}
+
+static void refresh_broker_address(void)
+{
+    if (resolve_broker())
+    {
+        dns_stale = false;
+        config->broker.address.hostname = broker_ip;
+        esp_mqtt_set_config(client, config);
+    }
+}
+
+static void reconnect_task(void *arg)
+{
+    uint32_t notified;
+
+    while (1)
+    {
+        xTaskNotifyWait(0, UINT32_MAX, &notified, portMAX_DELAY);
+
+        if (!(notified & RECONNECT_NOTIFY_RECONNECT))
+        {
+            // Connected by name: fill the cache for the next reconnect or boot
+            refresh_broker_address();
+            continue;
+        }
+
+        uint32_t delay = backoff_ms(stats.attempts);
+        ESP_LOGI(TAG, "Reconnecting in %" PRIu32 " ms (attempt %" PRIu32 ")", delay, stats.attempts);
+        vTaskDelay(delay / portTICK_PERIOD_MS);
+
+        if (dns_cacheable && (dns_stale || broker_ip[0] == '\0'))
+            refresh_broker_address();
+        esp_mqtt_client_reconnect(client);
+    }
+}
+
+/*
+ * @brief Prepares the client configuration: persistent session, no built-in reconnect and,
+ *        for mqtt:// and mqtts:// URLs, the cached broker address.
+ */
+void reconnect_init(esp_mqtt_client_config_t *cfg)
+{
+    config = cfg;
+    cfg->session.disable_clean_session = true;
+    cfg->network.disable_auto_reconnect = true;
+
+    dns_cacheable = parse_broker_url(CONFIG_BROKER_URL, cfg);
+    if (!dns_cacheable)
+    {
+        cfg->broker.address.uri = CONFIG_BROKER_URL;
+        return;
+    }
+
+    load_cached_ip();
+    cfg->broker.address.uri = NULL;
+    cfg->broker.address.hostname = broker_ip[0] ? broker_ip : broker_host;
+    // Certificates are issued for the name, not for the cached address
+    cfg->broker.verification.common_name = broker_host;
+}
+
+/*
+ * @brief Starts the supervisor task. The configuration given to reconnect_init() must outlive
+ *        the client, it is updated in place when the broker address changes.
+ */
+void reconnect_start(esp_mqtt_client_handle_t handle)
+{
+    client = handle;
+    xTaskCreate(reconnect_task, "mqtt_reconnect", 3072, NULL, tskIDLE_PRIORITY + 2, &supervisor);
+}
+
+void reconnect_on_connected(void)
+{
+    if (disconnected_us)
+    {
+        stats.reconnects++;
+        stats.last_connect_ms = (esp_timer_get_time() - disconnected_us) / 1000;
+        awaiting_publish = true;
+        ESP_LOGI(TAG, "Reconnected after %" PRIu32 " ms and %" PRIu32 " attempts",
+                 stats.last_connect_ms, stats.attempts);
+    }
+    stats.attempts = 0;
+
+    if (dns_cacheable && broker_ip[0] == '\0' && supervisor != NULL)
+        xTaskNotify(supervisor, RECONNECT_NOTIFY_RESOLVE, eSetBits);
+}
+
+void reconnect_on_disconnected(void)
+{
+    // Failed attempts also end here: the outage starts at the first one
+    if (disconnected_us == 0)
+        disconnected_us = esp_timer_get_time();
+    awaiting_publish = false;
+    stats.attempts++;
+    if (supervisor != NULL)
+        xTaskNotify(supervisor, RECONNECT_NOTIFY_RECONNECT, eSetBits);
+}
+
+/*
+ * @brief A transport failure may mean the broker moved: resolve the name again next time.
+ */
+void reconnect_on_error(esp_mqtt_event_handle_t event)
+{
+    if (event->error_handle->error_type == MQTT_ERROR_TYPE_TCP_TRANSPORT && broker_ip[0])
+        dns_stale = true;
+}
+
+void reconnect_on_publish(int msg_id)
+{
+    if (!awaiting_publish || msg_id < 0)
+        return;
+    awaiting_publish = false;
+    stats.last_recovery_ms = (esp_timer_get_time() - disconnected_us) / 1000;
+    disconnected_us = 0;
+    ESP_LOGI(TAG, "First publish %" PRIu32 " ms after disconnect", stats.last_recovery_ms);
+}
+
+void reconnect_get_stats(reconnect_stats_t *out)
+{
+    *out = stats;
+}
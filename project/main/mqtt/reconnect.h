@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdint.h>
+#include "mqtt_client.h"
+
+#define RECONNECT_NVS_NAMESPACE "mqtt"
+
+typedef struct {
+    uint32_t reconnects;            // Successful reconnections since boot
+    uint32_t attempts;              // Failed attempts of the current outage
+    uint32_t dns_lookups;           // Broker name resolutions (cache misses)
+    uint32_t last_connect_ms;       // Disconnect to MQTT_EVENT_CONNECTED
+    uint32_t last_recovery_ms;      // Disconnect to first successful publish
+} reconnect_stats_t;
+
+void reconnect_init(esp_mqtt_client_config_t *cfg);
+void reconnect_start(esp_mqtt_client_handle_t client);
+void reconnect_on_connected(void);
+void reconnect_on_disconnected(void);
+void reconnect_on_error(esp_mqtt_event_handle_t event);
+void reconnect_on_publish(int msg_id);
+void reconnect_get_stats(reconnect_stats_t *stats);
@@ -0,0 +1,86 @@
+#include "station.h"
+
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_mac.h"
+#include "nvs.h"
+
+static const char *TAG = "station";
+
+static char id[STATION_ID_LEN];
+
+// The ID is one topic level: no separators, no wildcards
+static bool valid_id(const char *s)
+{
+    if (*s == '\0')
+        return false;
+    for (; *s; s++)
+        if (*s == '/' || *s == '+' || *s == '#' || *s < 0x21 || *s > 0x7E)
+            return false;
+    return true;
+}
+
+/*
+ * @brief Picks the station ID: the "id" string of the station NVS namespace when one was
+ *        provisioned, otherwise the Wi-Fi station MAC address in hex. NVS must be ready.
+ */
+void station_init(void)
+{
+    nvs_handle_t nvs;
+    size_t len = sizeof(id);
+
+    if (nvs_open(STATION_NVS_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK)
+    {
+        if (nvs_get_str(nvs, "id", id, &len) != ESP_OK)
+            id[0] = '\0';
+        nvs_close(nvs);
+        if (id[0] != '\0' && !valid_id(id))
+        {
+            ESP_LOGW(TAG, "Provisioned id \"%s\" is not a valid topic level, using the MAC", id);
+            id[0] = '\0';
+        }
+    }
+
+    if (id[0] == '\0')
+    {
+        uint8_t mac[6];
+        ESP_ERROR_CHECK(esp_read_mac(mac, ESP_MAC_WIFI_STA));
+        snprintf(id, sizeof(id), "%02x%02x%02x%02x%02x%02x",
+                 mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    }
+    ESP_LOGI(TAG, "Station %s", id);
+}
+
+const char *station_id(void)
+{
+    return id;
+}
+
+/*
+ * @brief Writes the topic this station uses for a message kind: stations/<id>/<topic>, or
+ *        the topic unchanged without CONFIG_MQTT_STATION_TOPICS.
+ *
+ * @return Length of the topic, or -1 if buf is too small.
+ */
+int station_topic(const char *topic, char *buf, size_t len)
+{
+#if CONFIG_MQTT_STATION_TOPICS
+    int n = snprintf(buf, len, STATION_TOPIC_ROOT "/%s/%s", id, topic);
+#else
+    int n = snprintf(buf, len, "%s", topic);
+#endif
+    if (n < 0 || (size_t)n >= len)
+        return -1;
+    return n;
+}
+
+/*
+ * @brief Whether a received topic (not terminated) is the given message kind for this station.
+ */
+bool station_topic_is(const char *topic, int topic_len, const char *name)
+{
+    char expected[STATION_TOPIC_LEN];
+    int n = station_topic(name, expected, sizeof(expected));
+    return n == topic_len && !strncmp(topic, expected, topic_len);
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define STATION_NVS_NAMESPACE "station"
+#define STATION_TOPIC_ROOT "stations"
+#define STATION_ID_LEN 24           // Including the terminator
+#define STATION_TOPIC_LEN 64        // Full topic, as long as a topic alias entry
+
+void station_init(void);
+const char *station_id(void);
+int station_topic(const char *topic, char *buf, size_t len);
+bool station_topic_is(const char *topic, int topic_len, const char *name);
@@ -6,9 +6,19 @@
 #include "esp_event.h"
 #include "esp_log.h"
 #include "esp_ota_ops.h"
+#include "esp_app_format.h"
 #include "esp_http_client.h"
-#include "esp_https_ota.h"
+#include "nvs.h"
 #include "string.h"
+#include <strings.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include "esp_timer.h"
+#include "../tls/tls_session.h"
+#include "../mqtt/mqtt.h"
+#include "../boot/boot.h"
+#include "../radio/radio.h"
+#include "../otapatch/otapatch.h"
 #ifdef CONFIG_PROJECT_USE_CERT_BUNDLE
 #include "esp_crt_bundle.h"
 #endif
@@ -22,6 +32,38 @@ extern const uint8_t server_cert_pem_start[] asm("_binary_ca_cert_pem_start");
 extern const uint8_t server_cert_pem_end[] asm("_binary_ca_cert_pem_end");
 
 #define OTA_URL_SIZE 256
+#define OTA_BUF_SIZE 1024
+#define OTA_ETAG_SIZE 64
+#define OTA_RETRY_DELAY_MS 10000
+#define SLOT_ALIGN 16       // Flash write unit with flash encryption
+
+// Where a plain image keeps the build's ELF SHA-256, read to skip the running build
+#define APP_DESC_OFFSET (sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t))
+#define APP_ELF_SHA_OFFSET (APP_DESC_OFFSET + offsetof(esp_app_desc_t, app_elf_sha256))
+#define PREFIX_SIZE (APP_DESC_OFFSET + sizeof(esp_app_desc_t))
+
+static int64_t handshake_start_us = 0;
+static char ota_host[TLS_SESSION_HOST_LEN];
+static char pending_url[OTA_URL_SIZE];
+static volatile bool busy = false;
+static TaskHandle_t task = NULL;
+
+// Response headers of the current request
+static char response_etag[OTA_ETAG_SIZE];
+static char response_range[64];
+
+#ifdef CONFIG_PROJECT_USE_CERT_BUNDLE
+/*
+ * @brief Attaches the certificate bundle. esp-tls calls it once the TCP connection is up and
+ *        right before the handshake, so it also marks where the handshake starts; plain http
+ *        and the embedded CA never get here and are not accounted.
+ */
+static esp_err_t attach_bundle(void *conf)
+{
+    handshake_start_us = esp_timer_get_time();
+    return esp_crt_bundle_attach(conf);
+}
+#endif /* CONFIG_PROJECT_USE_CERT_BUNDLE */
 
 esp_err_t _http_event_handler(esp_http_client_event_t *evt)
 {
@@ -32,12 +74,22 @@ esp_err_t _http_event_handler(esp_http_client_event_t *evt)
         break;
     case HTTP_EVENT_ON_CONNECTED:
         ESP_LOGD(TAG, "HTTP_EVENT_ON_CONNECTED");
+        // esp_http_client has no hook for a saved session: this is always a full handshake
+        if (handshake_start_us)
+        {
+            tls_session_record(ota_host, (esp_timer_get_time() - handshake_start_us) / 1000, false);
+            handshake_start_us = 0;
+        }
         break;
     case HTTP_EVENT_HEADER_SENT:
         ESP_LOGD(TAG, "HTTP_EVENT_HEADER_SENT");
         break;
     case HTTP_EVENT_ON_HEADER:
         ESP_LOGD(TAG, "HTTP_EVENT_ON_HEADER, key=%s, value=%s", evt->header_key, evt->header_value);
+        if (!strcasecmp(evt->header_key, "ETag"))
+            strlcpy(response_etag, evt->header_value, sizeof(response_etag));
+        else if (!strcasecmp(evt->header_key, "Content-Range"))
+            strlcpy(response_range, evt->header_value, sizeof(response_range));
         break;
     case HTTP_EVENT_ON_DATA:
         ESP_LOGD(TAG, "HTTP_EVENT_ON_DATA, len=%d", evt->data_len);
@@ -66,31 +118,478 @@ static void print_sha256(const uint8_t *image_hash, const char *label)
     ESP_LOGI(TAG, "%s %s", label, hash_print);
 }
 
+// Neither the bootloader nor the running image change until the next reboot, and hashing
+// them reads the whole image from flash, so they are hashed once
+static uint8_t bootloader_sha[HASH_LEN];
+static uint8_t running_sha[HASH_LEN];
+static bool sha_cached = false;
+
 static void get_sha256_of_partitions(void)
 {
-    uint8_t sha_256[HASH_LEN] = {0};
-    esp_partition_t partition;
+    if (!sha_cached)
+    {
+        esp_partition_t partition;
 
-    // get sha256 digest for bootloader
-    partition.address = ESP_BOOTLOADER_OFFSET;
-    partition.size = ESP_PARTITION_TABLE_OFFSET;
-    partition.type = ESP_PARTITION_TYPE_APP;
-    esp_partition_get_sha256(&partition, sha_256);
-    print_sha256(sha_256, "SHA-256 for bootloader: ");
+        // get sha256 digest for bootloader
+        partition.address = ESP_BOOTLOADER_OFFSET;
+        partition.size = ESP_PARTITION_TABLE_OFFSET;
+        partition.type = ESP_PARTITION_TYPE_APP;
+        esp_partition_get_sha256(&partition, bootloader_sha);
 
-    // get sha256 digest for running partition
-    esp_partition_get_sha256(esp_ota_get_running_partition(), sha_256);
-    print_sha256(sha_256, "SHA-256 for current firmware: ");
+        // get sha256 digest for running partition
+        esp_partition_get_sha256(esp_ota_get_running_partition(), running_sha);
+        sha_cached = true;
+    }
+    print_sha256(bootloader_sha, "SHA-256 for bootloader: ");
+    print_sha256(running_sha, "SHA-256 for current firmware: ");
 }
 
-void ota_update(char *url)
+/*
+ * @brief Publishes the state of the update on OTA_STATUS_TOPIC as one line protocol line.
+ */
+static void report(const char *state, int progress, int bytes, int total)
+{
+    char line[128];
+    int len = snprintf(line, sizeof(line), "ota state=\"%s\",progress=%di,bytes=%di,total=%di",
+                       state, progress, bytes, total);
+    ESP_LOGI(TAG, "%s %d%% (%d of %d bytes)", state, progress, bytes, total);
+    if (mqtt_is_connected())
+        mqtt_enqueue_qos(OTA_STATUS_TOPIC, line, len, 0);
+}
+
+/*
+ * @brief Keeps the download under CONFIG_OTA_MAX_KBPS by sleeping while it is ahead of
+ *        schedule. Always yields for a tick so tasks of the same priority get the CPU.
+ */
+static void throttle(int64_t start_us, int bytes)
+{
+    TickType_t delay = 1;
+#if CONFIG_OTA_MAX_KBPS > 0
+    int64_t due_us = (int64_t)bytes * 1000 / CONFIG_OTA_MAX_KBPS;    // At 1000 bytes per kB
+    int64_t ahead_ms = (due_us - (esp_timer_get_time() - start_us)) / 1000;
+    if (ahead_ms > 0 && pdMS_TO_TICKS(ahead_ms) > delay)
+        delay = pdMS_TO_TICKS(ahead_ms);
+#endif
+    vTaskDelay(delay);
+}
+
+// Download progress, saved to NVS as one blob so a download cut off by a lost link or a
+// reset continues with a Range request instead of starting over
+typedef struct
+{
+    char url[OTA_URL_SIZE];
+    char etag[OTA_ETAG_SIZE];   // Empty when the server sends none
+    uint32_t slot;              // Address of the partition being written
+    uint32_t total;             // Length of the whole response body
+    uint32_t offset;            // Body bytes whose output is on flash
+    bool is_patch;
+    otapatch_t patch;           // Decoder state at offset, saved for patches only
+} resume_t;
+
+#define RESUME_PLAIN_SIZE offsetof(resume_t, patch)
+
+// The update slot, written directly: esp_ota_begin() in this IDF always starts from an
+// erased slot and cannot continue a partial image
+typedef struct
+{
+    const esp_partition_t *part;
+    uint32_t written;           // Bytes on flash, a multiple of SLOT_ALIGN
+    uint32_t erased;            // End of the erased sectors
+    uint8_t tail[SLOT_ALIGN];
+    uint32_t tail_len;
+} slot_t;
+
+static const esp_partition_t *running = NULL;
+static slot_t slot;
+static resume_t resume;
+static uint8_t buf[OTA_BUF_SIZE];
+
+static bool resume_load(void)
+{
+    nvs_handle_t nvs;
+    size_t len = sizeof(resume);
+    if (nvs_open(OTA_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK)
+        return false;
+    bool ok = nvs_get_blob(nvs, "state", &resume, &len) == ESP_OK &&
+              len == (resume.is_patch ? sizeof(resume) : RESUME_PLAIN_SIZE);
+    nvs_close(nvs);
+    return ok;
+}
+
+static void resume_save(void)
+{
+    nvs_handle_t nvs;
+    if (nvs_open(OTA_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to open NVS, download progress not saved");
+        return;
+    }
+    nvs_set_blob(nvs, "state", &resume, resume.is_patch ? sizeof(resume) : RESUME_PLAIN_SIZE);
+    nvs_commit(nvs);
+    nvs_close(nvs);
+}
+
+static void resume_clear(void)
+{
+    nvs_handle_t nvs;
+    memset(&resume, 0, sizeof(resume));
+    if (nvs_open(OTA_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK)
+        return;
+    nvs_erase_key(nvs, "state");
+    nvs_commit(nvs);
+    nvs_close(nvs);
+}
+
+static void slot_open(uint32_t offset)
+{
+    uint32_t sector = slot.part->erase_size;
+    slot.written = offset;
+    slot.erased = (offset + sector - 1) / sector * sector;
+    slot.tail_len = 0;
+}
+
+static esp_err_t slot_program(const void *data, uint32_t len)
+{
+    while (slot.erased < slot.written + len)
+    {
+        // Not ESP_ERR_INVALID_SIZE: the image does not fit, downloading it again will not help
+        if (slot.erased >= slot.part->size)
+            return ESP_ERR_INVALID_ARG;
+        esp_err_t err = esp_partition_erase_range(slot.part, slot.erased, slot.part->erase_size);
+        if (err != ESP_OK)
+            return err;
+        slot.erased += slot.part->erase_size;
+    }
+    esp_err_t err = esp_partition_write(slot.part, slot.written, data, len);
+    if (err == ESP_OK)
+        slot.written += len;
+    return err;
+}
+
+/*
+ * @brief Appends to the slot. Whole SLOT_ALIGN blocks go to flash at once, the rest waits
+ *        in tail for the next call.
+ */
+static esp_err_t slot_write(const uint8_t *data, uint32_t len)
+{
+    esp_err_t err = ESP_OK;
+    if (slot.tail_len > 0)
+    {
+        uint32_t n = len < SLOT_ALIGN - slot.tail_len ? len : SLOT_ALIGN - slot.tail_len;
+        memcpy(slot.tail + slot.tail_len, data, n);
+        slot.tail_len += n;
+        data += n;
+        len -= n;
+        if (slot.tail_len < SLOT_ALIGN)
+            return ESP_OK;
+        slot.tail_len = 0;
+        err = slot_program(slot.tail, SLOT_ALIGN);
+    }
+    uint32_t aligned = len & ~(SLOT_ALIGN - 1);
+    if (err == ESP_OK && aligned > 0)
+        err = slot_program(data, aligned);
+    memcpy(slot.tail, data + aligned, len - aligned);
+    slot.tail_len = len - aligned;
+    return err;
+}
+
+static esp_err_t slot_finish(void)
+{
+    if (slot.tail_len == 0)
+        return ESP_OK;
+    memset(slot.tail + slot.tail_len, 0xFF, SLOT_ALIGN - slot.tail_len);
+    slot.tail_len = 0;
+    return slot_program(slot.tail, SLOT_ALIGN);
+}
+
+// The decoder flushes whole OTAPATCH_OUT_BUF blocks, so every byte it handed over is on
+// flash when it reads it back
+static int patch_read_source(void *ctx, uint32_t offset, void *dst, uint32_t len)
+{
+    return esp_partition_read(running, offset, dst, len) == ESP_OK ? 0 : -1;
+}
+
+static int patch_read_target(void *ctx, uint32_t offset, void *dst, uint32_t len)
+{
+    return esp_partition_read(slot.part, offset, dst, len) == ESP_OK ? 0 : -1;
+}
+
+static int patch_write_target(void *ctx, const void *src, uint32_t len)
+{
+    return slot_write(src, len) == ESP_OK ? 0 : -1;
+}
+
+static const otapatch_io_t patch_io = {NULL, patch_read_source, patch_read_target, patch_write_target};
+
+static esp_err_t patch_err(int err)
+{
+    switch (err)
+    {
+    case OTAPATCH_OK:
+        return ESP_OK;
+    case OTAPATCH_ERR_TRUNCATED:
+        return ESP_ERR_INVALID_SIZE;
+    case OTAPATCH_ERR_IO:
+        return ESP_FAIL;
+    default:
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+}
+
+/*
+ * @brief Errors after which the download is worth continuing: the link, not the image.
+ *        ESP_ERR_INVALID_SIZE is a truncated body; an image too large for the slot is
+ *        ESP_ERR_INVALID_ARG and is not retried.
+ */
+static bool resumable(esp_err_t err)
+{
+    return err == ESP_ERR_INVALID_SIZE || err == ESP_ERR_TIMEOUT ||
+           (err >= ESP_ERR_HTTP_BASE && err < ESP_ERR_HTTP_BASE + 0x100);
+}
+
+// Reads until the buffer holds len bytes or the body ends
+static int read_full(esp_http_client_handle_t client, uint8_t *dst, int len)
+{
+    int got = 0;
+    while (got < len)
+    {
+        int n = esp_http_client_read(client, (char *)dst + got, len - got);
+        if (n < 0)
+            return n;
+        if (n == 0)
+            break;
+        got += n;
+    }
+    return got;
+}
+
+/*
+ * @brief Checks that a 206 answer continues the saved download: same start, same length
+ *        and, when the server sends one, the same ETag.
+ */
+static bool range_matches(void)
+{
+    uint32_t first, last, total;
+    if (sscanf(response_range, "bytes %" SCNu32 "-%" SCNu32 "/%" SCNu32, &first, &last, &total) != 3)
+        return false;
+    if (first != resume.offset || total != resume.total)
+        return false;
+    return !resume.etag[0] || !response_etag[0] || !strcmp(resume.etag, response_etag);
+}
+
+/*
+ * @brief Starts a download from byte zero: sniffs the first bytes to tell a plain image
+ *        (ESP_IMAGE_HEADER_MAGIC) from an otapatch payload, which is decoded on the fly
+ *        against the running image; tools/ota_patch.c writes those. Leaves the first
+ *        bytes in buf and returns their count, or a negated error.
+ */
+static int start_fresh(esp_http_client_handle_t client, const char *url, int total)
+{
+    int len = read_full(client, buf, PREFIX_SIZE);
+    if (len < OTAPATCH_HEADER_SIZE)
+        return len < 0 ? -ESP_ERR_INVALID_SIZE : -ESP_ERR_INVALID_RESPONSE;
+
+    memset(&resume, 0, sizeof(resume));
+    otapatch_header_t header;
+    resume.is_patch = buf[0] != ESP_IMAGE_HEADER_MAGIC;
+    if (resume.is_patch)
+    {
+        if (otapatch_parse_header(buf, len, &header) != OTAPATCH_OK)
+        {
+            ESP_LOGE(TAG, "Neither a firmware image nor a patch");
+            return -ESP_ERR_NOT_SUPPORTED;
+        }
+        if (!memcmp(header.target_sha256, running_sha, HASH_LEN))
+        {
+            ESP_LOGW(TAG, "Patch produces the running firmware, skipping");
+            return -ESP_ERR_INVALID_VERSION;
+        }
+        if (header.source_size > 0 &&
+            (memcmp(header.source_sha256, running_sha, HASH_LEN) || header.source_size > running->size))
+        {
+            print_sha256(header.source_sha256, "Patch is for another firmware:");
+            return -ESP_ERR_INVALID_STATE;
+        }
+        ESP_LOGI(TAG, "%s to a %" PRIu32 " byte image", header.source_size ? "Delta patch" : "Compressed image",
+                 header.target_size);
+        otapatch_init(&resume.patch, &patch_io);
+    }
+    else if (len == PREFIX_SIZE &&
+             !memcmp(buf + APP_ELF_SHA_OFFSET, esp_app_get_description()->app_elf_sha256, HASH_LEN))
+    {
+        ESP_LOGW(TAG, "Image is the running firmware, skipping");
+        return -ESP_ERR_INVALID_VERSION;
+    }
+
+    uint32_t image_size = resume.is_patch ? header.target_size : (total > 0 ? total : 0);
+    if (image_size > slot.part->size)
+    {
+        ESP_LOGE(TAG, "%" PRIu32 " byte image does not fit the %" PRIu32 " byte slot", image_size, slot.part->size);
+        return -ESP_ERR_INVALID_ARG;
+    }
+
+    strlcpy(resume.url, url, sizeof(resume.url));
+    strlcpy(resume.etag, response_etag, sizeof(resume.etag));
+    resume.slot = slot.part->address;
+    resume.total = total > 0 ? total : 0;
+    slot_open(0);
+    return len;
+}
+
+/*
+ * @brief Compares the written image with the SHA-256 it is expected to carry: from the
+ *        patch header, or appended to a plain image. Reading the slot's hash also runs
+ *        the image verification of the bootloader.
+ */
+static esp_err_t verify_slot(uint32_t size)
+{
+    uint8_t expected[HASH_LEN], sha[HASH_LEN];
+    if (resume.is_patch)
+        memcpy(expected, resume.patch.header.target_sha256, HASH_LEN);
+    else if (size < HASH_LEN || esp_partition_read(slot.part, size - HASH_LEN, expected, HASH_LEN) != ESP_OK)
+        return ESP_ERR_INVALID_ARG;
+
+    esp_err_t err = esp_partition_get_sha256(slot.part, sha);
+    if (err == ESP_OK && memcmp(sha, expected, HASH_LEN))
+    {
+        print_sha256(sha, "Written image does not match:");
+        err = ESP_ERR_INVALID_CRC;
+    }
+    return err;
+}
+
+/*
+ * @brief Streams the response body into the update slot, continuing a saved download of
+ *        the same URL with a Range request. Progress is saved every CONFIG_OTA_CHECKPOINT_KB.
+ */
+static esp_err_t receive(esp_http_client_handle_t client, const char *url)
+{
+    running = esp_ota_get_running_partition();
+    slot.part = esp_ota_get_next_update_partition(NULL);
+    if (slot.part == NULL)
+        return ESP_ERR_NOT_FOUND;
+
+    bool resuming = resume_load() && !strcmp(resume.url, url) && resume.slot == slot.part->address &&
+                    resume.offset > 0 && resume.offset < resume.total;
+    char range[32];
+    if (resuming)
+    {
+        snprintf(range, sizeof(range), "bytes=%" PRIu32 "-", resume.offset);
+        esp_http_client_set_header(client, "Range", range);
+        // A weak ETag cannot be used in If-Range; it is still compared below
+        if (resume.etag[0] && strncmp(resume.etag, "W/", 2))
+            esp_http_client_set_header(client, "If-Range", resume.etag);
+    }
+
+    response_etag[0] = '\0';
+    response_range[0] = '\0';
+    esp_err_t err = esp_http_client_open(client, 0);
+    if (err != ESP_OK)
+        return err;
+    int total = (int)esp_http_client_fetch_headers(client);
+    int status = esp_http_client_get_status_code(client);
+
+    int len;
+    if (resuming && status == 206 && range_matches())
+    {
+        ESP_LOGI(TAG, "Resuming at %" PRIu32 " of %" PRIu32 " bytes", resume.offset, resume.total);
+        if (resume.is_patch)
+        {
+            resume.patch.io = patch_io;
+            slot_open(resume.patch.flushed);
+        }
+        else
+        {
+            slot_open(resume.offset);
+        }
+        len = esp_http_client_read(client, (char *)buf, sizeof(buf));
+    }
+    else if (status == 200)
+    {
+        if (resuming)
+            ESP_LOGW(TAG, "Image changed or range refused, starting over");
+        len = start_fresh(client, url, total);
+        if (len < 0)
+        {
+            resume_clear();
+            return -len;
+        }
+        resume_save();      // Claims the slot: a saved download of another URL is gone
+    }
+    else
+    {
+        ESP_LOGE(TAG, "HTTP status %d", status);
+        if (status == 0)
+            return ESP_ERR_HTTP_FETCH_HEADER;
+        resume_clear();
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+
+    int64_t start = esp_timer_get_time();
+    uint32_t first = resume.offset;
+    uint32_t bytes = resume.offset;
+    uint32_t saved = resume.offset;
+    int reported = -1;
+    while (len > 0)
+    {
+        if (resume.is_patch)
+            err = patch_err(otapatch_feed(&resume.patch, buf, len));
+        else
+            err = slot_write(buf, len);
+        if (err != ESP_OK)
+            break;
+        bytes += len;
+
+        if (resume.total > 0 && bytes - saved >= CONFIG_OTA_CHECKPOINT_KB * 1024)
+        {
+            // A plain image resumes at the last whole block on flash, a patch with the
+            // decoder state that goes with the bytes fed
+            resume.offset = resume.is_patch ? bytes : slot.written;
+            resume_save();
+            saved = bytes;
+        }
+
+        int progress = resume.total > 0 ? (int)((int64_t)bytes * 100 / resume.total) : 0;
+        if (progress / CONFIG_OTA_PROGRESS_STEP != reported)
+        {
+            reported = progress / CONFIG_OTA_PROGRESS_STEP;
+            report("downloading", progress, bytes, resume.total);
+        }
+        throttle(start, bytes - first);
+        len = esp_http_client_read(client, (char *)buf, sizeof(buf));
+    }
+
+    if (err == ESP_OK && (len < 0 || !esp_http_client_is_complete_data_received(client)))
+        err = ESP_ERR_INVALID_SIZE;
+    if (err == ESP_OK && resume.is_patch)
+        err = patch_err(otapatch_finish(&resume.patch));
+    if (err == ESP_OK)
+        err = slot_finish();
+    if (err != ESP_OK)
+    {
+        if (!resumable(err))
+            resume_clear();
+        return err;
+    }
+    ESP_LOGI(TAG, "Downloaded %" PRIu32 " bytes in %" PRId64 " ms", bytes - first,
+             (esp_timer_get_time() - start) / 1000);
+
+    err = verify_slot(bytes);
+    resume_clear();
+    if (err == ESP_OK)
+        err = esp_ota_set_boot_partition(slot.part);
+    return err;
+}
+
+/*
+ * @brief Downloads one image or patch and makes it the boot image.
+ */
+static esp_err_t download(const char *url)
 {
-    ESP_LOGI(TAG, "Starting OTA update");
-    get_sha256_of_partitions();
     esp_http_client_config_t config = {
         .url = url,
 #ifdef CONFIG_PROJECT_USE_CERT_BUNDLE
-        .crt_bundle_attach = esp_crt_bundle_attach,
+        .crt_bundle_attach = attach_bundle,
 #else
         .cert_pem = (char *)server_cert_pem_start,
 #endif /* CONFIG_PROJECT_USE_CERT_BUNDLE */
@@ -102,18 +601,104 @@ void ota_update(char *url)
     config.skip_cert_common_name_check = true;
 #endif
 
-    esp_https_ota_config_t ota_config = {
-        .http_config = &config,
-    };
     ESP_LOGI(TAG, "Attempting to download update from %s", config.url);
-    esp_err_t ret = esp_https_ota(&ota_config);
-    if (ret == ESP_OK)
+    const char *host = strstr(url, "://");
+    host = host ? host + 3 : url;
+    size_t host_len = strcspn(host, ":/");
+    if (host_len >= sizeof(ota_host))
+        host_len = sizeof(ota_host) - 1;
+    memcpy(ota_host, host, host_len);
+    ota_host[host_len] = '\0';
+    handshake_start_us = 0;
+
+    esp_http_client_handle_t client = esp_http_client_init(&config);
+    if (client == NULL)
+        return ESP_FAIL;
+    // The download does not go through the MQTT queues: keep the radio out of power save
+    radio_hold();
+    esp_err_t err = receive(client, url);
+    radio_release();
+    esp_http_client_cleanup(client);
+    return err;
+}
+
+static void ota_task(void *arg)
+{
+    // A download cut off by a reset carries on once the network is back
+    bool queued = busy;
+    if (queued)
+        boot_wait(BOOT_PHASE_WIFI_CONNECTED, portMAX_DELAY);
+
+    while (1)
     {
-        ESP_LOGI(TAG, "OTA Succeed, Rebooting...");
-        esp_restart();
+        if (!queued)
+            xTaskNotifyWait(0, UINT32_MAX, NULL, portMAX_DELAY);
+        queued = false;
+
+        ESP_LOGI(TAG, "Starting OTA update");
+        get_sha256_of_partitions();
+        report("started", 0, 0, 0);
+
+        esp_err_t ret = download(pending_url);
+        for (int retry = 0; retry < CONFIG_OTA_RETRIES && resumable(ret); retry++)
+        {
+            ESP_LOGW(TAG, "Download interrupted: %s, resuming in %d s", esp_err_to_name(ret),
+                     OTA_RETRY_DELAY_MS / 1000);
+            report("interrupted", resume.total > 0 ? (int)((int64_t)resume.offset * 100 / resume.total) : 0,
+                   resume.offset, resume.total);
+            vTaskDelay(pdMS_TO_TICKS(OTA_RETRY_DELAY_MS));
+            ret = download(pending_url);
+        }
+        if (ret == ESP_OK)
+        {
+            report("done", 100, 0, 0);
+            ESP_LOGI(TAG, "OTA Succeed, Rebooting...");
+            // Let the status message and staged samples out first
+            vTaskDelay(pdMS_TO_TICKS(1000));
+            esp_restart();
+        }
+        else
+        {
+            ESP_LOGE(TAG, "Firmware upgrade failed: %s", esp_err_to_name(ret));
+            report(ret == ESP_ERR_INVALID_VERSION ? "current" : "failed", 0, 0, 0);
+        }
+        busy = false;
     }
-    else
+}
+
+/*
+ * @brief Starts the OTA task. It runs at the lowest priority, so sampling and publishing
+ *        preempt the download. A download saved in NVS is queued again. Needs NVS.
+ */
+void ota_init(void)
+{
+    if (resume_load())
+    {
+        ESP_LOGI(TAG, "Unfinished download of %s at %" PRIu32 " of %" PRIu32 " bytes", resume.url,
+                 resume.offset, resume.total);
+        strlcpy(pending_url, resume.url, sizeof(pending_url));
+        busy = true;
+    }
+    xTaskCreate(ota_task, "ota", 8192, NULL, tskIDLE_PRIORITY + 1, &task);
+}
+
+/*
+ * @brief Queues an update from the given URL and returns at once; safe to call from the
+ *        MQTT event handler. Ignored while an update is running.
+ */
+void ota_update(char *url)
+{
+    if (task == NULL || busy)
+    {
+        ESP_LOGW(TAG, "OTA %s, ignoring %s", task == NULL ? "not started" : "in progress", url);
+        return;
+    }
+    if (strlen(url) >= sizeof(pending_url))
     {
-        ESP_LOGE(TAG, "Firmware upgrade failed");
+        ESP_LOGE(TAG, "OTA URL too long");
+        return;
     }
+    busy = true;
+    strcpy(pending_url, url);
+    xTaskNotify(task, 1, eSetBits);
 }
@@ -2,4 +2,9 @@
 
 #include "esp_err.h"
 
+#define OTA_TOPIC "ota"                 // Firmware URL to install
+#define OTA_STATUS_TOPIC "ota/status"
+#define OTA_NVS_NAMESPACE "ota"
+
+void ota_init(void);
 void ota_update(char* url);
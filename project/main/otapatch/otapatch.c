@@ -0,0 +1,311 @@
+#include "otapatch.h"
+
+#include <string.h>
+
+/*
+ * Streaming decoder: otapatch_feed() accepts the patch in pieces of any size, as they come
+ * off the network, and produces the image in order through write_target. RAM use is the
+ * otapatch_t alone; COPY reads earlier output back from the target slot and ADD reads the
+ * running image, so neither a dictionary window nor the old image is held in memory.
+ */
+
+enum {
+    STATE_HEADER,
+    STATE_OP,
+    STATE_VARINT,
+    STATE_LITERAL,
+    STATE_DIFF,
+    STATE_DONE,
+};
+
+_Static_assert(sizeof(otapatch_header_t) == OTAPATCH_HEADER_SIZE, "header size");
+
+static uint32_t min_u32(uint32_t a, uint32_t b)
+{
+    return a < b ? a : b;
+}
+
+int otapatch_parse_header(const uint8_t *data, size_t len, otapatch_header_t *header)
+{
+    if (len < OTAPATCH_HEADER_SIZE)
+        return OTAPATCH_ERR_TRUNCATED;
+    memcpy(header, data, OTAPATCH_HEADER_SIZE);
+    if (header->magic != OTAPATCH_MAGIC || header->version != OTAPATCH_VERSION)
+        return OTAPATCH_ERR_FORMAT;
+    return OTAPATCH_OK;
+}
+
+void otapatch_init(otapatch_t *patch, const otapatch_io_t *io)
+{
+    memset(patch, 0, sizeof(*patch));
+    patch->io = *io;
+    patch->state = STATE_HEADER;
+}
+
+static int flush(otapatch_t *patch)
+{
+    uint32_t pending = patch->out_pos - patch->flushed;
+    if (pending == 0)
+        return OTAPATCH_OK;
+    if (patch->io.write_target(patch->io.ctx, patch->out, pending) != 0)
+        return OTAPATCH_ERR_IO;
+    patch->flushed = patch->out_pos;
+    return OTAPATCH_OK;
+}
+
+static int put(otapatch_t *patch, const uint8_t *data, uint32_t len)
+{
+    if (len > patch->header.target_size - patch->out_pos)
+        return OTAPATCH_ERR_FORMAT;
+    while (len > 0) {
+        uint32_t used = patch->out_pos - patch->flushed;
+        uint32_t n = min_u32(len, OTAPATCH_OUT_BUF - used);
+        memcpy(patch->out + used, data, n);
+        patch->out_pos += n;
+        data += n;
+        len -= n;
+        if (patch->out_pos - patch->flushed == OTAPATCH_OUT_BUF) {
+            int err = flush(patch);
+            if (err != OTAPATCH_OK)
+                return err;
+        }
+    }
+    return OTAPATCH_OK;
+}
+
+// Earlier output, from the target slot or from what is still buffered
+static int read_output(otapatch_t *patch, uint32_t offset, uint8_t *dst, uint32_t len)
+{
+    if (offset < patch->flushed) {
+        uint32_t n = min_u32(len, patch->flushed - offset);
+        if (patch->io.read_target(patch->io.ctx, offset, dst, n) != 0)
+            return OTAPATCH_ERR_IO;
+        offset += n;
+        dst += n;
+        len -= n;
+    }
+    memcpy(dst, patch->out + (offset - patch->flushed), len);
+    return OTAPATCH_OK;
+}
+
+static int read_source(otapatch_t *patch, uint8_t *dst, uint32_t len)
+{
+    if (len > patch->header.source_size || patch->source_pos > patch->header.source_size - len)
+        return OTAPATCH_ERR_FORMAT;
+    if (patch->io.read_source(patch->io.ctx, patch->source_pos, dst, len) != 0)
+        return OTAPATCH_ERR_IO;
+    patch->source_pos += len;
+    return OTAPATCH_OK;
+}
+
+static int copy(otapatch_t *patch, uint32_t distance, uint32_t len)
+{
+    if (distance == 0 || distance > patch->out_pos)
+        return OTAPATCH_ERR_FORMAT;
+    while (len > 0) {
+        // At most distance bytes at a time, so an overlapping copy repeats what it wrote
+        uint32_t n = min_u32(min_u32(len, OTAPATCH_WORK_BUF), distance);
+        int err = read_output(patch, patch->out_pos - distance, patch->work, n);
+        if (err == OTAPATCH_OK)
+            err = put(patch, patch->work, n);
+        if (err != OTAPATCH_OK)
+            return err;
+        len -= n;
+    }
+    return OTAPATCH_OK;
+}
+
+// Source bytes taken unchanged: a zero run of an ADD
+static int add_zero(otapatch_t *patch, uint32_t len)
+{
+    while (len > 0) {
+        uint32_t n = min_u32(len, OTAPATCH_WORK_BUF);
+        int err = read_source(patch, patch->work, n);
+        if (err == OTAPATCH_OK)
+            err = put(patch, patch->work, n);
+        if (err != OTAPATCH_OK)
+            return err;
+        len -= n;
+    }
+    return OTAPATCH_OK;
+}
+
+static int64_t unzigzag(uint64_t v)
+{
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static void next_varint(otapatch_t *patch, int field)
+{
+    patch->field = field;
+    patch->varint = 0;
+    patch->shift = 0;
+    patch->state = STATE_VARINT;
+}
+
+static void end_op(otapatch_t *patch)
+{
+    patch->state = patch->out_pos == patch->header.target_size ? STATE_DONE : STATE_OP;
+}
+
+/*
+ * @brief Acts on a complete varint: stores it, runs the work it enables and picks the next
+ *        state.
+ */
+static int field_done(otapatch_t *patch)
+{
+    uint64_t v = patch->varint;
+    int err = OTAPATCH_OK;
+
+    if (v > UINT32_MAX && !(patch->op == OTAPATCH_OP_ADD && patch->field == 0))
+        return OTAPATCH_ERR_FORMAT;
+
+    switch (patch->op) {
+    case OTAPATCH_OP_LITERAL:
+        patch->count = (uint32_t)v;
+        patch->state = STATE_LITERAL;
+        if (patch->count == 0)
+            end_op(patch);
+        break;
+
+    case OTAPATCH_OP_COPY:
+        if (patch->field == 0) {
+            patch->count = (uint32_t)v;     // Distance
+            next_varint(patch, 1);
+        } else {
+            err = copy(patch, patch->count, (uint32_t)v);
+            end_op(patch);
+        }
+        break;
+
+    case OTAPATCH_OP_ADD:
+        switch (patch->field) {
+        case 0: {
+            int64_t pos = (int64_t)patch->source_pos + unzigzag(v);
+            if (pos < 0 || pos > patch->header.source_size)
+                return OTAPATCH_ERR_FORMAT;
+            patch->source_pos = (uint32_t)pos;
+            next_varint(patch, 1);
+            break;
+        }
+        case 1:
+            patch->len = (uint32_t)v;
+            next_varint(patch, 2);
+            if (patch->len == 0)
+                end_op(patch);
+            break;
+        case 2:     // Zero run
+            if (v > patch->len)
+                return OTAPATCH_ERR_FORMAT;
+            err = add_zero(patch, (uint32_t)v);
+            patch->len -= (uint32_t)v;
+            if (patch->len == 0)
+                end_op(patch);
+            else
+                next_varint(patch, 3);
+            break;
+        case 3:     // Diff count
+            if (v == 0 || v > patch->len)
+                return OTAPATCH_ERR_FORMAT;
+            patch->count = (uint32_t)v;
+            patch->state = STATE_DIFF;
+            break;
+        }
+        break;
+
+    default:
+        return OTAPATCH_ERR_FORMAT;
+    }
+    return err;
+}
+
+/*
+ * @brief Consumes the next piece of the patch. Returns OTAPATCH_OK or an error, after which
+ *        the decoder must not be fed again.
+ */
+int otapatch_feed(otapatch_t *patch, const uint8_t *data, size_t len)
+{
+    int err = OTAPATCH_OK;
+
+    while (len > 0 && err == OTAPATCH_OK) {
+        switch (patch->state) {
+        case STATE_HEADER: {
+            uint32_t n = min_u32(len, OTAPATCH_HEADER_SIZE - patch->count);
+            memcpy(patch->header_buf + patch->count, data, n);
+            patch->count += n;
+            data += n;
+            len -= n;
+            if (patch->count == OTAPATCH_HEADER_SIZE) {
+                err = otapatch_parse_header(patch->header_buf, OTAPATCH_HEADER_SIZE, &patch->header);
+                patch->count = 0;
+                end_op(patch);
+            }
+            break;
+        }
+
+        case STATE_OP:
+            patch->op = *data++;
+            len--;
+            if (patch->op < OTAPATCH_OP_LITERAL || patch->op > OTAPATCH_OP_ADD)
+                return OTAPATCH_ERR_FORMAT;
+            next_varint(patch, 0);
+            break;
+
+        case STATE_VARINT: {
+            uint8_t b = *data++;
+            len--;
+            if (patch->shift > 63)
+                return OTAPATCH_ERR_FORMAT;
+            patch->varint |= (uint64_t)(b & 0x7F) << patch->shift;
+            patch->shift += 7;
+            if (!(b & 0x80))
+                err = field_done(patch);
+            break;
+        }
+
+        case STATE_LITERAL: {
+            uint32_t n = min_u32(len, patch->count);
+            err = put(patch, data, n);
+            data += n;
+            len -= n;
+            patch->count -= n;
+            if (patch->count == 0)
+                end_op(patch);
+            break;
+        }
+
+        case STATE_DIFF: {
+            uint32_t n = min_u32(min_u32(len, patch->count), OTAPATCH_WORK_BUF);
+            err = read_source(patch, patch->work, n);
+            if (err != OTAPATCH_OK)
+                break;
+            for (uint32_t i = 0; i < n; i++)
+                patch->work[i] += data[i];
+            err = put(patch, patch->work, n);
+            data += n;
+            len -= n;
+            patch->count -= n;
+            patch->len -= n;
+            if (patch->len == 0)
+                end_op(patch);
+            else if (patch->count == 0)
+                next_varint(patch, 2);
+            break;
+        }
+
+        case STATE_DONE:
+            return OTAPATCH_ERR_FORMAT;     // Trailing bytes
+        }
+    }
+    return err;
+}
+
+/*
+ * @brief Writes out the buffered tail. Fails unless the whole image was produced.
+ */
+int otapatch_finish(otapatch_t *patch)
+{
+    if (patch->state != STATE_DONE)
+        return OTAPATCH_ERR_TRUNCATED;
+    return flush(patch);
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Kept free of ESP-IDF headers so the host tool can check the patches it writes
+
+#define OTAPATCH_MAGIC 0x5041544F   // "OTAP"
+#define OTAPATCH_VERSION 1
+#define OTAPATCH_HEADER_SIZE 80
+#define OTAPATCH_OUT_BUF 512        // Output not yet handed to write_target
+#define OTAPATCH_WORK_BUF 128
+
+#define OTAPATCH_OK 0
+#define OTAPATCH_ERR_FORMAT -1      // Not a patch, or a corrupted one
+#define OTAPATCH_ERR_IO -2          // A callback failed
+#define OTAPATCH_ERR_TRUNCATED -3   // The stream ended before the image was complete
+
+// Operations, each an opcode byte followed by LEB128 varints:
+//  LITERAL len, then len bytes
+//  COPY    distance, len: repeat output bytes from distance back (compression)
+//  ADD     zigzag(source offset - end of the previous ADD), len, then until len bytes are
+//          produced: zero run, diff count, diff bytes. Output = source + diff (delta updates)
+#define OTAPATCH_OP_LITERAL 1
+#define OTAPATCH_OP_COPY 2
+#define OTAPATCH_OP_ADD 3
+
+typedef struct {
+    uint32_t magic;
+    uint8_t version;
+    uint8_t reserved[3];
+    uint32_t source_size;           // Bytes of source read by ADD, 0 for a compressed full image
+    uint32_t target_size;
+    uint8_t source_sha256[32];      // SHA-256 appended to the source image, zero without source
+    uint8_t target_sha256[32];      // SHA-256 appended to the target image
+} otapatch_header_t;
+
+// The source is the running image, the target the slot being written, which is read back
+// for COPY: no window is kept in RAM. Every callback returns 0 on success.
+typedef struct {
+    void *ctx;
+    int (*read_source)(void *ctx, uint32_t offset, void *dst, uint32_t len);
+    int (*read_target)(void *ctx, uint32_t offset, void *dst, uint32_t len);
+    int (*write_target)(void *ctx, const void *src, uint32_t len);  // Sequential
+} otapatch_io_t;
+
+typedef struct {
+    otapatch_io_t io;
+    otapatch_header_t header;
+    uint8_t header_buf[OTAPATCH_HEADER_SIZE];
+    int state;
+    uint8_t op;
+    int field;                  // Varint of the operation being read
+    uint64_t varint;
+    int shift;
+    uint32_t len;               // Output bytes left in the operation
+    uint32_t count;             // Bytes left in the current literal or diff run
+    uint32_t source_pos;        // Next source byte of an ADD
+    uint32_t out_pos;           // Bytes produced
+    uint32_t flushed;           // Bytes handed to write_target
+    uint8_t out[OTAPATCH_OUT_BUF];
+    uint8_t work[OTAPATCH_WORK_BUF];
+} otapatch_t;
+
+int otapatch_parse_header(const uint8_t *data, size_t len, otapatch_header_t *header);
+void otapatch_init(otapatch_t *patch, const otapatch_io_t *io);
+int otapatch_feed(otapatch_t *patch, const uint8_t *data, size_t len);
+int otapatch_finish(otapatch_t *patch);
@@ -0,0 +1,120 @@
+#include "payload.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+/*
+ * @brief Encodes a sample as one InfluxDB line protocol record.
+ *
+ *  weather temperature=21.53,pressure=1013.25,humidity=45.10,forecast=12i,seq=42i 1700000000000000000
+ *
+ * @return Number of characters written (without the terminator) or -1 if buf is too small.
+ */
+int payload_encode_line(const sample_t* sample, char* buf, size_t len)
+{
+    int n = snprintf(buf, len,
+                     TELEMETRY_MEASUREMENT " temperature=%.2f,pressure=%.2f,humidity=%.2f,forecast=%di,seq=%" PRIu32 "i %" PRId64 "000000",
+                     sample->temperature, sample->pressure, sample->humidity,
+                     sample->forecast, sample->seq, sample->timestamp);
+    if (n < 0 || (size_t)n >= len)
+        return -1;
+    return n;
+}
+
+// CBOR major types (RFC 8949)
+#define CBOR_UINT 0
+#define CBOR_NINT 1
+#define CBOR_TEXT 3
+#define CBOR_MAP 5
+#define CBOR_FLOAT32 0xFA
+
+static int cbor_put_head(uint8_t* buf, size_t len, int pos, int major, uint64_t value)
+{
+    int extra;
+    uint8_t info;
+
+    if (value < 24)              { extra = 0; info = value; }
+    else if (value <= 0xFF)      { extra = 1; info = 24; }
+    else if (value <= 0xFFFF)    { extra = 2; info = 25; }
+    else if (value <= 0xFFFFFFFF){ extra = 4; info = 26; }
+    else                         { extra = 8; info = 27; }
+
+    if (pos < 0 || (size_t)(pos + 1 + extra) > len)
+        return -1;
+
+    buf[pos++] = (major << 5) | info;
+    for (int i = extra - 1; i >= 0; i--)
+        buf[pos++] = value >> (8 * i);
+    return pos;
+}
+
+static int cbor_put_int(uint8_t* buf, size_t len, int pos, int64_t value)
+{
+    if (value < 0)
+        return cbor_put_head(buf, len, pos, CBOR_NINT, (uint64_t)(-1 - value));
+    return cbor_put_head(buf, len, pos, CBOR_UINT, value);
+}
+
+static int cbor_put_key(uint8_t* buf, size_t len, int pos, char key)
+{
+    pos = cbor_put_head(buf, len, pos, CBOR_TEXT, 1);
+    if (pos < 0 || (size_t)pos >= len)
+        return -1;
+    buf[pos++] = key;
+    return pos;
+}
+
+static int cbor_put_float(uint8_t* buf, size_t len, int pos, float value)
+{
+    uint32_t bits;
+    if (pos < 0 || (size_t)(pos + 5) > len)
+        return -1;
+    memcpy(&bits, &value, sizeof(bits));
+    buf[pos++] = CBOR_FLOAT32;
+    for (int i = 3; i >= 0; i--)
+        buf[pos++] = bits >> (8 * i);
+    return pos;
+}
+
+/*
+ * @brief Encodes a sample as a CBOR map: {"t": ms, "s": seq, "T": *C, "P": hPa, "H": %RH, "F": forecast}
+ *
+ *  Channels are float32, so a full sample takes about 40 bytes.
+ *
+ * @return Number of bytes written or -1 if buf is too small.
+ */
+int payload_encode_cbor(const sample_t* sample, uint8_t* buf, size_t len)
+{
+    int pos = cbor_put_head(buf, len, 0, CBOR_MAP, 6);
+    pos = cbor_put_key(buf, len, pos, 't');
+    pos = cbor_put_int(buf, len, pos, sample->timestamp);
+    pos = cbor_put_key(buf, len, pos, 's');
+    pos = cbor_put_int(buf, len, pos, sample->seq);
+    pos = cbor_put_key(buf, len, pos, 'T');
+    pos = cbor_put_float(buf, len, pos, sample->temperature);
+    pos = cbor_put_key(buf, len, pos, 'P');
+    pos = cbor_put_float(buf, len, pos, sample->pressure);
+    pos = cbor_put_key(buf, len, pos, 'H');
+    pos = cbor_put_float(buf, len, pos, sample->humidity);
+    pos = cbor_put_key(buf, len, pos, 'F');
+    pos = cbor_put_int(buf, len, pos, sample->forecast);
+    return pos;
+}
+
+int payload_encode(payload_format_t format, const sample_t* sample, uint8_t* buf, size_t len)
+{
+    switch (format)
+    {
+    case PAYLOAD_FORMAT_CBOR:
+        return payload_encode_cbor(sample, buf, len);
+    case PAYLOAD_FORMAT_LINE:
+    default:
+        return payload_encode_line(sample, (char*)buf, len);
+    }
+}
+
+const char* payload_topic(payload_format_t format)
+{
+    return format == PAYLOAD_FORMAT_CBOR ? TELEMETRY_CBOR_TOPIC : TELEMETRY_LINE_TOPIC;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Kept free of ESP-IDF headers so host tools can reuse the encoders
+
+#define PAYLOAD_MAX_LEN 160
+
+#define TELEMETRY_MEASUREMENT "weather"
+#define TELEMETRY_LINE_TOPIC "telemetry/influx"
+#define TELEMETRY_CBOR_TOPIC "telemetry/cbor"
+
+typedef enum {
+    PAYLOAD_FORMAT_LINE,    // InfluxDB line protocol, text
+    PAYLOAD_FORMAT_CBOR,    // CBOR map with single-letter keys
+} payload_format_t;
+
+typedef struct {
+    int64_t timestamp;      // Unix epoch, milliseconds
+    uint32_t seq;           // Monotonic sample sequence number
+    float temperature;      // *C
+    float pressure;         // hPa
+    float humidity;         // %RH
+    int forecast;           // Zambretti forecast index, 0 when unknown
+} sample_t;
+
+int payload_encode_line(const sample_t* sample, char* buf, size_t len);
+int payload_encode_cbor(const sample_t* sample, uint8_t* buf, size_t len);
+int payload_encode(payload_format_t format, const sample_t* sample, uint8_t* buf, size_t len);
+const char* payload_topic(payload_format_t format);
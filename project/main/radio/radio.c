@@ -0,0 +1,186 @@
+#include "radio.h"
+
+#include <inttypes.h>
+#include "freertos/task.h"
+#include "freertos/event_groups.h"
+#include "esp_wifi.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "../mqtt/mqtt.h"
+#include "../mqtt/outbox.h"
+#include "../mqtt/publisher.h"
+
+#define RADIO_POLL_MS 20
+#define WINDOW_BIT 0x01
+
+#if CONFIG_RADIO_PS_MAX_MODEM
+#define RADIO_PS WIFI_PS_MAX_MODEM
+#elif CONFIG_RADIO_PS_MIN_MODEM
+#define RADIO_PS WIFI_PS_MIN_MODEM
+#else
+#define RADIO_PS WIFI_PS_NONE
+#endif
+
+static const char *TAG = "radio";
+
+/*
+ * Between transmissions the station sleeps in modem power save and only wakes for beacons.
+ * A transmit window switches power save off while messages go out, so TCP acks and PUBACKs
+ * come back at once instead of waiting at the access point for the next listen interval,
+ * and the radio is back asleep as soon as the queues are empty.
+ */
+
+static TaskHandle_t task = NULL;
+static EventGroupHandle_t events = NULL;
+static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+static int holds = 0;
+static int keepalive_s = 120;
+static int64_t on_us = 0;
+static radio_stats_t stats;
+
+static bool held(void)
+{
+    portENTER_CRITICAL(&lock);
+    bool h = holds > 0;
+    portEXIT_CRITICAL(&lock);
+    return h;
+}
+
+// Nothing left to send or to wait an ack for
+static bool idle(void)
+{
+    if (!mqtt_is_connected())
+        return true;
+    outbox_stats_t outbox;
+    outbox_get_stats(&outbox);
+    return publisher_pending() == 0 && mqtt_outbox_size() == 0 && outbox.occupancy == 0;
+}
+
+static void set_ps(wifi_ps_type_t mode)
+{
+    esp_err_t err = esp_wifi_set_ps(mode);
+    if (err != ESP_OK)
+        ESP_LOGW(TAG, "Power save mode %d refused: %s", mode, esp_err_to_name(err));
+}
+
+/*
+ * @brief Opens a window on the first request and closes it once the stack has been idle
+ *        for CONFIG_RADIO_WINDOW_TAIL_MS, or after CONFIG_RADIO_WINDOW_MAX_MS, unless held.
+ */
+static void radio_task(void *arg)
+{
+    while (1)
+    {
+        xTaskNotifyWait(0, UINT32_MAX, NULL, portMAX_DELAY);
+
+        int64_t start = esp_timer_get_time();
+        set_ps(WIFI_PS_NONE);
+        xEventGroupSetBits(events, WINDOW_BIT);
+
+        int quiet_ms = 0;
+        while (held() || quiet_ms < CONFIG_RADIO_WINDOW_TAIL_MS)
+        {
+            bool woken = xTaskNotifyWait(0, UINT32_MAX, NULL, pdMS_TO_TICKS(RADIO_POLL_MS)) == pdTRUE;
+            quiet_ms = woken || !idle() ? 0 : quiet_ms + RADIO_POLL_MS;
+            if (!held() && esp_timer_get_time() - start >= CONFIG_RADIO_WINDOW_MAX_MS * 1000LL)
+            {
+                stats.cut_short++;
+                break;
+            }
+        }
+
+        xEventGroupClearBits(events, WINDOW_BIT);
+        set_ps(RADIO_PS);
+
+        int64_t elapsed = esp_timer_get_time() - start;
+        on_us += elapsed;
+        stats.windows++;
+        stats.window_last_ms = elapsed / 1000;
+        if (stats.window_last_ms > stats.window_max_ms)
+            stats.window_max_ms = stats.window_last_ms;
+        ESP_LOGD(TAG, "Window of %" PRIu32 " ms", stats.window_last_ms);
+    }
+}
+
+/*
+ * @brief Puts the station in the configured power save mode and starts the scheduler.
+ *        Called once the Wi-Fi driver is initialised and before the MQTT client starts.
+ *
+ * @param window_period_s Expected time between transmit windows; sets the keepalive.
+ */
+void radio_init(int window_period_s)
+{
+    // esp-mqtt pings after keepalive/2 without an outgoing packet: at three periods no ping
+    // falls between two windows, and a missed window or two still does not cost one
+    if (3 * window_period_s > keepalive_s)
+        keepalive_s = 3 * window_period_s;
+    stats.listen_interval = CONFIG_RADIO_LISTEN_INTERVAL;
+
+    set_ps(RADIO_PS);
+    events = xEventGroupCreate();
+#if !CONFIG_RADIO_PS_NONE
+    xTaskCreate(radio_task, "radio", 2560, NULL, tskIDLE_PRIORITY + 2, &task);
+#endif
+    ESP_LOGI(TAG, "Power save %d, listen interval %d, keepalive %d s", RADIO_PS,
+             CONFIG_RADIO_LISTEN_INTERVAL, keepalive_s);
+}
+
+/*
+ * @brief MQTT keepalive matched to the window period.
+ */
+int radio_keepalive_s(void)
+{
+    return keepalive_s;
+}
+
+/*
+ * @brief Opens a transmit window, or keeps the current one open. Called on every publish;
+ *        never blocks.
+ */
+void radio_wake(void)
+{
+    if (task != NULL)
+        xTaskNotify(task, 1, eSetBits);
+}
+
+/*
+ * @brief Keeps the radio at full power until the matching radio_release(), for transfers
+ *        that do not go through the MQTT queues, such as an OTA download.
+ */
+void radio_hold(void)
+{
+    portENTER_CRITICAL(&lock);
+    holds++;
+    portEXIT_CRITICAL(&lock);
+    radio_wake();
+}
+
+void radio_release(void)
+{
+    portENTER_CRITICAL(&lock);
+    if (holds > 0)
+        holds--;
+    portEXIT_CRITICAL(&lock);
+}
+
+/*
+ * @brief Waits for the next transmit window so an occasional message rides along with the
+ *        telemetry instead of waking the radio on its own. Returns false on timeout; always
+ *        true when power save is off.
+ */
+bool radio_wait_window(TickType_t timeout)
+{
+    if (task == NULL)
+        return true;
+    return xEventGroupWaitBits(events, WINDOW_BIT, pdFALSE, pdTRUE, timeout) & WINDOW_BIT;
+}
+
+void radio_get_stats(radio_stats_t *out)
+{
+    int64_t uptime_us = esp_timer_get_time();
+    *out = stats;
+    if (task == NULL)
+        out->on_ms_per_hour = 3600000;
+    else if (uptime_us >= 1000)
+        out->on_ms_per_hour = on_us / 1000 * 3600000 / (uptime_us / 1000);
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+
+typedef struct {
+    uint32_t windows;           // Transmit windows opened
+    uint32_t window_last_ms;    // Length of the last one
+    uint32_t window_max_ms;
+    uint32_t cut_short;         // Windows closed by CONFIG_RADIO_WINDOW_MAX_MS with traffic left
+    uint32_t on_ms_per_hour;    // Time at full power, averaged over uptime
+    uint32_t listen_interval;   // Beacon intervals between wake-ups in max modem sleep
+} radio_stats_t;
+
+void radio_init(int window_period_s);
+int radio_keepalive_s(void);
+void radio_wake(void);
+void radio_hold(void);
+void radio_release(void);
+bool radio_wait_window(TickType_t timeout);
+void radio_get_stats(radio_stats_t *stats);
@@ -0,0 +1,255 @@
+#include "ringlog.h"
+
+#include <stddef.h>
+#include <string.h>
+
+/*
+ * Layout: the partition is a ring of 4 KB sectors. Each sector starts with a header carrying
+ * a sequence number that grows by one every time a sector is (re)started, followed by
+ * fixed-size record slots written in order. A record is record_size - 1 bytes of data and a
+ * CRC-8 byte.
+ *
+ * Crash consistency relies on NOR semantics only:
+ *  - a sector is erased before its header is written, so a crash in between leaves a sector
+ *    without a valid header, which mount ignores and the next append erases again;
+ *  - records are appended in slot order, so the written slots of a sector form a prefix and
+ *    the first erased slot is found by binary search;
+ *  - the CRC byte is programmed in a separate write after the data and is never 0xFF, so a
+ *    record cut short by a power loss is skipped over on mount and rejected on read.
+ */
+
+typedef struct {
+    uint32_t magic;
+    uint32_t seq;
+    uint16_t record_size;
+    uint8_t version;
+    uint8_t crc;            // CRC-8 of the fields above
+    uint32_t reserved;      // Left erased
+} ringlog_header_t;
+
+_Static_assert(sizeof(ringlog_header_t) == RINGLOG_HEADER_SIZE, "header size");
+
+// CRC-8, polynomial 0x07, mapped away from the erased value
+static uint8_t crc8(const void *data, uint32_t len)
+{
+    const uint8_t *p = data;
+    uint8_t crc = 0;
+    while (len--) {
+        crc ^= *p++;
+        for (int i = 0; i < 8; i++)
+            crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+    }
+    return crc == 0xFF ? 0xFE : crc;
+}
+
+static bool is_erased(const void *data, uint32_t len)
+{
+    const uint8_t *p = data;
+    while (len--)
+        if (*p++ != 0xFF)
+            return false;
+    return true;
+}
+
+static uint32_t sector_offset(uint32_t sector)
+{
+    return sector * RINGLOG_SECTOR_SIZE;
+}
+
+static uint32_t record_offset(const ringlog_t *log, uint32_t sector, uint32_t slot)
+{
+    return sector_offset(sector) + RINGLOG_HEADER_SIZE + slot * log->record_size;
+}
+
+static int read_header(const ringlog_t *log, uint32_t sector, uint32_t *seq)
+{
+    ringlog_header_t header;
+    if (log->flash.read(log->flash.ctx, sector_offset(sector), &header, sizeof(header)) != 0)
+        return RINGLOG_ERR_FLASH;
+    if (header.magic != RINGLOG_SECTOR_MAGIC || header.version != RINGLOG_VERSION ||
+        header.record_size != log->record_size ||
+        header.crc != crc8(&header, offsetof(ringlog_header_t, crc)))
+        return RINGLOG_ERR_CRC;
+    *seq = header.seq;
+    return RINGLOG_OK;
+}
+
+static int slot_erased(const ringlog_t *log, uint32_t sector, uint32_t slot, bool *erased)
+{
+    uint8_t chunk[32];
+    uint32_t offset = record_offset(log, sector, slot);
+
+    *erased = true;
+    for (uint32_t done = 0; done < log->record_size && *erased; done += sizeof(chunk)) {
+        uint32_t len = log->record_size - done < sizeof(chunk) ? log->record_size - done : sizeof(chunk);
+        if (log->flash.read(log->flash.ctx, offset + done, chunk, len) != 0)
+            return RINGLOG_ERR_FLASH;
+        *erased = is_erased(chunk, len);
+    }
+    return RINGLOG_OK;
+}
+
+/*
+ * @brief Finds the newest and oldest sectors and the first free slot of the newest one.
+ *
+ *  Reads one header per sector plus log2(slots per sector) records. Sectors written with
+ *  another record size are treated as free.
+ */
+int ringlog_mount(ringlog_t *log, const ringlog_flash_t *flash, uint32_t record_size)
+{
+    memset(log, 0, sizeof(*log));
+    log->flash = *flash;
+    log->sectors = flash->size / RINGLOG_SECTOR_SIZE;
+    log->record_size = record_size;
+    log->empty = true;
+    if (log->sectors < 2 || flash->size % RINGLOG_SECTOR_SIZE != 0 ||
+        record_size < 2 || record_size > RINGLOG_MAX_RECORD_SIZE) {
+        log->sectors = 0;
+        return RINGLOG_ERR_INVALID;
+    }
+    log->per_sector = (RINGLOG_SECTOR_SIZE - RINGLOG_HEADER_SIZE) / record_size;
+
+    for (uint32_t sector = 0; sector < log->sectors; sector++) {
+        uint32_t seq;
+        int err = read_header(log, sector, &seq);
+        if (err == RINGLOG_ERR_FLASH)
+            return err;
+        if (err != RINGLOG_OK)
+            continue;
+        if (log->empty || (int32_t)(seq - log->head_seq) > 0) {
+            log->head_sector = sector;
+            log->head_seq = seq;
+        }
+        if (log->empty || (int32_t)(seq - log->oldest_seq) < 0) {
+            log->oldest_sector = sector;
+            log->oldest_seq = seq;
+        }
+        log->empty = false;
+    }
+    if (log->empty)
+        return RINGLOG_OK;
+
+    // Sectors are started in ring order, so the oldest one still valid is at most
+    // sectors - 1 behind the head
+    if (log->head_seq - log->oldest_seq >= log->sectors) {
+        log->oldest_seq = log->head_seq - (log->sectors - 1);
+        log->oldest_sector = (log->head_sector + 1) % log->sectors;
+    }
+
+    // First erased slot of the head sector
+    uint32_t lo = 0, hi = log->per_sector;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        bool erased;
+        if (slot_erased(log, log->head_sector, mid, &erased) != RINGLOG_OK)
+            return RINGLOG_ERR_FLASH;
+        if (erased)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    log->head_slot = lo;
+    return RINGLOG_OK;
+}
+
+/*
+ * @brief Erases the next sector and makes it the head, dropping the oldest sector when the
+ *        ring is full.
+ */
+static int start_sector(ringlog_t *log)
+{
+    uint32_t sector = log->empty ? 0 : (log->head_sector + 1) % log->sectors;
+    uint32_t seq = log->empty ? 0 : log->head_seq + 1;
+
+    if (!log->empty && sector == log->oldest_sector) {
+        log->oldest_sector = (log->oldest_sector + 1) % log->sectors;
+        log->oldest_seq++;
+    }
+
+    if (log->flash.erase(log->flash.ctx, sector_offset(sector), RINGLOG_SECTOR_SIZE) != 0)
+        return RINGLOG_ERR_FLASH;
+    log->erases++;
+
+    ringlog_header_t header;
+    memset(&header, 0xFF, sizeof(header));
+    header.magic = RINGLOG_SECTOR_MAGIC;
+    header.seq = seq;
+    header.record_size = log->record_size;
+    header.version = RINGLOG_VERSION;
+    header.crc = crc8(&header, offsetof(ringlog_header_t, crc));
+    if (log->flash.write(log->flash.ctx, sector_offset(sector), &header, sizeof(header)) != 0)
+        return RINGLOG_ERR_FLASH;
+
+    if (log->empty) {
+        log->oldest_sector = sector;
+        log->oldest_seq = seq;
+        log->empty = false;
+    }
+    log->head_sector = sector;
+    log->head_seq = seq;
+    log->head_slot = 0;
+    return RINGLOG_OK;
+}
+
+/*
+ * @brief Appends one record of record_size - 1 data bytes. Two flash writes, plus a sector
+ *        erase whenever the head sector is full.
+ */
+int ringlog_append(ringlog_t *log, const void *data)
+{
+    if (log->sectors == 0)
+        return RINGLOG_ERR_INVALID;
+    if (log->empty || log->head_slot >= log->per_sector) {
+        int err = start_sector(log);
+        if (err != RINGLOG_OK)
+            return err;
+    }
+
+    uint32_t len = log->record_size - 1;
+    uint8_t crc = crc8(data, len);
+
+    // The slot is consumed even if a write fails: it may hold part of the record
+    uint32_t offset = record_offset(log, log->head_sector, log->head_slot++);
+    if (log->flash.write(log->flash.ctx, offset, data, len) != 0 ||
+        log->flash.write(log->flash.ctx, offset + len, &crc, 1) != 0)
+        return RINGLOG_ERR_FLASH;
+    return RINGLOG_OK;
+}
+
+/*
+ * @brief Number of record slots in use, torn ones included. Positions run from 0 (oldest).
+ */
+uint32_t ringlog_count(const ringlog_t *log)
+{
+    if (log->empty)
+        return 0;
+    return (log->head_seq - log->oldest_seq) * log->per_sector + log->head_slot;
+}
+
+uint32_t ringlog_capacity(const ringlog_t *log)
+{
+    return log->sectors * log->per_sector;
+}
+
+/*
+ * @brief Reads the record_size - 1 data bytes at a position, 0 being the oldest. Returns
+ *        RINGLOG_ERR_CRC for a torn record, which callers should skip.
+ */
+int ringlog_read(const ringlog_t *log, uint32_t position, void *data)
+{
+    if (position >= ringlog_count(log))
+        return RINGLOG_ERR_RANGE;
+
+    uint32_t sector = (log->oldest_sector + position / log->per_sector) % log->sectors;
+    uint32_t slot = position % log->per_sector;
+    uint32_t offset = record_offset(log, sector, slot);
+    uint32_t len = log->record_size - 1;
+    uint8_t crc;
+
+    if (log->flash.read(log->flash.ctx, offset, data, len) != 0 ||
+        log->flash.read(log->flash.ctx, offset + len, &crc, 1) != 0)
+        return RINGLOG_ERR_FLASH;
+    if (crc != crc8(data, len))
+        return RINGLOG_ERR_CRC;
+    return RINGLOG_OK;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Kept free of ESP-IDF headers so host tools can run the log on an emulated flash
+
+#define RINGLOG_SECTOR_SIZE 4096
+#define RINGLOG_SECTOR_MAGIC 0x474F4C52 // "RLOG"
+#define RINGLOG_VERSION 2
+#define RINGLOG_HEADER_SIZE 16
+#define RINGLOG_MAX_RECORD_SIZE 1024
+
+#define RINGLOG_OK 0
+#define RINGLOG_ERR_FLASH -1        // The flash driver reported an error
+#define RINGLOG_ERR_RANGE -2        // No record at that position
+#define RINGLOG_ERR_CRC -3          // Torn or corrupted record
+#define RINGLOG_ERR_INVALID -4      // Unusable flash geometry
+
+// NOR flash access: writes only clear bits, erases set whole sectors to 0xFF.
+// Every callback returns 0 on success.
+typedef struct {
+    void *ctx;
+    uint32_t size;      // Bytes, a multiple of RINGLOG_SECTOR_SIZE
+    int (*read)(void *ctx, uint32_t offset, void *dst, uint32_t len);
+    int (*write)(void *ctx, uint32_t offset, const void *src, uint32_t len);
+    int (*erase)(void *ctx, uint32_t offset, uint32_t len);
+} ringlog_flash_t;
+
+typedef struct {
+    ringlog_flash_t flash;
+    uint32_t sectors;
+    uint32_t record_size;   // Bytes per slot, the last one holding the CRC
+    uint32_t per_sector;    // Record slots per sector
+    bool empty;
+    uint32_t head_sector;   // Sector being filled
+    uint32_t head_seq;
+    uint32_t head_slot;     // Next free record slot in the head sector
+    uint32_t oldest_sector;
+    uint32_t oldest_seq;
+    uint32_t erases;        // Sector erases since mount
+} ringlog_t;
+
+int ringlog_mount(ringlog_t *log, const ringlog_flash_t *flash, uint32_t record_size);
+int ringlog_append(ringlog_t *log, const void *data);
+uint32_t ringlog_count(const ringlog_t *log);
+int ringlog_read(const ringlog_t *log, uint32_t position, void *data);
+uint32_t ringlog_capacity(const ringlog_t *log);
@@ -1,45 +1,162 @@
 #include "sntp.h"
+#include <stdlib.h>
+#include <inttypes.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_timer.h"
+#include "../boot/boot.h"
 
 static const char* TAG = TAG_SNTP;
 
+// Clock model: epoch = anchorEpochUs + elapsed * (1 + driftPpm / 1e6), elapsed being the
+// esp_timer time since the anchor. Every sync re-anchors the model and refines the drift of
+// the crystal against the servers; samples are converted through it, so a sync also dates
+// the samples taken before it.
+static int64_t anchorMonoUs = 0;
+static int64_t anchorEpochUs = 0;   // 0 while the wall clock is unknown
+static double driftPpm = 0;
+static clock_stats_t stats;
+static portMUX_TYPE clockLock = portMUX_INITIALIZER_UNLOCKED;
+
+static int64_t predictEpochUs(int64_t monotonicUs) {
+    int64_t elapsed = monotonicUs - anchorMonoUs;
+    return anchorEpochUs + elapsed + (int64_t)(elapsed * driftPpm / 1e6);
+}
+
+/*
+ * @brief Next poll interval: as long as the drift error seen over the last interval keeps
+ *        the predicted error within CONFIG_CLOCK_MAX_ERROR_MS, at most doubling per sync.
+ *        A prediction that missed the bound halves it.
+ */
+static uint32_t nextPollS(int64_t residualUs, int64_t elapsedUs) {
+    const int64_t boundUs = CONFIG_CLOCK_MAX_ERROR_MS * 1000LL;
+    uint32_t poll = stats.pollIntervalS;
+
+    if (llabs(residualUs) > boundUs) {
+        poll /= 2;
+    } else {
+        // Drift error in ppm, never trusted below CLOCK_DRIFT_FLOOR_PPB (temperature swings)
+        double errorPpm = (double)llabs(residualUs) * 1e6 / elapsedUs;
+        if (errorPpm < CLOCK_DRIFT_FLOOR_PPB / 1000.0)
+            errorPpm = CLOCK_DRIFT_FLOOR_PPB / 1000.0;
+        double fit = boundUs / errorPpm;    // Seconds: us / (us per s)
+        poll = fit > 2.0 * poll ? 2 * poll : (uint32_t)fit;
+    }
+    if (poll < CONFIG_CLOCK_POLL_MIN_S)
+        poll = CONFIG_CLOCK_POLL_MIN_S;
+    if (poll > CONFIG_CLOCK_POLL_MAX_S)
+        poll = CONFIG_CLOCK_POLL_MAX_S;
+    return poll;
+}
+
+// Called from the lwIP task on every sync, before the next poll is scheduled
+static void onTimeSync(struct timeval* tv) {
+    int64_t nowMono = esp_timer_get_time();
+    int64_t nowEpoch = (int64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+
+    portENTER_CRITICAL(&clockLock);
+    int64_t elapsed = nowMono - anchorMonoUs;
+    bool modelled = stats.syncs > 0 && elapsed > 0;
+    int64_t residual = modelled ? nowEpoch - predictEpochUs(nowMono) : 0;
+    if (modelled) {
+        // Raw drift over this interval, smoothed once characterized
+        double measured = driftPpm + residual * 1e6 / (double)elapsed;
+        driftPpm = stats.syncs == 1 ? measured : driftPpm + (measured - driftPpm) / 4;
+    }
+    anchorMonoUs = nowMono;
+    anchorEpochUs = nowEpoch;
+    stats.syncs++;
+    stats.lastResidualUs = residual;
+    stats.driftPpb = (int32_t)(driftPpm * 1000);
+    stats.pollIntervalS = modelled ? nextPollS(residual, elapsed) : CONFIG_CLOCK_POLL_MIN_S;
+    uint32_t poll = stats.pollIntervalS;
+    portEXIT_CRITICAL(&clockLock);
+
+    // Applies to the poll lwIP schedules after this callback
+    sntp_set_sync_interval(poll * 1000);
+    boot_mark(BOOT_PHASE_TIME_SYNCED);
+    ESP_LOGI(TAG, "Time synchronized: off by %" PRId64 " us, drift %.3f ppm, next poll in %" PRIu32 " s",
+             residual, driftPpm, poll);
+}
+
+/*
+ * @brief Starts SNTP without waiting for it: the first sync calls onTimeSync() from the lwIP task.
+ */
 void time_init(void) {
     ESP_LOGI(TAG, "Initializing SNTP");
-    esp_sntp_setoperatingmode(SNTP_OPMODE_POLL);
-    esp_sntp_setservername(0, "pool.ntp.org");
-    esp_sntp_init();
-    time_t now;
-    struct tm timeinfo;
-    int retry = 0;
-    while (timeinfo.tm_year < (2016 - 1900) && ++retry < RETRY_COUNT){
-        ESP_LOGI(TAG, "Waiting for system time to be set... (%d/%d)", retry, RETRY_COUNT);
-        vTaskDelay(2000 / portTICK_PERIOD_MS);
-        time(&now);
-        localtime_r(&now, &timeinfo);
-    }
 
-    if (retry == RETRY_COUNT) {
-        ESP_LOGE(TAG, "Failed to synchronize time with SNTP server");
+    // The RTC keeps the system time across software resets and deep sleep
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    if (now.tv_sec >= SNTP_VALID_EPOCH_S) {
+        portENTER_CRITICAL(&clockLock);
+        anchorMonoUs = esp_timer_get_time();
+        anchorEpochUs = (int64_t)now.tv_sec * 1000000 + now.tv_usec;
+        portEXIT_CRITICAL(&clockLock);
+        ESP_LOGI(TAG, "System time kept across the reset");
     }
 
-    time(&now);
-    localtime_r(&now, &timeinfo);
+    stats.pollIntervalS = CONFIG_CLOCK_POLL_MIN_S;
+    sntp_set_sync_interval(CONFIG_CLOCK_POLL_MIN_S * 1000);
+    sntp_set_time_sync_notification_cb(onTimeSync);
+    esp_sntp_setoperatingmode(SNTP_OPMODE_POLL);
+    esp_sntp_setservername(0, "pool.ntp.org");
+    esp_sntp_init();
 
     // Set timezone to WET (Western European Time) and DST to WEST (Western European Summer Time)
     setenv("TZ", "WET0WEST,M3.5.0/1,M10.5.0/2", 1);
     tzset();
+}
+
+bool clockIsSynced(void) {
+    portENTER_CRITICAL(&clockLock);
+    bool synced = anchorEpochUs != 0;
+    portEXIT_CRITICAL(&clockLock);
+    return synced;
+}
+
+/*
+ * @brief Converts an esp_timer_get_time() value of this boot to epoch milliseconds, drift
+ *        corrected. Returns -1 while the clock is not synced.
+ */
+int64_t clockToEpochMs(int64_t monotonicUs) {
+    portENTER_CRITICAL(&clockLock);
+    int64_t epochUs = anchorEpochUs != 0 ? predictEpochUs(monotonicUs) : -1000;
+    portEXIT_CRITICAL(&clockLock);
+    return epochUs / 1000;
+}
 
-    time(&now);
-    localtime_r(&now, &timeinfo);
+/*
+ * @brief Length in esp_timer microseconds of a wall clock interval, for periodic timers
+ *        that should keep wall clock cadence.
+ */
+int64_t clockLocalPeriodUs(int64_t wallUs) {
+    portENTER_CRITICAL(&clockLock);
+    double drift = driftPpm;
+    portEXIT_CRITICAL(&clockLock);
+    return (int64_t)(wallUs / (1 + drift / 1e6));
 }
 
-char* getTimestamp(void) {
-    time_t now;
+void clockGetStats(clock_stats_t* out) {
+    portENTER_CRITICAL(&clockLock);
+    *out = stats;
+    portEXIT_CRITICAL(&clockLock);
+}
+
+/*
+ * @brief Formats epoch milliseconds as local time. Not reentrant: returns a static buffer.
+ */
+char* getTimestamp(int64_t epochMs) {
+    time_t seconds = epochMs / 1000;
     struct tm timeinfo;
-    time(&now);
-    // adjust_time(now);
-    localtime_r(&now, &timeinfo);
+    localtime_r(&seconds, &timeinfo);
 
     static char time_str[20];
     strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", &timeinfo);
     return time_str;
+}
+
+int64_t getEpochMs(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
 }
\ No newline at end of file
@@ -1,10 +1,24 @@
 #include "esp_log.h"
 #include "esp_sntp.h"
+#include <stdbool.h>
 #include <time.h>
 #include <sys/time.h>
 
 #define TAG_SNTP "SNTP"
-#define RETRY_COUNT 10
+#define SNTP_VALID_EPOCH_S 1451606400 // 2016-01-01, an earlier clock was never set
+#define CLOCK_DRIFT_FLOOR_PPB 500       // Drift error assumed at least, whatever the fit
+
+typedef struct {
+    uint32_t syncs;
+    uint32_t pollIntervalS;     // Current SNTP poll interval
+    int32_t driftPpb;           // Estimated crystal drift against the servers
+    int64_t lastResidualUs;     // Model error found by the last sync
+} clock_stats_t;
 
 void time_init(void);
-char* getTimestamp(void);
\ No newline at end of file
+bool clockIsSynced(void);
+int64_t clockToEpochMs(int64_t monotonicUs);
+int64_t clockLocalPeriodUs(int64_t wallUs);
+void clockGetStats(clock_stats_t* out);
+char* getTimestamp(int64_t epochMs);
+int64_t getEpochMs(void);
\ No newline at end of file
@@ -1,12 +1,68 @@
 #include "spiffs.h"
+#include "esp_timer.h"
+#include "esp_attr.h"
+#include "esp_system.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 
 esp_vfs_spiffs_conf_t conf = {
     .base_path = "/spiffs",
     .partition_label = NULL,
-    .max_files = 1,
+    .max_files = 3,
     .format_if_mount_failed = true
 };
 
+// Set while no modification is in progress. RTC memory survives software resets, panics
+// and watchdogs but not a power loss, after which the filesystem counts as dirty.
+static RTC_NOINIT_ATTR uint32_t cleanMagic;
+
+static SemaphoreHandle_t writeLock = NULL;
+static int openWrites = 0;
+static bool writeFailed = false;
+static uint32_t mountTimeUs = 0;
+
+static void setDirty(bool dirty)
+{
+    cleanMagic = dirty ? 0 : SPIFFS_CLEAN_MAGIC;
+}
+
+/*
+ * @brief Marks the filesystem dirty in RTC memory until the matching spiffsWriteEnd().
+ *
+ *  Wrap every SPIFFS modification (write, remove) so a reset or power loss in the middle
+ *  leaves the flag set and the next boot runs esp_spiffs_check(). A modification that
+ *  failed (ok false) leaves it set as well, until that check.
+ */
+void spiffsWriteBegin()
+{
+    if (writeLock == NULL)
+        return;
+    xSemaphoreTake(writeLock, portMAX_DELAY);
+    if (openWrites++ == 0)
+        setDirty(true);
+    xSemaphoreGive(writeLock);
+}
+
+void spiffsWriteEnd(bool ok)
+{
+    if (writeLock == NULL)
+        return;
+    xSemaphoreTake(writeLock, portMAX_DELAY);
+    if (!ok)
+        writeFailed = true;
+    if (--openWrites == 0 && !writeFailed)
+        setDirty(false);
+    xSemaphoreGive(writeLock);
+}
+
+/*
+ * @brief Time spent in init_spiffs() mounting, and checking when needed, in microseconds.
+ */
+uint32_t spiffsMountTimeUs()
+{
+    return mountTimeUs;
+}
+
 int spiffsUsedSpace()
 {
     size_t total = 0, used = 0;
@@ -14,11 +70,19 @@ int spiffsUsedSpace()
     if (ret != ESP_OK) {
         ESP_LOGE("SPIFFS", "Failed to get SPIFFS partition information (%s)", esp_err_to_name(ret));
     }
-    return (used/total)*100;
+    return total ? (used * 100) / total : 100;
 }
 
 void init_spiffs(FILE* f, char* file_path)
 {
+    int64_t start = esp_timer_get_time();
+    esp_reset_reason_t reason = esp_reset_reason();
+    // After a power loss RTC memory holds garbage: unknown state counts as dirty
+    bool dirty = reason == ESP_RST_POWERON || reason == ESP_RST_BROWNOUT ||
+                 cleanMagic != SPIFFS_CLEAN_MAGIC;
+
+    writeLock = xSemaphoreCreateMutex();
+
     esp_err_t ret = esp_vfs_spiffs_register(&conf);
 
     if (ret != ESP_OK) {
@@ -32,15 +96,24 @@ void init_spiffs(FILE* f, char* file_path)
         return;
     }
 
-    ESP_LOGI("SPIFFS", "Performing SPIFFS_check().");
-    ret = esp_spiffs_check(conf.partition_label);
-    if (ret != ESP_OK) {
-        ESP_LOGE("SPIFFS", "SPIFFS_check() failed (%s)", esp_err_to_name(ret));
-        return;
+    // The check reads the whole partition; only pay for it after an interrupted write
+    if (dirty) {
+        ESP_LOGI("SPIFFS", "Performing SPIFFS_check().");
+        ret = esp_spiffs_check(conf.partition_label);
+        if (ret != ESP_OK) {
+            ESP_LOGE("SPIFFS", "SPIFFS_check() failed (%s)", esp_err_to_name(ret));
+            return;
+        } else {
+            ESP_LOGI("SPIFFS", "SPIFFS_check() successful");
+            setDirty(false);
+        }
     } else {
-        ESP_LOGI("SPIFFS", "SPIFFS_check() successful");
+        ESP_LOGI("SPIFFS", "Clean shutdown, skipping SPIFFS_check()");
     }
 
+    mountTimeUs = esp_timer_get_time() - start;
+    ESP_LOGI("SPIFFS", "Mounted in %lu us", (unsigned long)mountTimeUs);
+
     size_t total = 0, used = 0;
     ret = esp_spiffs_info(conf.partition_label, &total, &used);
     if (ret != ESP_OK) {
@@ -1,7 +1,15 @@
+#pragma once
+
 #include "esp_spiffs.h"
 #include "esp_log.h"
+#include <stdint.h>
+#include <stdbool.h>
 
 #define MINUTES_BETWEEN_STORING_DATA 5
+#define SPIFFS_CLEAN_MAGIC 0x5350434C // "SPCL"
 
 int spiffsUsedSpace();
-void init_spiffs(FILE* f, char* file_path);
\ No newline at end of file
+void init_spiffs(FILE* f, char* file_path);
+void spiffsWriteBegin();
+void spiffsWriteEnd(bool ok);
+uint32_t spiffsMountTimeUs();
\ No newline at end of file
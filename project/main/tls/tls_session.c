@@ -0,0 +1,308 @@
+#include "tls_session.h"
+
+#include <string.h>
+#include <sys/select.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_tls.h"
+#include "mbedtls/ssl.h"
+#include "mbedtls/platform_util.h"
+#ifdef CONFIG_PROJECT_USE_CERT_BUNDLE
+#include "esp_crt_bundle.h"
+#endif
+
+static const char *TAG = "tls_session";
+
+#define TLS_MASTER_LEN 48
+
+/*
+ * Saved TLS sessions (ticket and session id), one per server name. They live in RAM, which
+ * is retained in light sleep, so a node waking from light sleep resumes instead of doing a
+ * full ECDHE handshake. Only the MQTT transport uses them: esp_http_client takes no client
+ * session, so OTA downloads always do a full handshake. tools/tls_resume times both kinds.
+ */
+typedef struct {
+    char host[TLS_SESSION_HOST_LEN];
+    esp_tls_client_session_t *session;
+    unsigned char master[TLS_MASTER_LEN];  // Master secret of `session`
+} tls_session_entry_t;
+
+static tls_session_entry_t cache[TLS_SESSION_CACHE_SIZE];
+static tls_session_stats_t stats;
+static SemaphoreHandle_t lock = NULL;
+
+#ifndef CONFIG_PROJECT_USE_CERT_BUNDLE
+extern const uint8_t server_cert_pem_start[] asm("_binary_ca_cert_pem_start");
+extern const uint8_t server_cert_pem_end[] asm("_binary_ca_cert_pem_end");
+#endif
+
+typedef struct {
+    esp_tls_t *tls;
+    char server_name[TLS_SESSION_HOST_LEN];
+} tls_transport_t;
+
+static void ensure_lock(void)
+{
+    if (lock == NULL)
+        lock = xSemaphoreCreateMutex();
+}
+
+static tls_session_entry_t *find(const char *host, bool create)
+{
+    for (int i = 0; i < TLS_SESSION_CACHE_SIZE; i++)
+        if (!strcmp(cache[i].host, host))
+            return &cache[i];
+    if (!create)
+        return NULL;
+    for (int i = 0; i < TLS_SESSION_CACHE_SIZE; i++)
+    {
+        if (cache[i].host[0] == '\0')
+        {
+            strlcpy(cache[i].host, host, sizeof(cache[i].host));
+            return &cache[i];
+        }
+    }
+    // Cache full: recycle the first entry
+    if (cache[0].session != NULL)
+        esp_tls_free_client_session(cache[0].session);
+    cache[0].session = NULL;
+    mbedtls_platform_zeroize(cache[0].master, sizeof(cache[0].master));
+    strlcpy(cache[0].host, host, sizeof(cache[0].host));
+    return &cache[0];
+}
+
+/*
+ * @brief Drops the saved session of a server, e.g. after the server rejected it.
+ */
+void tls_session_invalidate(const char *server_name)
+{
+    ensure_lock();
+    xSemaphoreTake(lock, portMAX_DELAY);
+    tls_session_entry_t *entry = find(server_name, false);
+    if (entry != NULL && entry->session != NULL)
+    {
+        esp_tls_free_client_session(entry->session);
+        entry->session = NULL;
+        mbedtls_platform_zeroize(entry->master, sizeof(entry->master));
+    }
+    xSemaphoreGive(lock);
+}
+
+/*
+ * @brief Accounts one handshake. Also used by connections that cannot resume (OTA over
+ *        esp_http_client) so both kinds can be compared in the same statistics.
+ */
+void tls_session_record(const char *server_name, uint32_t handshake_ms, bool resumed)
+{
+    uint32_t *count = resumed ? &stats.resumed_handshakes : &stats.full_handshakes;
+    uint32_t *avg = resumed ? &stats.resumed_avg_ms : &stats.full_avg_ms;
+
+    ensure_lock();
+    xSemaphoreTake(lock, portMAX_DELAY);
+    (*count)++;
+    *avg += ((int32_t)handshake_ms - (int32_t)*avg) / (int32_t)*count;
+    stats.last_ms = handshake_ms;
+    xSemaphoreGive(lock);
+    ESP_LOGI(TAG, "%s handshake with %s took %" PRIu32 " ms", resumed ? "Resumed" : "Full",
+             server_name, handshake_ms);
+}
+
+void tls_session_get_stats(tls_session_stats_t *out)
+{
+    *out = stats;
+}
+
+/*
+ * @brief Master secret of the session a connection ended up with. A resumed (TLS 1.2)
+ *        handshake keeps the master secret of the offered session, a full one derives a new
+ *        one, whichever of ticket or session id was offered. mbedTLS has no accessor for it
+ *        and mbedtls_ssl_get_session() exports a session only once, which
+ *        esp_tls_get_client_session() already does, so it is read from the context.
+ */
+static const unsigned char *session_master(esp_tls_t *tls)
+{
+    mbedtls_ssl_context *ssl = esp_tls_get_ssl_context(tls);
+    if (ssl == NULL || ssl->MBEDTLS_PRIVATE(session) == NULL)
+        return NULL;
+    return ssl->MBEDTLS_PRIVATE(session)->MBEDTLS_PRIVATE(master);
+}
+
+static int transport_connect(esp_transport_handle_t t, const char *host, int port, int timeout_ms)
+{
+    tls_transport_t *ctx = esp_transport_get_context_data(t);
+
+    esp_tls_cfg_t cfg = {
+#ifdef CONFIG_PROJECT_USE_CERT_BUNDLE
+        .crt_bundle_attach = esp_crt_bundle_attach,
+#else
+        .cacert_buf = server_cert_pem_start,
+        .cacert_bytes = server_cert_pem_end - server_cert_pem_start,
+#endif
+        .timeout_ms = timeout_ms,
+        // The host may be a cached address; the certificate is checked against the name
+        .common_name = ctx->server_name,
+    };
+
+    ensure_lock();
+    xSemaphoreTake(lock, portMAX_DELAY);
+    tls_session_entry_t *entry = find(ctx->server_name, true);
+    cfg.client_session = entry->session;
+    bool offered = entry->session != NULL;
+    unsigned char offered_master[TLS_MASTER_LEN];
+    memcpy(offered_master, entry->master, sizeof(offered_master));
+    xSemaphoreGive(lock);
+
+    ctx->tls = esp_tls_init();
+    if (ctx->tls == NULL)
+        return -1;
+
+    int64_t start = esp_timer_get_time();
+    if (esp_tls_conn_new_sync(host, strlen(host), port, &cfg, ctx->tls) <= 0)
+    {
+        stats.failed_handshakes++;
+        esp_tls_conn_destroy(ctx->tls);
+        ctx->tls = NULL;
+        // A stale ticket must not make every following attempt fail
+        tls_session_invalidate(ctx->server_name);
+        return -1;
+    }
+    uint32_t elapsed_ms = (esp_timer_get_time() - start) / 1000;
+
+    // Offering a session does not make it resumed: the server may have turned it down
+    const unsigned char *master = session_master(ctx->tls);
+    bool resumed = offered && master != NULL && !memcmp(master, offered_master, TLS_MASTER_LEN);
+    if (offered && !resumed)
+    {
+        xSemaphoreTake(lock, portMAX_DELAY);
+        stats.rejected_resumptions++;
+        xSemaphoreGive(lock);
+    }
+    tls_session_record(ctx->server_name, elapsed_ms, resumed);
+
+    // Keep the newest session: servers rotate tickets on every handshake
+    esp_tls_client_session_t *session = esp_tls_get_client_session(ctx->tls);
+    if (session != NULL)
+    {
+        xSemaphoreTake(lock, portMAX_DELAY);
+        entry = find(ctx->server_name, true);
+        if (entry->session != NULL)
+            esp_tls_free_client_session(entry->session);
+        entry->session = session;
+        if (master != NULL)
+            memcpy(entry->master, master, TLS_MASTER_LEN);
+        xSemaphoreGive(lock);
+    }
+    return 0;
+}
+
+static int transport_poll(esp_transport_handle_t t, int timeout_ms, bool for_read)
+{
+    tls_transport_t *ctx = esp_transport_get_context_data(t);
+    int sock;
+
+    if (ctx->tls == NULL || esp_tls_get_conn_sockfd(ctx->tls, &sock) != ESP_OK)
+        return -1;
+    // Records already decrypted by mbedTLS are not visible to select()
+    if (for_read && esp_tls_get_bytes_avail(ctx->tls) > 0)
+        return 1;
+
+    fd_set fds, errfds;
+    FD_ZERO(&fds);
+    FD_ZERO(&errfds);
+    FD_SET(sock, &fds);
+    FD_SET(sock, &errfds);
+    struct timeval tv = { .tv_sec = timeout_ms / 1000, .tv_usec = (timeout_ms % 1000) * 1000 };
+    int ret = select(sock + 1, for_read ? &fds : NULL, for_read ? NULL : &fds, &errfds,
+                     timeout_ms < 0 ? NULL : &tv);
+    if (ret > 0 && FD_ISSET(sock, &errfds))
+        return -1;
+    return ret;
+}
+
+static int transport_poll_read(esp_transport_handle_t t, int timeout_ms)
+{
+    return transport_poll(t, timeout_ms, true);
+}
+
+static int transport_poll_write(esp_transport_handle_t t, int timeout_ms)
+{
+    return transport_poll(t, timeout_ms, false);
+}
+
+static int transport_read(esp_transport_handle_t t, char *buffer, int len, int timeout_ms)
+{
+    tls_transport_t *ctx = esp_transport_get_context_data(t);
+
+    int poll = transport_poll_read(t, timeout_ms);
+    if (poll <= 0)
+        return poll == 0 ? ERR_TCP_TRANSPORT_CONNECTION_TIMEOUT : -1;
+
+    int ret = esp_tls_conn_read(ctx->tls, buffer, len);
+    if (ret == 0)
+        return ERR_TCP_TRANSPORT_CONNECTION_CLOSED_BY_FIN;
+    if (ret == ESP_TLS_ERR_SSL_WANT_READ || ret == ESP_TLS_ERR_SSL_WANT_WRITE)
+        return ERR_TCP_TRANSPORT_CONNECTION_TIMEOUT;
+    return ret;
+}
+
+static int transport_write(esp_transport_handle_t t, const char *buffer, int len, int timeout_ms)
+{
+    tls_transport_t *ctx = esp_transport_get_context_data(t);
+
+    int poll = transport_poll_write(t, timeout_ms);
+    if (poll <= 0)
+        return poll;
+
+    int ret = esp_tls_conn_write(ctx->tls, buffer, len);
+    if (ret == ESP_TLS_ERR_SSL_WANT_READ || ret == ESP_TLS_ERR_SSL_WANT_WRITE)
+        return 0;
+    return ret;
+}
+
+static int transport_close(esp_transport_handle_t t)
+{
+    tls_transport_t *ctx = esp_transport_get_context_data(t);
+
+    if (ctx->tls != NULL)
+    {
+        esp_tls_conn_destroy(ctx->tls);
+        ctx->tls = NULL;
+    }
+    return 0;
+}
+
+static int transport_destroy(esp_transport_handle_t t)
+{
+    transport_close(t);
+    free(esp_transport_get_context_data(t));
+    return 0;
+}
+
+/*
+ * @brief Creates an SSL transport that resumes TLS sessions to `server_name`.
+ *
+ *  Used as esp_mqtt_client_config_t.network.transport. Certificates are verified the same
+ *  way as OTA (certificate bundle or embedded CA).
+ */
+esp_transport_handle_t tls_session_transport_new(const char *server_name)
+{
+    esp_transport_handle_t t = esp_transport_init();
+    tls_transport_t *ctx = calloc(1, sizeof(tls_transport_t));
+    if (t == NULL || ctx == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to allocate transport");
+        free(ctx);
+        if (t != NULL)
+            esp_transport_destroy(t);
+        return NULL;
+    }
+
+    strlcpy(ctx->server_name, server_name, sizeof(ctx->server_name));
+    esp_transport_set_context_data(t, ctx);
+    esp_transport_set_func(t, transport_connect, transport_read, transport_write, transport_close,
+                           transport_poll_read, transport_poll_write, transport_destroy);
+    esp_transport_set_default_port(t, 8883);
+    return t;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "esp_transport.h"
+
+#define TLS_SESSION_HOST_LEN 64
+#define TLS_SESSION_CACHE_SIZE 2    // Broker and OTA server
+
+typedef struct {
+    uint32_t full_handshakes;       // Connections that did not resume, whether offered or not
+    uint32_t resumed_handshakes;    // Connections the server resumed from a cached session
+    uint32_t rejected_resumptions;  // Cached sessions the server turned down (also counted full)
+    uint32_t failed_handshakes;
+    uint32_t full_avg_ms;           // Average duration of each kind of handshake
+    uint32_t resumed_avg_ms;
+    uint32_t last_ms;
+} tls_session_stats_t;
+
+esp_transport_handle_t tls_session_transport_new(const char *server_name);
+void tls_session_invalidate(const char *server_name);
+void tls_session_record(const char *server_name, uint32_t handshake_ms, bool resumed);
+void tls_session_get_stats(tls_session_stats_t *stats);
@@ -0,0 +1,221 @@
+#include "tscodec.h"
+
+#include <string.h>
+
+/*
+ * Two on-flash encodings of sample_t:
+ *
+ *  Fixed record, 15 bytes: epoch seconds, sequence, temperature (0.01 *C), pressure (0.1 hPa),
+ *  humidity (0.01 %RH) and forecast code, little endian.
+ *
+ *  Block, up to 255 bytes, decodable on its own: magic, sample count, then per sample
+ *   - timestamp (ms): absolute for the first sample, delta-of-delta after it,
+ *   - sequence: absolute first, then delta - 1 (0 for consecutive samples),
+ *   - temperature, pressure (0.01 hPa), humidity and forecast: absolute first, then delta,
+ *  all as zigzag LEB128 varints. At one sample a minute a sample costs 6 to 8 bytes, about
+ *  35 per block.
+ */
+
+// Channel resolution of the block encoding
+#define TEMPERATURE_SCALE 100
+#define PRESSURE_SCALE 100
+#define HUMIDITY_SCALE 100
+
+// Worst case of one encoded sample: a 64 bit and five 32 bit varints
+#define SAMPLE_MAX_LEN (10 + 5 * 5)
+
+static int32_t quantize(float value, int scale)
+{
+    return (int32_t)(value * scale + (value < 0 ? -0.5f : 0.5f));
+}
+
+static void put_le(uint8_t* out, uint32_t value, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+        out[i] = value >> (8 * i);
+}
+
+static uint32_t get_le(const uint8_t* in, int bytes)
+{
+    uint32_t value = 0;
+    for (int i = 0; i < bytes; i++)
+        value |= (uint32_t)in[i] << (8 * i);
+    return value;
+}
+
+static int32_t clamp(int32_t value, int32_t min, int32_t max)
+{
+    return value < min ? min : value > max ? max : value;
+}
+
+/*
+ * @brief Packs a sample into a fixed TSCODEC_RECORD_SIZE byte record.
+ */
+void tscodec_pack_record(const sample_t* sample, uint8_t* out)
+{
+    put_le(out, (uint32_t)(sample->timestamp / 1000), 4);
+    put_le(out + 4, sample->seq, 4);
+    put_le(out + 8, (uint16_t)clamp(quantize(sample->temperature, 100), INT16_MIN, INT16_MAX), 2);
+    put_le(out + 10, clamp(quantize(sample->pressure, 10), 0, UINT16_MAX), 2);
+    put_le(out + 12, clamp(quantize(sample->humidity, 100), 0, UINT16_MAX), 2);
+    out[14] = sample->forecast;
+}
+
+void tscodec_unpack_record(const uint8_t* in, sample_t* sample)
+{
+    sample->timestamp = (int64_t)get_le(in, 4) * 1000;
+    sample->seq = get_le(in + 4, 4);
+    sample->temperature = (int16_t)get_le(in + 8, 2) / 100.0f;
+    sample->pressure = get_le(in + 10, 2) / 10.0f;
+    sample->humidity = get_le(in + 12, 2) / 100.0f;
+    sample->forecast = in[14];
+}
+
+static uint64_t zigzag(int64_t value)
+{
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static int64_t unzigzag(uint64_t value)
+{
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+static int put_varint(uint8_t* out, uint64_t value)
+{
+    int n = 0;
+    while (value >= 0x80) {
+        out[n++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    out[n++] = value;
+    return n;
+}
+
+// Returns the bytes consumed, 0 when the varint runs past the end
+static int get_varint(const uint8_t* in, size_t len, uint64_t* value)
+{
+    *value = 0;
+    for (size_t n = 0; n < len && n < 10; n++) {
+        *value |= (uint64_t)(in[n] & 0x7F) << (7 * n);
+        if (!(in[n] & 0x80))
+            return n + 1;
+    }
+    return 0;
+}
+
+void tscodec_block_init(tscodec_block_t* block)
+{
+    memset(block, 0, sizeof(*block));
+    memset(block->data, 0xFF, sizeof(block->data));
+    block->data[0] = TSCODEC_BLOCK_MAGIC;
+    block->data[1] = 0;
+    block->len = TSCODEC_BLOCK_HEADER;
+}
+
+/*
+ * @brief Appends a sample to the block.
+ *
+ * @return 0, or -1 if the block is full and must be written out and reinitialised first.
+ */
+int tscodec_block_add(tscodec_block_t* block, const sample_t* sample)
+{
+    uint8_t encoded[SAMPLE_MAX_LEN];
+    int n = 0;
+
+    int32_t temperature = quantize(sample->temperature, TEMPERATURE_SCALE);
+    int32_t pressure = quantize(sample->pressure, PRESSURE_SCALE);
+    int32_t humidity = quantize(sample->humidity, HUMIDITY_SCALE);
+    int32_t forecast = sample->forecast;
+    int64_t delta = 0;
+
+    if (block->count == UINT8_MAX)
+        return -1;
+
+    if (block->count == 0) {
+        n += put_varint(encoded + n, zigzag(sample->timestamp));
+        n += put_varint(encoded + n, sample->seq);
+        n += put_varint(encoded + n, zigzag(temperature));
+        n += put_varint(encoded + n, zigzag(pressure));
+        n += put_varint(encoded + n, zigzag(humidity));
+        n += put_varint(encoded + n, zigzag(forecast));
+    } else {
+        delta = sample->timestamp - block->timestamp;
+        n += put_varint(encoded + n, zigzag(delta - block->delta));
+        n += put_varint(encoded + n, zigzag((int32_t)(sample->seq - block->seq - 1)));
+        n += put_varint(encoded + n, zigzag(temperature - block->temperature));
+        n += put_varint(encoded + n, zigzag(pressure - block->pressure));
+        n += put_varint(encoded + n, zigzag(humidity - block->humidity));
+        n += put_varint(encoded + n, zigzag(forecast - block->forecast));
+    }
+
+    if (block->len + n > TSCODEC_BLOCK_SIZE)
+        return -1;
+
+    memcpy(block->data + block->len, encoded, n);
+    block->len += n;
+    block->data[1] = ++block->count;
+    block->timestamp = sample->timestamp;
+    block->delta = delta;
+    block->seq = sample->seq;
+    block->temperature = temperature;
+    block->pressure = pressure;
+    block->humidity = humidity;
+    block->forecast = forecast;
+    return 0;
+}
+
+/*
+ * @brief Decodes up to max samples of a block. With samples NULL the whole block is only
+ *        checked.
+ *
+ * @return Number of samples decoded, or -1 if the block is malformed.
+ */
+int tscodec_block_decode(const uint8_t* data, size_t len, sample_t* samples, int max)
+{
+    if (len < TSCODEC_BLOCK_HEADER || data[0] != TSCODEC_BLOCK_MAGIC)
+        return -1;
+
+    int count = samples == NULL || data[1] < max ? data[1] : max;
+    size_t pos = TSCODEC_BLOCK_HEADER;
+    int64_t timestamp = 0, delta = 0;
+    uint32_t seq = 0;
+    int64_t values[4] = {0};    // temperature, pressure, humidity, forecast
+
+    for (int i = 0; i < count; i++) {
+        uint64_t field;
+        int n;
+
+        if (!(n = get_varint(data + pos, len - pos, &field)))
+            return -1;
+        pos += n;
+        if (i == 0) {
+            timestamp = unzigzag(field);
+        } else {
+            delta += unzigzag(field);
+            timestamp += delta;
+        }
+
+        if (!(n = get_varint(data + pos, len - pos, &field)))
+            return -1;
+        pos += n;
+        seq = i == 0 ? (uint32_t)field : seq + 1 + (int32_t)unzigzag(field);
+
+        for (int c = 0; c < 4; c++) {
+            if (!(n = get_varint(data + pos, len - pos, &field)))
+                return -1;
+            pos += n;
+            values[c] = i == 0 ? unzigzag(field) : values[c] + unzigzag(field);
+        }
+
+        if (samples == NULL)
+            continue;
+        samples[i].timestamp = timestamp;
+        samples[i].seq = seq;
+        samples[i].temperature = (float)values[0] / TEMPERATURE_SCALE;
+        samples[i].pressure = (float)values[1] / PRESSURE_SCALE;
+        samples[i].humidity = (float)values[2] / HUMIDITY_SCALE;
+        samples[i].forecast = values[3];
+    }
+    return count;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "../payload/payload.h"
+
+// Kept free of ESP-IDF headers so host tools can decode flash dumps
+
+#define TSCODEC_RECORD_SIZE 15      // Fixed record data bytes, 16 with the ring log CRC
+#define TSCODEC_BLOCK_SIZE 255      // Block data bytes, one 256 byte flash page with the CRC
+#define TSCODEC_BLOCK_MAGIC 0xB1
+#define TSCODEC_BLOCK_HEADER 2      // Magic and sample count
+// Every sample takes at least six one-byte varints
+#define TSCODEC_BLOCK_MAX_SAMPLES ((TSCODEC_BLOCK_SIZE - TSCODEC_BLOCK_HEADER) / 6)
+
+// Open block: the encoded bytes plus the state the next sample is encoded against
+typedef struct {
+    uint8_t data[TSCODEC_BLOCK_SIZE];
+    uint16_t len;
+    uint8_t count;
+    int64_t timestamp;      // Previous sample, quantized
+    int64_t delta;          // Previous timestamp delta
+    uint32_t seq;
+    int32_t temperature;
+    int32_t pressure;
+    int32_t humidity;
+    int32_t forecast;
+} tscodec_block_t;
+
+void tscodec_pack_record(const sample_t* sample, uint8_t* out);
+void tscodec_unpack_record(const uint8_t* in, sample_t* sample);
+
+void tscodec_block_init(tscodec_block_t* block);
+int tscodec_block_add(tscodec_block_t* block, const sample_t* sample);
+int tscodec_block_decode(const uint8_t* data, size_t len, sample_t* samples, int max);
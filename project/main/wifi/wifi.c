@@ -1,14 +1,16 @@
 #include "wifi.h"
 
 #include <string.h>
+#include <inttypes.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #if CONFIG_ESP_WIFI_MODE_STA
 #include "freertos/event_groups.h"
 #include "esp_system.h"
-#elif CONFIG_ESP_WIFI_MODE_AP
-#include "esp_mac.h"
+#include "esp_timer.h"
+#include "nvs.h"
 #endif
+#include "esp_mac.h"
 #include "esp_wifi.h"
 #include "esp_event.h"
 #include "esp_log.h"
@@ -17,6 +19,8 @@
 #include "lwip/err.h"
 #include "lwip/sys.h"
 
+#include "../boot/boot.h"
+
 #define PROJECT_ESP_WIFI_SSID CONFIG_ESP_WIFI_SSID
 #define PROJECT_ESP_WIFI_PASS CONFIG_ESP_WIFI_PASSWORD
 
@@ -65,22 +69,160 @@ static EventGroupHandle_t s_wifi_event_group;
 static const char *TAG = "wifi station";
 
 static int s_retry_num = 0;
+static uint32_t s_reconnect_count = 0;
+
+static esp_netif_t *s_netif = NULL;
+
+// Last access point joined and the lease it gave, for a directed connect on the next start
+typedef struct {
+    uint8_t ssid[32];
+    uint8_t bssid[6];
+    uint8_t channel;
+    esp_netif_ip_info_t ip_info;
+    esp_netif_dns_info_t dns;
+} ap_cache_t;
+
+static ap_cache_t s_cache;
+static bool s_directed = false;         // Station config targets the cached BSSID and channel
+static bool s_directed_ok = false;      // The current directed attempt got an address
+static bool s_connected = false;
+static uint8_t s_assoc_bssid[6];
+static uint8_t s_assoc_channel = 0;
+static int64_t s_connect_us = 0;        // Start, or disconnect of a connected station
+static int64_t s_assoc_us = 0;
+static wifi_connect_stats_t s_stats;
 
 #elif CONFIG_ESP_WIFI_MODE_AP
 static const char *TAG = "wifi softAP";
 #endif
 
+#if CONFIG_ESP_WIFI_MODE_STA
+/*
+ * @brief Loads the cached access point. Returns false without one, or when it was cached
+ *        for another SSID.
+ */
+static bool cache_load(void)
+{
+    nvs_handle_t nvs;
+    size_t len = sizeof(s_cache);
+    if (nvs_open(WIFI_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK)
+        return false;
+    bool ok = nvs_get_blob(nvs, "ap", &s_cache, &len) == ESP_OK && len == sizeof(s_cache);
+    nvs_close(nvs);
+    if (!ok)
+        memset(&s_cache, 0, sizeof(s_cache));
+    return ok && strncmp((const char *)s_cache.ssid, PROJECT_ESP_WIFI_SSID, sizeof(s_cache.ssid)) == 0;
+}
+
+static void cache_save(void)
+{
+    nvs_handle_t nvs;
+    if (nvs_open(WIFI_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK)
+        return;
+    nvs_set_blob(nvs, "ap", &s_cache, sizeof(s_cache));
+    nvs_commit(nvs);
+    nvs_close(nvs);
+}
+
+/*
+ * @brief Records the access point and lease of the connection just made. Flash is written
+ *        only when they changed (roaming, a new lease), not on every reconnect.
+ */
+static void cache_update(const esp_netif_ip_info_t *ip_info)
+{
+    ap_cache_t fresh;
+    memset(&fresh, 0, sizeof(fresh));
+    strncpy((char *)fresh.ssid, PROJECT_ESP_WIFI_SSID, sizeof(fresh.ssid));
+    memcpy(fresh.bssid, s_assoc_bssid, sizeof(fresh.bssid));
+    fresh.channel = s_assoc_channel;
+    fresh.ip_info = *ip_info;
+    esp_netif_get_dns_info(s_netif, ESP_NETIF_DNS_MAIN, &fresh.dns);
+    if (memcmp(&fresh, &s_cache, sizeof(fresh)) == 0)
+        return;
+    memcpy(&s_cache, &fresh, sizeof(s_cache));
+    cache_save();
+}
+
+#if CONFIG_WIFI_FAST_CONNECT_STATIC_IP
+/*
+ * @brief Configures the cached lease statically. The netif raises IP_EVENT_STA_GOT_IP at once,
+ *        without a DHCP exchange.
+ */
+static void apply_cached_ip(void)
+{
+    esp_netif_dhcpc_stop(s_netif);
+    if (esp_netif_set_ip_info(s_netif, &s_cache.ip_info) != ESP_OK)
+    {
+        esp_netif_dhcpc_start(s_netif);
+        return;
+    }
+    esp_netif_set_dns_info(s_netif, ESP_NETIF_DNS_MAIN, &s_cache.dns);
+}
+#endif
+
+/*
+ * @brief Gives up on the cached access point: the next esp_wifi_connect() scans for the SSID,
+ *        and DHCP runs again if the cached lease was configured statically.
+ */
+static void fall_back_to_scan(void)
+{
+    wifi_config_t config;
+    esp_wifi_get_config(WIFI_IF_STA, &config);
+    config.sta.bssid_set = false;
+    config.sta.channel = 0;
+    esp_wifi_set_config(WIFI_IF_STA, &config);
+#if CONFIG_WIFI_FAST_CONNECT_STATIC_IP
+    esp_netif_dhcpc_start(s_netif);
+#endif
+    s_directed = false;
+    s_stats.fast_fallbacks++;
+}
+#endif
+
 static void event_handler(void *arg, esp_event_base_t event_base,
                           int32_t event_id, void *event_data)
 {
 #if CONFIG_ESP_WIFI_MODE_STA
     if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START)
     {
+        s_connect_us = esp_timer_get_time();
         esp_wifi_connect();
     }
+    else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED)
+    {
+        wifi_event_sta_connected_t *event = (wifi_event_sta_connected_t *)event_data;
+        s_assoc_us = esp_timer_get_time();
+        memcpy(s_assoc_bssid, event->bssid, sizeof(s_assoc_bssid));
+        s_assoc_channel = event->channel;
+        boot_mark(BOOT_PHASE_WIFI_ASSOCIATED);
+#if CONFIG_WIFI_FAST_CONNECT_STATIC_IP
+        if (s_directed)
+            apply_cached_ip();
+#endif
+    }
     else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED)
     {
-        if (s_retry_num < EXAMPLE_ESP_MAXIMUM_RETRY)
+        s_reconnect_count++;
+        if (s_connected)
+        {
+            s_connected = false;
+            s_connect_us = esp_timer_get_time();
+        }
+        if (s_directed && s_directed_ok)
+        {
+            // An ordinary drop: the cached access point worked, so it is tried again first
+            s_directed_ok = false;
+            ESP_LOGI(TAG, "connection lost, reconnecting to the cached access point");
+            esp_wifi_connect();
+        }
+        else if (s_directed)
+        {
+            // Not counted as a retry: the scan is the first attempt of the normal path
+            ESP_LOGI(TAG, "cached access point failed, scanning");
+            fall_back_to_scan();
+            esp_wifi_connect();
+        }
+        else if (s_retry_num < EXAMPLE_ESP_MAXIMUM_RETRY)
         {
             esp_wifi_connect();
             s_retry_num++;
@@ -95,9 +237,21 @@ static void event_handler(void *arg, esp_event_base_t event_base,
     else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP)
     {
         ip_event_got_ip_t *event = (ip_event_got_ip_t *)event_data;
-        ESP_LOGI(TAG, "got ip:" IPSTR, IP2STR(&event->ip_info.ip));
+        int64_t now = esp_timer_get_time();
+        s_stats.fast = s_directed;
+        s_stats.connect_ms = (now - s_connect_us) / 1000;
+        s_stats.assoc_to_ip_ms = (now - s_assoc_us) / 1000;
+        ESP_LOGI(TAG, "got ip:" IPSTR " in %" PRIu32 " ms, %" PRIu32 " ms after association%s",
+                 IP2STR(&event->ip_info.ip), s_stats.connect_ms, s_stats.assoc_to_ip_ms,
+                 s_directed ? " (cached access point)" : "");
+        s_connected = true;
+        s_directed_ok = s_directed;
         s_retry_num = 0;
+#if CONFIG_WIFI_FAST_CONNECT
+        cache_update(&event->ip_info);
+#endif
         xEventGroupSetBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
+        boot_mark(BOOT_PHASE_WIFI_CONNECTED);
     }
 #elif CONFIG_ESP_WIFI_MODE_AP
     if (event_id == WIFI_EVENT_AP_STACONNECTED)
@@ -115,22 +269,17 @@ static void event_handler(void *arg, esp_event_base_t event_base,
 #endif
 }
 
+/*
+ * @brief Brings up the netif, the default event loop and the Wi-Fi driver. NVS must be
+ *        initialised already (the driver keeps its calibration data there).
+ */
 void wifi_init()
 {
-    // Initialize NVS
-    esp_err_t ret = nvs_flash_init();
-    if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND)
-    {
-        ESP_ERROR_CHECK(nvs_flash_erase());
-        ret = nvs_flash_init();
-    }
-    ESP_ERROR_CHECK(ret);
-
     ESP_ERROR_CHECK(esp_netif_init());
     ESP_ERROR_CHECK(esp_event_loop_create_default());
 
 #if CONFIG_ESP_WIFI_MODE_STA
-    esp_netif_create_default_wifi_sta();
+    s_netif = esp_netif_create_default_wifi_sta();
 #elif CONFIG_ESP_WIFI_MODE_AP
     esp_netif_create_default_wifi_ap();
 #endif
@@ -150,6 +299,7 @@ void wifi_init()
             .threshold.authmode = ESP_WIFI_SCAN_AUTH_MODE_THRESHOLD,
             .sae_pwe_h2e = ESP_WIFI_SAE_MODE,
             .sae_h2e_identifier = EXAMPLE_H2E_IDENTIFIER,
+            .listen_interval = CONFIG_RADIO_LISTEN_INTERVAL,
 #elif CONFIG_ESP_WIFI_MODE_AP
             .ssid_len = strlen(PROJECT_ESP_WIFI_SSID),
             .channel = PROJECT_ESP_WIFI_CHANNEL,
@@ -168,6 +318,18 @@ void wifi_init()
     };
 
 #if CONFIG_ESP_WIFI_MODE_STA
+#if CONFIG_WIFI_FAST_CONNECT
+    // Straight to the last access point: a scan of its channel only, no full sweep
+    if (cache_load())
+    {
+        wifi_config.sta.bssid_set = true;
+        memcpy(wifi_config.sta.bssid, s_cache.bssid, sizeof(wifi_config.sta.bssid));
+        wifi_config.sta.channel = s_cache.channel;
+        s_directed = true;
+        ESP_LOGI(TAG, "connecting to cached access point " MACSTR " on channel %d",
+                 MAC2STR(s_cache.bssid), s_cache.channel);
+    }
+#endif
     ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
     ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
 #elif CONFIG_ESP_WIFI_MODE_AP
@@ -245,3 +407,40 @@ void wifi_stop()
 #endif
     ESP_ERROR_CHECK(esp_wifi_stop());
 }
+
+/*
+ * @brief Returns the RSSI of the associated access point, or 0 when not associated.
+ */
+int wifi_get_rssi()
+{
+#if CONFIG_ESP_WIFI_MODE_STA
+    wifi_ap_record_t ap;
+    if (esp_wifi_sta_get_ap_info(&ap) == ESP_OK)
+        return ap.rssi;
+#endif
+    return 0;
+}
+
+/*
+ * @brief Returns the number of station disconnections since boot.
+ */
+uint32_t wifi_get_reconnect_count()
+{
+#if CONFIG_ESP_WIFI_MODE_STA
+    return s_reconnect_count;
+#else
+    return 0;
+#endif
+}
+
+/*
+ * @brief Copies the timing of the last connection and the fast connect counters.
+ */
+void wifi_get_connect_stats(wifi_connect_stats_t *stats)
+{
+#if CONFIG_ESP_WIFI_MODE_STA
+    *stats = s_stats;
+#else
+    memset(stats, 0, sizeof(*stats));
+#endif
+}
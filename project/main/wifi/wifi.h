@@ -1,7 +1,21 @@
 #pragma once
 
+#include <stdint.h>
+#include <stdbool.h>
 #include "esp_err.h"
 
+#define WIFI_NVS_NAMESPACE "wifi"
+
+typedef struct {
+    bool fast;                      // Last connection used the cached access point
+    uint32_t fast_fallbacks;        // Cached access point failed, full scan instead
+    uint32_t connect_ms;            // Start or disconnect to IP, last connection
+    uint32_t assoc_to_ip_ms;        // Association to IP, last connection
+} wifi_connect_stats_t;
+
 void wifi_init();
 void wifi_start();
 void wifi_stop();
+int wifi_get_rssi();
+uint32_t wifi_get_reconnect_count();
+void wifi_get_connect_stats(wifi_connect_stats_t *stats);
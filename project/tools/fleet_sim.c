@@ -0,0 +1,1143 @@
+/*
+ * Fleet load simulator for the MQTT -> Telegraf -> InfluxDB stack: thousands of emulated
+ * stations publish samples encoded by main/payload on the firmware topics, with the firmware's
+ * connect, outage and backlog replay behaviour, and the run reports broker throughput,
+ * acknowledgement and delivery latency, end-to-end ingest lag and where messages were lost.
+ *
+ *  gcc -O2 -I../main -o fleet_sim fleet_sim.c ../main/payload/payload.c -lpthread -lm
+ *
+ *  ./fleet_sim [-n stations] [-i interval_s] [-d duration_s] [-q 0|1] [-f line|cbor]
+ *              [-c connects_per_s] [-r mean_s_between_drops] [-D down_s]
+ *              [-o percent,at_s,length_s] [-b broker[:port]]
+ *              [-I http://influxdb:8086 -O org -B bucket]       (token in INFLUX_TOKEN)
+ *
+ * Against the manifests in ../kubernetes, on a local cluster:
+ *  kubectl apply -f mqtt-conf.yaml -f mqtt-service.yaml -f mqtt-deployment.yaml  (same for
+ *      influxdb-* and telegraf-*)
+ *  kubectl apply -f telegraf-loadtest.yaml   (Telegraf's internal input, for metrics_dropped)
+ *  kubectl -n ase-p1g4 rollout restart deployment/telegraf
+ *  kubectl -n ase-p1g4 port-forward svc/mqtt 1883 &
+ *  kubectl -n ase-p1g4 port-forward svc/influxdb 8086 &
+ *  INFLUX_TOKEN=... ./fleet_sim -n 5000 -i 10 -d 300 -I http://localhost:8086 -O org -B bucket
+ *  kubectl delete -f telegraf-loadtest.yaml && kubectl -n ase-p1g4 rollout restart deployment/telegraf
+ *
+ * No run against these manifests has been recorded yet: the tool was only checked against a
+ * local fake broker and InfluxDB, so there are no throughput, latency or loss figures for the
+ * real mosquitto/Telegraf/InfluxDB stack.
+ *
+ * Every station is one TCP connection. Live samples go out as they are taken, like
+ * post_data(); samples taken while a station is offline, or while its in-flight window
+ * is full, are queued and replayed after the reconnect in QoS 1 batches of
+ * BACKLOG_BATCH_SIZE lines every BACKLOG_BATCH_INTERVAL_MS, like the backlog drain task.
+ * -r drops random stations without a DISCONNECT (Wi-Fi loss) and -o takes a share of the
+ * fleet offline together, which ends in a reconnect storm and a burst of replays.
+ *
+ * Stations publish under stations/sim<n>/, the namespace of CONFIG_MQTT_STATION_TOPICS,
+ * so Telegraf tags each series with its station. Sequence numbers are unique across the fleet
+ * and start at the Unix time of the run, which is how each stage is accounted for: a
+ * subscriber on the broker sees which samples were delivered, and InfluxDB is polled for the
+ * highest and the number of seq values written.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <math.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "payload/payload.h"
+#include "mqtt/station.h"
+
+#define KEEPALIVE_S 60
+#define CONNECT_TIMEOUT_US 10000000
+#define INFLIGHT_MAX 8              // QoS 1 messages awaiting PUBACK, per station
+#define BACKLOG_BATCH_SIZE 8        // CONFIG_BACKLOG_BATCH_SIZE
+#define BACKLOG_BATCH_INTERVAL_MS 1000
+#define OUT_BUF 2048
+#define IN_BUF 256
+#define SUB_BUF 65536
+#define HIST_MAX_MS 120000
+#define SETTLE_STABLE_US 20000000   // InfluxDB count unchanged this long: Telegraf has flushed
+#define SETTLE_MAX_US 120000000
+#define DRAIN_MAX_US 120000000
+
+// Options ---------------------------------------------------------------------------------
+
+static int stations = 1000;
+static int interval_s = 60;         // SENSOR_PERIOD_US
+static int duration_s = 60;
+static int qos = 0;                 // CONFIG_MQTT_TELEMETRY_QOS1
+static payload_format_t format = PAYLOAD_FORMAT_LINE;
+static int connect_rate = 200;
+static double drop_mean_s = 0;
+static int down_s = 5;
+static int outage_percent = 0, outage_at_s = 0, outage_len_s = 0;
+static char broker_host[128] = "localhost";
+static char broker_port[8] = "1883";
+static const char *influx_url = NULL, *influx_org = NULL, *influx_bucket = NULL;
+static const char *influx_token = NULL;
+
+// Time and statistics -----------------------------------------------------------------------
+
+static int64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static int64_t wall_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static double rand_unit(void)
+{
+    return (rand() + 0.5) / ((double)RAND_MAX + 1);
+}
+
+typedef struct {
+    uint32_t counts[HIST_MAX_MS + 1];   // 1 ms buckets, the last one open ended
+    uint64_t n;
+    uint32_t max_ms;
+} hist_t;
+
+static void hist_add(hist_t *h, int64_t us)
+{
+    uint32_t ms = us < 0 ? 0 : (uint32_t)(us / 1000);
+    if (ms > h->max_ms)
+        h->max_ms = ms;
+    h->counts[ms > HIST_MAX_MS ? HIST_MAX_MS : ms]++;
+    h->n++;
+}
+
+static uint32_t hist_pct(const hist_t *h, double p)
+{
+    uint64_t want = (uint64_t)ceil(h->n * p), seen = 0;
+    for (uint32_t ms = 0; ms <= HIST_MAX_MS; ms++) {
+        seen += h->counts[ms];
+        if (seen >= want && seen > 0)
+            return ms;
+    }
+    return 0;
+}
+
+static void hist_print(const char *name, const hist_t *h)
+{
+    if (h->n == 0) {
+        printf("  %-18s no samples\n", name);
+        return;
+    }
+    printf("  %-18s p50 %" PRIu32 " ms, p95 %" PRIu32 " ms, p99 %" PRIu32 " ms, max %" PRIu32 " ms\n",
+           name, hist_pct(h, 0.50), hist_pct(h, 0.95), hist_pct(h, 0.99), h->max_ms);
+}
+
+static hist_t ack_hist, deliver_hist, lag_hist, connack_hist;
+
+static struct {
+    uint64_t generated, published_samples, published_messages, batches;
+    uint64_t sent_qos0;             // Samples in QoS 0 messages, the broker's once sent
+    uint64_t acked, republished, delivered;
+    uint64_t connects, drops, connect_failures;
+} stats;
+
+// Samples ---------------------------------------------------------------------------------
+
+// Indexed by seq - seq_base. sent_us is read by the InfluxDB poller thread
+static uint32_t seq_base;
+static uint32_t sample_cap, sample_count;
+static int64_t *sample_ts;
+static int64_t *sample_sent_us;
+static uint32_t *sample_station;
+static uint8_t *sample_flags;
+#define SAMPLE_ACKED 1
+#define SAMPLE_DELIVERED 2
+
+static uint32_t sample_new(int station)
+{
+    uint32_t idx = sample_count++;
+    sample_ts[idx] = wall_ms();
+    sample_station[idx] = station;
+    stats.generated++;
+    return idx;
+}
+
+// Plausible weather, different per station
+static void sample_fill(uint32_t idx, sample_t *s)
+{
+    double day = sample_ts[idx] / 86400000.0 * 2 * M_PI + sample_station[idx];
+    s->timestamp = sample_ts[idx];
+    s->seq = seq_base + idx;
+    s->temperature = (float)(15 + 8 * sin(day) + (sample_station[idx] % 7) * 0.5);
+    s->pressure = (float)(1013 + 6 * sin(day / 3));
+    s->humidity = (float)(60 + 20 * cos(day));
+    s->forecast = 1 + sample_station[idx] % 26;
+}
+
+// MQTT 3.1.1 encoding ------------------------------------------------------------------------
+
+static int put_remaining(uint8_t *p, uint32_t len)
+{
+    int n = 0;
+    do {
+        p[n] = len & 0x7F;
+        len >>= 7;
+        if (len)
+            p[n] |= 0x80;
+        n++;
+    } while (len);
+    return n;
+}
+
+static int put_string(uint8_t *p, const char *s)
+{
+    size_t len = strlen(s);
+    p[0] = len >> 8;
+    p[1] = len & 0xFF;
+    memcpy(p + 2, s, len);
+    return 2 + (int)len;
+}
+
+static int mqtt_connect_packet(uint8_t *p, const char *client_id)
+{
+    uint8_t body[128];
+    int n = put_string(body, "MQTT");
+    body[n++] = 4;                  // Protocol level 3.1.1
+    body[n++] = 0x02;               // Clean session
+    body[n++] = KEEPALIVE_S >> 8;
+    body[n++] = KEEPALIVE_S & 0xFF;
+    n += put_string(body + n, client_id);
+    p[0] = 0x10;
+    int h = 1 + put_remaining(p + 1, n);
+    memcpy(p + h, body, n);
+    return h + n;
+}
+
+// Header of a PUBLISH carrying len payload bytes; the payload follows it
+static int mqtt_publish_header(uint8_t *p, const char *topic, int qos, uint16_t pid, int len)
+{
+    int topic_len = 2 + (int)strlen(topic);
+    p[0] = 0x30 | (qos << 1);
+    int h = 1 + put_remaining(p + 1, topic_len + (qos ? 2 : 0) + len);
+    h += put_string(p + h, topic);
+    if (qos) {
+        p[h++] = pid >> 8;
+        p[h++] = pid & 0xFF;
+    }
+    return h;
+}
+
+static int mqtt_subscribe_packet(uint8_t *p, uint16_t pid, const char *const *filters, int count)
+{
+    uint8_t body[512];
+    int n = 0;
+    body[n++] = pid >> 8;
+    body[n++] = pid & 0xFF;
+    for (int i = 0; i < count; i++) {
+        n += put_string(body + n, filters[i]);
+        body[n++] = 0;              // QoS 0
+    }
+    p[0] = 0x82;
+    int h = 1 + put_remaining(p + 1, n);
+    memcpy(p + h, body, n);
+    return h + n;
+}
+
+/*
+ * @brief Length of the first complete packet in buf, 0 if it is not all there yet. The fixed
+ *        header length is stored in header.
+ */
+static uint32_t mqtt_packet_len(const uint8_t *buf, uint32_t len, int *header)
+{
+    uint32_t remaining = 0;
+    for (int i = 1; i < 5; i++) {
+        if ((uint32_t)i >= len)
+            return 0;
+        remaining |= (uint32_t)(buf[i] & 0x7F) << (7 * (i - 1));
+        if (!(buf[i] & 0x80)) {
+            *header = i + 1;
+            return *header + remaining <= len ? *header + remaining : 0;
+        }
+    }
+    return UINT32_MAX;              // Malformed
+}
+
+// Connections -----------------------------------------------------------------------------
+
+static struct addrinfo *broker_addr;
+
+static int tcp_open(void)
+{
+    int fd = socket(broker_addr->ai_family, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    if (connect(fd, broker_addr->ai_addr, broker_addr->ai_addrlen) != 0 && errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+enum {
+    ST_OFFLINE,
+    ST_TCP,             // connect() in progress
+    ST_CONNACK,         // CONNECT sent
+    ST_ONLINE,
+};
+
+typedef struct {
+    uint16_t pid;       // 0 when the slot is free
+    uint8_t count;
+    bool batch;
+    int64_t sent_us;
+    uint32_t samples[BACKLOG_BATCH_SIZE];
+} inflight_t;
+
+typedef struct {
+    int id;
+    int fd;
+    int state;
+    int64_t state_us;           // Since when in state
+    int64_t next_sample_us;
+    int64_t reconnect_us;
+    int64_t drop_us;            // Random disconnect, 0 when none is planned
+    int64_t last_tx_us;
+    int64_t next_batch_us;
+    bool batch_inflight;
+    uint16_t next_pid;
+    uint32_t *backlog;          // Ring of sample indexes waiting for a replay
+    uint32_t backlog_head, backlog_count, backlog_cap;
+    inflight_t inflight[INFLIGHT_MAX];
+    uint32_t out_len, in_len;
+    uint8_t out[OUT_BUF];
+    uint8_t in[IN_BUF];
+} station_t;
+
+static station_t *fleet;
+
+static void backlog_push(station_t *s, uint32_t idx)
+{
+    s->backlog[(s->backlog_head + s->backlog_count) % s->backlog_cap] = idx;
+    s->backlog_count++;
+}
+
+static uint32_t backlog_peek(station_t *s, uint32_t i)
+{
+    return s->backlog[(s->backlog_head + i) % s->backlog_cap];
+}
+
+static bool flush_out(station_t *s)
+{
+    while (s->out_len > 0) {
+        ssize_t n = send(s->fd, s->out, s->out_len, MSG_NOSIGNAL);
+        if (n < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        memmove(s->out, s->out + n, s->out_len - n);
+        s->out_len -= n;
+    }
+    return true;
+}
+
+static bool out_room(station_t *s, uint32_t len)
+{
+    return s->out_len + len <= OUT_BUF;
+}
+
+static void out_put(station_t *s, const void *data, uint32_t len, int64_t now)
+{
+    memcpy(s->out + s->out_len, data, len);
+    s->out_len += len;
+    s->last_tx_us = now;
+}
+
+static inflight_t *inflight_free(station_t *s)
+{
+    for (int i = 0; i < INFLIGHT_MAX; i++)
+        if (s->inflight[i].pid == 0)
+            return &s->inflight[i];
+    return NULL;
+}
+
+/*
+ * @brief Closes the connection. Unacknowledged QoS 1 samples go back to the backlog, as the
+ *        outbox hands them over on a disconnect; QoS 0 samples already sent are the broker's.
+ */
+static void station_close(station_t *s, int64_t now, int64_t reconnect_in_us)
+{
+    if (s->fd >= 0)
+        close(s->fd);
+    s->fd = -1;
+    for (int i = 0; i < INFLIGHT_MAX; i++) {
+        inflight_t *f = &s->inflight[i];
+        for (int k = 0; k < f->count && f->pid; k++)
+            backlog_push(s, f->samples[k]);
+        f->pid = 0;
+        f->count = 0;
+    }
+    s->batch_inflight = false;
+    s->out_len = s->in_len = 0;
+    s->state = ST_OFFLINE;
+    s->state_us = now;
+    s->reconnect_us = now + reconnect_in_us;
+    s->drop_us = 0;
+}
+
+static void station_connect(station_t *s, int64_t now)
+{
+    s->fd = tcp_open();
+    s->state_us = now;
+    if (s->fd < 0) {
+        stats.connect_failures++;
+        station_close(s, now, (int64_t)(down_s * 1e6 * (1 + rand_unit())));
+        return;
+    }
+    s->state = ST_TCP;
+}
+
+/*
+ * @brief Queues a PUBLISH of the given samples: one encoded sample, or for a replay batch
+ *        the line protocol lines joined by newlines, as read_batch() builds them.
+ */
+static bool station_publish(station_t *s, const uint32_t *samples, int count, bool batch, int64_t now)
+{
+    uint8_t payload[BACKLOG_BATCH_SIZE * PAYLOAD_MAX_LEN];
+    int len = 0;
+    payload_format_t f = batch ? PAYLOAD_FORMAT_LINE : format;
+    for (int i = 0; i < count; i++) {
+        sample_t sample;
+        sample_fill(samples[i], &sample);
+        if (i > 0)
+            payload[len++] = '\n';
+        int n = payload_encode(f, &sample, payload + len, sizeof(payload) - len);
+        if (n < 0)
+            return false;
+        len += n;
+    }
+
+    int message_qos = batch ? 1 : qos;
+    inflight_t *slot = NULL;
+    if (message_qos) {
+        slot = inflight_free(s);
+        if (slot == NULL)
+            return false;
+    }
+    char topic[STATION_TOPIC_LEN];
+    snprintf(topic, sizeof(topic), STATION_TOPIC_ROOT "/sim%d/%s", s->id,
+             batch ? TELEMETRY_LINE_TOPIC : payload_topic(format));
+    uint8_t header[256];
+    uint16_t pid = 0;
+    if (message_qos) {
+        if (++s->next_pid == 0)
+            s->next_pid = 1;
+        pid = s->next_pid;
+    }
+    int h = mqtt_publish_header(header, topic, message_qos, pid, len);
+    if (!out_room(s, h + len))
+        return false;
+    out_put(s, header, h, now);
+    out_put(s, payload, len, now);
+
+    for (int i = 0; i < count; i++) {
+        if (__atomic_load_n(&sample_sent_us[samples[i]], __ATOMIC_RELAXED) != 0)
+            stats.republished++;
+        __atomic_store_n(&sample_sent_us[samples[i]], now, __ATOMIC_RELAXED);
+    }
+    if (!message_qos)
+        stats.sent_qos0 += count;
+    if (slot) {
+        slot->pid = pid;
+        slot->count = count;
+        slot->batch = batch;
+        slot->sent_us = now;
+        memcpy(slot->samples, samples, count * sizeof(samples[0]));
+    }
+    stats.published_messages++;
+    stats.published_samples += count;
+    if (batch)
+        stats.batches++;
+    return true;
+}
+
+static void station_puback(station_t *s, uint16_t pid, int64_t now)
+{
+    for (int i = 0; i < INFLIGHT_MAX; i++) {
+        inflight_t *f = &s->inflight[i];
+        if (f->pid != pid)
+            continue;
+        hist_add(&ack_hist, now - f->sent_us);
+        for (int k = 0; k < f->count; k++) {
+            if (!(sample_flags[f->samples[k]] & SAMPLE_ACKED))
+                stats.acked++;
+            sample_flags[f->samples[k]] |= SAMPLE_ACKED;
+        }
+        if (f->batch) {
+            s->batch_inflight = false;
+            s->next_batch_us = now + BACKLOG_BATCH_INTERVAL_MS * 1000LL;
+        }
+        f->pid = 0;
+        f->count = 0;
+        return;
+    }
+}
+
+static void station_read(station_t *s, int64_t now)
+{
+    ssize_t n = recv(s->fd, s->in + s->in_len, IN_BUF - s->in_len, 0);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+        stats.drops++;
+        station_close(s, now, (int64_t)(down_s * 1e6 * rand_unit()));
+        return;
+    }
+    if (n < 0)
+        return;
+    s->in_len += n;
+
+    int header;
+    uint32_t len;
+    while ((len = mqtt_packet_len(s->in, s->in_len, &header)) > 0) {
+        if (len == UINT32_MAX || len > IN_BUF) {
+            station_close(s, now, down_s * 1000000LL);
+            return;
+        }
+        const uint8_t *p = s->in + header;
+        switch (s->in[0] >> 4) {
+        case 2:                     // CONNACK
+            if (len - header < 2 || p[1] != 0) {
+                stats.connect_failures++;
+                station_close(s, now, (int64_t)(down_s * 1e6 * (1 + rand_unit())));
+                return;
+            }
+            hist_add(&connack_hist, now - s->state_us);
+            stats.connects++;
+            s->state = ST_ONLINE;
+            s->state_us = now;
+            s->next_batch_us = now;
+            if (drop_mean_s > 0)
+                s->drop_us = now + (int64_t)(-log(rand_unit()) * drop_mean_s * 1e6);
+            break;
+        case 4:                     // PUBACK
+            if (len - header >= 2)
+                station_puback(s, (uint16_t)(p[0] << 8 | p[1]), now);
+            break;
+        }
+        memmove(s->in, s->in + len, s->in_len - len);
+        s->in_len -= len;
+    }
+}
+
+static bool in_outage(const station_t *s, int64_t t)
+{
+    return outage_len_s > 0 && s->id % 100 < outage_percent &&
+           t >= outage_at_s * 1000000LL && t < (outage_at_s + outage_len_s) * 1000000LL;
+}
+
+/*
+ * @brief Timed work of one station: sampling, the connection state machine, replays and
+ *        keepalive. t is the time since the start of the run.
+ */
+static void station_tick(station_t *s, int64_t now, int64_t t, bool sampling)
+{
+    if (sampling && now >= s->next_sample_us) {
+        s->next_sample_us += interval_s * 1000000LL;
+        uint32_t idx = sample_new(s->id);
+        // Live when possible, otherwise queued like flush_data() falls back to backlog_push()
+        if (s->state != ST_ONLINE || !station_publish(s, &idx, 1, false, now))
+            backlog_push(s, idx);
+    }
+
+    switch (s->state) {
+    case ST_OFFLINE:
+        if (now >= s->reconnect_us && !in_outage(s, t))
+            station_connect(s, now);
+        break;
+
+    case ST_TCP:
+    case ST_CONNACK:
+        if (now - s->state_us > CONNECT_TIMEOUT_US) {
+            stats.connect_failures++;
+            station_close(s, now, (int64_t)(down_s * 1e6 * (1 + rand_unit())));
+        }
+        break;
+
+    case ST_ONLINE:
+        if ((s->drop_us && now >= s->drop_us) || in_outage(s, t)) {
+            // Gone without a DISCONNECT: the broker only notices by keepalive
+            stats.drops++;
+            station_close(s, now, in_outage(s, t) ? 0 : (int64_t)(down_s * 1e6));
+            if (!in_outage(s, t))
+                break;
+            // Back at the end of the outage, within a second of the others
+            s->reconnect_us = now + (outage_at_s + outage_len_s) * 1000000LL - t +
+                              (int64_t)(1e6 * rand_unit());
+            break;
+        }
+        if (s->backlog_count > 0 && !s->batch_inflight && now >= s->next_batch_us) {
+            uint32_t batch[BACKLOG_BATCH_SIZE];
+            int count = s->backlog_count < BACKLOG_BATCH_SIZE ? s->backlog_count : BACKLOG_BATCH_SIZE;
+            for (int i = 0; i < count; i++)
+                batch[i] = backlog_peek(s, i);
+            if (station_publish(s, batch, count, true, now)) {
+                s->backlog_head = (s->backlog_head + count) % s->backlog_cap;
+                s->backlog_count -= count;
+                s->batch_inflight = true;
+            }
+        }
+        if (now - s->last_tx_us > KEEPALIVE_S * 500000LL && out_room(s, 2)) {
+            static const uint8_t pingreq[] = {0xC0, 0x00};
+            out_put(s, pingreq, sizeof(pingreq), now);
+        }
+        break;
+    }
+}
+
+static void station_writable(station_t *s, int64_t now)
+{
+    if (s->state == ST_TCP) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0) {
+            stats.connect_failures++;
+            station_close(s, now, (int64_t)(down_s * 1e6 * (1 + rand_unit())));
+            return;
+        }
+        char client_id[32];
+        uint8_t packet[128];
+        snprintf(client_id, sizeof(client_id), "fleet-sim-%d", s->id);
+        int n = mqtt_connect_packet(packet, client_id);
+        out_put(s, packet, n, now);
+        s->state = ST_CONNACK;
+    }
+    if (!flush_out(s)) {
+        stats.drops++;
+        station_close(s, now, (int64_t)(down_s * 1e6 * rand_unit()));
+    }
+}
+
+// Subscriber ------------------------------------------------------------------------------
+
+// Broker counters published by mosquitto every sys_interval
+static const char *const sys_topics[] = {
+    "$SYS/broker/clients/connected",
+    "$SYS/broker/load/messages/received/1min",
+    "$SYS/broker/publish/messages/dropped",
+};
+#define SYS_TOPICS (int)(sizeof(sys_topics) / sizeof(sys_topics[0]))
+static char sys_values[SYS_TOPICS][32];
+
+static struct {
+    int fd;
+    bool subscribed;
+    uint32_t in_len;
+    uint8_t in[SUB_BUF];
+} sub = {.fd = -1};
+
+static void sub_seq(uint64_t seq, int64_t now)
+{
+    if (seq < seq_base || seq - seq_base >= sample_count)
+        return;
+    uint32_t idx = (uint32_t)(seq - seq_base);
+    if (sample_flags[idx] & SAMPLE_DELIVERED)
+        return;
+    sample_flags[idx] |= SAMPLE_DELIVERED;
+    stats.delivered++;
+    hist_add(&deliver_hist, now - sample_sent_us[idx]);
+}
+
+// The "s" entry of a payload_encode_cbor() map
+static bool cbor_seq(const uint8_t *p, uint32_t len, uint64_t *seq)
+{
+    uint32_t pos = 1;
+    if (len == 0 || (p[0] >> 5) != 5)
+        return false;
+    for (int pair = 0; pair < (p[0] & 0x1F) && pos + 2 < len; pair++) {
+        char key = p[pos + 1];
+        pos += 2;
+        if (p[pos] == 0xFA) {
+            pos += 5;
+            continue;
+        }
+        int info = p[pos] & 0x1F, extra = info < 24 ? 0 : 1 << (info - 24);
+        uint64_t v = info < 24 ? (uint64_t)info : 0;
+        if (pos + 1 + extra > len)
+            return false;
+        for (int i = 0; i < extra; i++)
+            v = v << 8 | p[pos + 1 + i];
+        pos += 1 + extra;
+        if (key == 's') {
+            *seq = v;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void sub_message(const char *topic, const uint8_t *p, uint32_t len, int64_t now)
+{
+    for (int i = 0; i < SYS_TOPICS; i++) {
+        if (!strcmp(topic, sys_topics[i])) {
+            uint32_t n = len < sizeof(sys_values[i]) - 1 ? len : sizeof(sys_values[i]) - 1;
+            memcpy(sys_values[i], p, n);
+            sys_values[i][n] = '\0';
+            return;
+        }
+    }
+    size_t len_topic = strlen(topic);
+    if (len_topic > strlen(TELEMETRY_CBOR_TOPIC) &&
+        !strcmp(topic + len_topic - strlen(TELEMETRY_CBOR_TOPIC), TELEMETRY_CBOR_TOPIC)) {
+        uint64_t seq;
+        if (cbor_seq(p, len, &seq))
+            sub_seq(seq, now);
+        return;
+    }
+    // Line protocol, one or several lines
+    for (uint32_t i = 0; i + 4 < len; i++)
+        if (!memcmp(p + i, "seq=", 4) && (i == 0 || p[i - 1] == ',' || p[i - 1] == ' '))
+            sub_seq(strtoull((const char *)p + i + 4, NULL, 10), now);
+}
+
+static void sub_start(void)
+{
+    const char *filters[2 + SYS_TOPICS] = {
+        STATION_TOPIC_ROOT "/+/" TELEMETRY_LINE_TOPIC,
+        STATION_TOPIC_ROOT "/+/" TELEMETRY_CBOR_TOPIC,
+    };
+    for (int i = 0; i < SYS_TOPICS; i++)
+        filters[2 + i] = sys_topics[i];
+
+    int fd = socket(broker_addr->ai_family, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, broker_addr->ai_addr, broker_addr->ai_addrlen) != 0) {
+        perror("broker");
+        exit(1);
+    }
+    uint8_t packet[600];
+    int n = mqtt_connect_packet(packet, "fleet-sim-monitor");
+    n += mqtt_subscribe_packet(packet + n, 1, filters, 2 + SYS_TOPICS);
+    if (send(fd, packet, n, MSG_NOSIGNAL) != n) {
+        perror("broker");
+        exit(1);
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    sub.fd = fd;
+}
+
+static void sub_read(int64_t now)
+{
+    ssize_t n = recv(sub.fd, sub.in + sub.in_len, SUB_BUF - sub.in_len, 0);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+        fprintf(stderr, "monitor connection lost, delivery no longer counted\n");
+        close(sub.fd);
+        sub.fd = -1;
+        return;
+    }
+    if (n < 0)
+        return;
+    sub.in_len += n;
+
+    int header;
+    uint32_t len;
+    while ((len = mqtt_packet_len(sub.in, sub.in_len, &header)) > 0 && len != UINT32_MAX) {
+        const uint8_t *p = sub.in + header;
+        uint32_t body = len - header;
+        if ((sub.in[0] >> 4) == 9)                  // SUBACK
+            sub.subscribed = true;
+        if ((sub.in[0] >> 4) == 3 && body >= 2) {   // PUBLISH, QoS 0
+            uint32_t topic_len = p[0] << 8 | p[1];
+            if (2 + topic_len <= body) {
+                char topic[128];
+                uint32_t t = topic_len < sizeof(topic) - 1 ? topic_len : sizeof(topic) - 1;
+                memcpy(topic, p + 2, t);
+                topic[t] = '\0';
+                sub_message(topic, p + 2 + topic_len, body - 2 - topic_len, now);
+            }
+        }
+        memmove(sub.in, sub.in + len, sub.in_len - len);
+        sub.in_len -= len;
+    }
+    if (len == UINT32_MAX || sub.in_len == SUB_BUF) {
+        fprintf(stderr, "monitor stream corrupted\n");
+        close(sub.fd);
+        sub.fd = -1;
+    }
+}
+
+// InfluxDB poller ---------------------------------------------------------------------------
+
+static pthread_t poller;
+static volatile bool poller_stop;
+static int64_t run_start_s;
+static volatile int64_t influx_count = -1, influx_changed_us;
+static volatile int64_t telegraf_dropped = -1;
+
+/*
+ * @brief Runs a Flux query returning one value and parses it out of the CSV reply. Returns
+ *        false on any error; an empty result gives 0.
+ */
+static bool influx_query(const char *flux, int64_t *value)
+{
+    char host[128], port[8] = "8086";
+    if (sscanf(influx_url, "http://%127[^:/]:%7[0-9]", host, port) < 1)
+        return false;
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM}, *addr;
+    if (getaddrinfo(host, port, &hints, &addr) != 0)
+        return false;
+    int fd = socket(addr->ai_family, SOCK_STREAM, 0);
+    bool ok = fd >= 0 && connect(fd, addr->ai_addr, addr->ai_addrlen) == 0;
+    freeaddrinfo(addr);
+
+    static char request[2048], reply[16384];
+    int n = snprintf(request, sizeof(request),
+                     "POST /api/v2/query?org=%s HTTP/1.0\r\nHost: %s\r\n"
+                     "Authorization: Token %s\r\nContent-Type: application/vnd.flux\r\n"
+                     "Accept: application/csv\r\nContent-Length: %zu\r\n\r\n%s",
+                     influx_org, host, influx_token, strlen(flux), flux);
+    ok = ok && send(fd, request, n, MSG_NOSIGNAL) == n;
+    size_t len = 0;
+    ssize_t got;
+    while (ok && len < sizeof(reply) - 1 && (got = recv(fd, reply + len, sizeof(reply) - 1 - len, 0)) > 0)
+        len += got;
+    if (fd >= 0)
+        close(fd);
+    if (!ok)
+        return false;
+    reply[len] = '\0';
+
+    if (strncmp(reply, "HTTP/1.", 7) || atoi(reply + 9) != 200)
+        return false;
+    char *csv = strstr(reply, "\r\n\r\n");
+    if (csv == NULL)
+        return false;
+    csv += 4;
+
+    // Header row, then the first data row; the value is in the _value column
+    char *row = strchr(csv, '\n');
+    *value = 0;
+    if (row == NULL)
+        return true;
+    *row++ = '\0';
+    int column = 0;
+    for (char *c = csv; c && strncmp(c, "_value", 6); c = strchr(c, ','), c = c ? c + 1 : NULL)
+        column++;
+    for (int i = 0; i < column && row; i++)
+        row = strchr(row, ',') ? strchr(row, ',') + 1 : NULL;
+    if (row && *row && *row != '\r' && *row != '\n')
+        *value = strtoll(row, NULL, 10);
+    return true;
+}
+
+/*
+ * @brief Once a second: the highest seq written gives the ingest lag (time since that sample
+ *        was sent), the number of seq values what reached the database. Telegraf's own
+ *        metrics_dropped counter is read when telegraf-loadtest.yaml is applied.
+ */
+static bool seq_query(const char *aggregate, int64_t *value)
+{
+    char flux[512];
+    snprintf(flux, sizeof(flux),
+             "from(bucket:\"%s\") |> range(start: %" PRId64 ")"
+             " |> filter(fn: (r) => r._measurement == \"" TELEMETRY_MEASUREMENT "\" and r._field == \"seq\""
+             " and r._value >= %" PRIu32 ") |> group() |> %s()",
+             influx_bucket, run_start_s - 60, seq_base, aggregate);
+    return influx_query(flux, value);
+}
+
+static void *poller_task(void *arg)
+{
+    char flux[512];
+    int64_t last_max = 0;
+    while (!poller_stop) {
+        int64_t value;
+        if (seq_query("max", &value) && value > last_max) {
+            last_max = value;
+            uint32_t idx = (uint32_t)(value - seq_base);
+            int64_t sent = idx < sample_cap ? __atomic_load_n(&sample_sent_us[idx], __ATOMIC_RELAXED) : 0;
+            if (sent)
+                hist_add(&lag_hist, now_us() - sent);
+        }
+        if (seq_query("count", &value) && value != influx_count) {
+            influx_count = value;
+            influx_changed_us = now_us();
+        }
+        snprintf(flux, sizeof(flux),
+                 "from(bucket:\"%s\") |> range(start: %" PRId64 ")"
+                 " |> filter(fn: (r) => r._measurement == \"internal_write\" and r._field == \"metrics_dropped\")"
+                 " |> group() |> spread()",
+                 influx_bucket, run_start_s);
+        if (influx_query(flux, &value))
+            telegraf_dropped = value;
+        sleep(1);
+    }
+    return NULL;
+}
+
+// Run -------------------------------------------------------------------------------------
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [-n stations] [-i interval_s] [-d duration_s] [-q 0|1] [-f line|cbor]\n"
+            "          [-c connects_per_s] [-r mean_s_between_drops] [-D down_s]\n"
+            "          [-o percent,at_s,length_s] [-b broker[:port]]\n"
+            "          [-I http://influxdb:8086 -O org -B bucket]   (token in INFLUX_TOKEN)\n",
+            name);
+    exit(2);
+}
+
+static void parse_args(int argc, char **argv)
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "n:i:d:q:f:c:r:D:o:b:I:O:B:")) != -1) {
+        switch (opt) {
+        case 'n': stations = atoi(optarg); break;
+        case 'i': interval_s = atoi(optarg); break;
+        case 'd': duration_s = atoi(optarg); break;
+        case 'q': qos = atoi(optarg) ? 1 : 0; break;
+        case 'f': format = !strcmp(optarg, "cbor") ? PAYLOAD_FORMAT_CBOR : PAYLOAD_FORMAT_LINE; break;
+        case 'c': connect_rate = atoi(optarg); break;
+        case 'r': drop_mean_s = atof(optarg); break;
+        case 'D': down_s = atoi(optarg); break;
+        case 'o':
+            if (sscanf(optarg, "%d,%d,%d", &outage_percent, &outage_at_s, &outage_len_s) != 3)
+                usage(argv[0]);
+            break;
+        case 'b':
+            if (sscanf(optarg, "%127[^:]:%7s", broker_host, broker_port) < 1)
+                usage(argv[0]);
+            break;
+        case 'I': influx_url = optarg; break;
+        case 'O': influx_org = optarg; break;
+        case 'B': influx_bucket = optarg; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (stations < 1 || interval_s < 1 || duration_s < 1 || connect_rate < 1)
+        usage(argv[0]);
+    influx_token = getenv("INFLUX_TOKEN");
+    if (influx_url && (!influx_org || !influx_bucket || !influx_token)) {
+        fprintf(stderr, "InfluxDB needs -O, -B and INFLUX_TOKEN\n");
+        exit(2);
+    }
+}
+
+static void setup(void)
+{
+    // One descriptor per station, plus the monitor and the poller
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    if (limit.rlim_cur < (rlim_t)stations + 16) {
+        fprintf(stderr, "only %lu file descriptors, raise the hard limit (ulimit -Hn)\n",
+                (unsigned long)limit.rlim_cur);
+        exit(1);
+    }
+
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    if (getaddrinfo(broker_host, broker_port, &hints, &broker_addr) != 0) {
+        fprintf(stderr, "cannot resolve %s\n", broker_host);
+        exit(1);
+    }
+
+    uint32_t per_station = duration_s / interval_s + 2;
+    sample_cap = per_station * stations;
+    sample_ts = calloc(sample_cap, sizeof(*sample_ts));
+    sample_sent_us = calloc(sample_cap, sizeof(*sample_sent_us));
+    sample_station = calloc(sample_cap, sizeof(*sample_station));
+    sample_flags = calloc(sample_cap, sizeof(*sample_flags));
+    fleet = calloc(stations, sizeof(*fleet));
+    if (!sample_ts || !sample_sent_us || !sample_station || !sample_flags || !fleet) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    run_start_s = wall_ms() / 1000;
+    seq_base = (uint32_t)run_start_s;
+    int64_t start = now_us();
+    for (int i = 0; i < stations; i++) {
+        station_t *s = &fleet[i];
+        s->id = i;
+        s->fd = -1;
+        s->backlog_cap = per_station;
+        s->backlog = malloc(per_station * sizeof(uint32_t));
+        // Connections ramp up at connect_rate; samples are spread over the interval
+        s->reconnect_us = start + i * 1000000LL / connect_rate;
+        s->next_sample_us = start + (int64_t)(rand_unit() * interval_s * 1e6);
+    }
+}
+
+static uint64_t queued_samples(void)
+{
+    uint64_t n = 0;
+    for (int i = 0; i < stations; i++) {
+        n += fleet[i].backlog_count;
+        for (int k = 0; k < INFLIGHT_MAX; k++)
+            n += fleet[i].inflight[k].pid ? fleet[i].inflight[k].count : 0;
+    }
+    return n;
+}
+
+static void progress(int64_t t, uint64_t *last_published, uint64_t *last_acked)
+{
+    int online = 0;
+    for (int i = 0; i < stations; i++)
+        online += fleet[i].state == ST_ONLINE;
+    fprintf(stderr, "%4" PRId64 " s  online %d  published %" PRIu64 "/s  acked %" PRIu64 "/s"
+            "  queued %" PRIu64 "  delivered %" PRIu64,
+            t / 1000000, online, stats.published_messages - *last_published,
+            stats.acked - *last_acked, queued_samples(), stats.delivered);
+    if (influx_url)
+        fprintf(stderr, "  influx %" PRId64, influx_count);
+    fprintf(stderr, "\n");
+    *last_published = stats.published_messages;
+    *last_acked = stats.acked;
+}
+
+static void report(int64_t elapsed_us)
+{
+    double seconds = elapsed_us / 1e6;
+    uint64_t queued = queued_samples();
+    uint64_t reached_broker = stats.acked + stats.sent_qos0;
+
+    printf("\n%d stations, a sample every %d s for %d s, QoS %d, %s\n", stations, interval_s,
+           duration_s, qos, format == PAYLOAD_FORMAT_CBOR ? "CBOR" : "line protocol");
+    printf("samples\n  generated %" PRIu64 ", published %" PRIu64 " (%" PRIu64 " again after a drop),"
+           " never sent %" PRIu64 "\n",
+           stats.generated, stats.published_samples, stats.republished, queued);
+    printf("broker\n  %" PRIu64 " messages in %.0f s, %.1f/s, %" PRIu64 " of them replay batches\n",
+           stats.published_messages, seconds, stats.published_messages / seconds, stats.batches);
+    if (qos || stats.batches)
+        hist_print("PUBACK", &ack_hist);
+    if (sub.subscribed) {
+        printf("  delivered %" PRIu64 ", lost %" PRId64 "\n", stats.delivered,
+               (int64_t)reached_broker - (int64_t)stats.delivered);
+        hist_print("publish to deliver", &deliver_hist);
+    }
+    printf("  mosquitto: clients %s, received/1min %s, dropped %s\n",
+           sys_values[0][0] ? sys_values[0] : "?", sys_values[1][0] ? sys_values[1] : "?",
+           sys_values[2][0] ? sys_values[2] : "?");
+    printf("connections\n  %" PRIu64 " connects, %" PRIu64 " drops, %" PRIu64 " failed attempts\n",
+           stats.connects, stats.drops, stats.connect_failures);
+    hist_print("CONNACK", &connack_hist);
+    if (influx_url) {
+        printf("telegraf -> influxdb\n  written %" PRId64 ", lost %" PRId64 "\n", influx_count,
+               (int64_t)reached_broker - influx_count);
+        hist_print("ingest lag", &lag_hist);
+        if (telegraf_dropped >= 0)
+            printf("  telegraf metrics_dropped %" PRId64 "\n", telegraf_dropped);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    parse_args(argc, argv);
+    signal(SIGPIPE, SIG_IGN);
+    srand((unsigned)time(NULL));
+    setup();
+
+    sub_start();
+    if (influx_url)
+        pthread_create(&poller, NULL, poller_task, NULL);
+
+    struct pollfd *fds = calloc(stations + 1, sizeof(*fds));
+    int *fd_station = calloc(stations + 1, sizeof(int));
+    const int64_t start = now_us();
+    int64_t next_progress = start + 1000000, end_us = 0;
+    uint64_t last_published = 0, last_acked = 0;
+    enum { RUN, DRAIN, SETTLE } phase = RUN;
+
+    while (1) {
+        int64_t now = now_us(), t = now - start;
+
+        if (phase == RUN && t >= duration_s * 1000000LL) {
+            phase = DRAIN;
+            fprintf(stderr, "sampling stopped, replaying what is queued\n");
+        }
+        if (phase == DRAIN && (queued_samples() == 0 || t >= duration_s * 1000000LL + DRAIN_MAX_US)) {
+            static const uint8_t disconnect[] = {0xE0, 0x00};
+            for (int i = 0; i < stations; i++)
+                if (fleet[i].fd >= 0) {
+                    if (fleet[i].state == ST_ONLINE && fleet[i].out_len == 0)
+                        send(fleet[i].fd, disconnect, sizeof(disconnect), MSG_NOSIGNAL);
+                    close(fleet[i].fd);
+                    fleet[i].fd = -1;
+                }
+            end_us = now;
+            phase = SETTLE;
+            fprintf(stderr, "waiting for the pipeline to settle\n");
+        }
+        if (phase == SETTLE) {
+            int64_t quiet = now - (influx_url ? (influx_changed_us > end_us ? influx_changed_us : end_us) : end_us);
+            if (quiet > (influx_url ? SETTLE_STABLE_US : 2000000) || now - end_us > SETTLE_MAX_US)
+                break;
+        }
+
+        int nfds = 0;
+        if (phase != SETTLE) {
+            for (int i = 0; i < stations; i++) {
+                station_t *s = &fleet[i];
+                station_tick(s, now, t, phase == RUN);
+                if (s->fd >= 0 && s->out_len > 0 && s->state != ST_TCP && !flush_out(s)) {
+                    stats.drops++;
+                    station_close(s, now, down_s * 1000000LL);
+                }
+                if (s->fd < 0)
+                    continue;
+                fds[nfds].fd = s->fd;
+                fds[nfds].events = POLLIN | (s->state == ST_TCP || s->out_len ? POLLOUT : 0);
+                fd_station[nfds++] = i;
+            }
+        }
+        if (sub.fd >= 0) {
+            fds[nfds].fd = sub.fd;
+            fds[nfds].events = POLLIN;
+            fd_station[nfds++] = -1;
+        }
+
+        if (poll(fds, nfds, 5) > 0) {
+            now = now_us();
+            for (int i = 0; i < nfds; i++) {
+                if (!fds[i].revents)
+                    continue;
+                if (fd_station[i] < 0) {
+                    sub_read(now);
+                    continue;
+                }
+                station_t *s = &fleet[fd_station[i]];
+                if (fds[i].revents & (POLLOUT | POLLERR | POLLHUP))
+                    station_writable(s, now);
+                if (s->fd >= 0 && s->state != ST_TCP && (fds[i].revents & (POLLIN | POLLHUP)))
+                    station_read(s, now);
+            }
+        }
+
+        if (now >= next_progress) {
+            progress(now - start, &last_published, &last_acked);
+            next_progress += 1000000;
+        }
+    }
+
+    if (influx_url) {
+        poller_stop = true;
+        pthread_join(poller, NULL);
+    }
+    report(end_us - start);
+    return 0;
+}
@@ -0,0 +1,111 @@
+/*
+ * Decodes a dump of the "history" partition and prints the samples as InfluxDB line protocol,
+ * oldest first, ready for `influx write`.
+ *
+ *  parttool.py read_partition --partition-name history --output history.bin
+ *  gcc -O2 -I../main -o history_dump history_dump.c \
+ *      ../main/ringlog/ringlog.c ../main/tscodec/tscodec.c ../main/payload/payload.c
+ *  ./history_dump history.bin > history.lp
+ *
+ * Both record formats (CONFIG_HISTORY_COMPRESSED on or off) are recognised.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ringlog/ringlog.h"
+#include "tscodec/tscodec.h"
+#include "payload/payload.h"
+
+static uint8_t *image;
+
+static int image_read(void *ctx, uint32_t offset, void *dst, uint32_t len)
+{
+    memcpy(dst, image + offset, len);
+    return 0;
+}
+
+static int image_write(void *ctx, uint32_t offset, const void *src, uint32_t len)
+{
+    return -1;
+}
+
+static int image_erase(void *ctx, uint32_t offset, uint32_t len)
+{
+    return -1;
+}
+
+static void print_sample(const sample_t *sample)
+{
+    char line[PAYLOAD_MAX_LEN];
+    if (payload_encode_line(sample, line, sizeof(line)) > 0)
+        puts(line);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <history partition dump>\n", argv[0]);
+        return 2;
+    }
+
+    FILE *f = fopen(argv[1], "rb");
+    if (f == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    image = malloc(size);
+    if (image == NULL || fread(image, 1, size, f) != (size_t)size) {
+        fprintf(stderr, "failed to read %s\n", argv[1]);
+        return 1;
+    }
+    fclose(f);
+
+    ringlog_flash_t flash = {NULL, size, image_read, image_write, image_erase};
+    ringlog_t log;
+    const uint32_t sizes[] = {TSCODEC_BLOCK_SIZE + 1, TSCODEC_RECORD_SIZE + 1};
+    bool compressed = false;
+    for (int i = 0; i < 2; i++) {
+        if (ringlog_mount(&log, &flash, sizes[i]) != RINGLOG_OK) {
+            fprintf(stderr, "%s is not a history partition dump\n", argv[1]);
+            return 1;
+        }
+        if (ringlog_count(&log) > 0) {
+            compressed = i == 0;
+            break;
+        }
+    }
+
+    uint32_t records = ringlog_count(&log), torn = 0, samples = 0;
+    uint8_t data[TSCODEC_BLOCK_SIZE];
+    sample_t decoded[UINT8_MAX];
+    for (uint32_t pos = 0; pos < records; pos++) {
+        if (ringlog_read(&log, pos, data) != RINGLOG_OK) {
+            torn++;
+            continue;
+        }
+        if (!compressed) {
+            tscodec_unpack_record(data, decoded);
+            print_sample(decoded);
+            samples++;
+            continue;
+        }
+        int n = tscodec_block_decode(data, sizeof(data), decoded, UINT8_MAX);
+        if (n < 0) {
+            torn++;
+            continue;
+        }
+        for (int i = 0; i < n; i++)
+            print_sample(&decoded[i]);
+        samples += n;
+    }
+
+    fprintf(stderr, "%s: %u records, %u samples, %u unreadable, %.1f bytes/sample\n",
+            compressed ? "blocks" : "fixed records", records, samples, torn,
+            samples ? (double)records * log.record_size / samples : 0.0);
+    free(image);
+    return 0;
+}
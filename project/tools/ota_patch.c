@@ -0,0 +1,356 @@
+/*
+ * Writes OTA payloads for main/otapatch: a binary delta of a firmware image against the
+ * image running on the devices, or with no source image a compressed full image. Every
+ * payload is decoded again with the device decoder and compared before it is written.
+ *
+ *  gcc -O2 -I../main -o ota_patch ota_patch.c ../main/otapatch/otapatch.c
+ *
+ *  ./ota_patch [-s running.bin] new.bin payload.otap
+ *
+ * Both images are the .bin files of the build (build/<project>.bin); their last 32 bytes are
+ * the SHA-256 ESP-IDF appends, which is how the device recognizes its running image.
+ * Plain .bin files can still be served: the device tells them apart by their first byte.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "otapatch/otapatch.h"
+
+#define MIN_MATCH 6
+#define HASH_BITS 18
+#define MAX_CHAIN 48
+#define GIVE_UP 32          // Extension of an ADD stops this far below its best score
+
+typedef struct {
+    uint8_t *data;
+    size_t len, cap;
+} buf_t;
+
+static void put_bytes(buf_t *b, const void *data, size_t len)
+{
+    if (b->len + len > b->cap) {
+        b->cap = (b->len + len) * 2;
+        b->data = realloc(b->data, b->cap);
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+static void put_byte(buf_t *b, uint8_t v)
+{
+    put_bytes(b, &v, 1);
+}
+
+static void put_varint(buf_t *b, uint64_t v)
+{
+    while (v >= 0x80) {
+        put_byte(b, (uint8_t)(v | 0x80));
+        v >>= 7;
+    }
+    put_byte(b, (uint8_t)v);
+}
+
+static int varint_len(uint64_t v)
+{
+    int n = 1;
+    while (v >= 0x80) {
+        v >>= 7;
+        n++;
+    }
+    return n;
+}
+
+static uint64_t zigzag(int64_t v)
+{
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static uint8_t *load(const char *path, size_t *len)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        perror(path);
+        exit(1);
+    }
+    fseek(f, 0, SEEK_END);
+    *len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t *data = malloc(*len ? *len : 1);
+    if (fread(data, 1, *len, f) != *len) {
+        perror(path);
+        exit(1);
+    }
+    fclose(f);
+    return data;
+}
+
+// Hash chains over MIN_MATCH byte prefixes ---------------------------------------------
+
+typedef struct {
+    int32_t *head;
+    int32_t *prev;
+} chains_t;
+
+static uint32_t hash(const uint8_t *p)
+{
+    uint32_t h = 0;
+    for (int i = 0; i < MIN_MATCH; i++)
+        h = h * 0x9E3779B1u + p[i];
+    return h >> (32 - HASH_BITS);
+}
+
+static void chains_init(chains_t *c, size_t len)
+{
+    c->head = malloc(sizeof(int32_t) << HASH_BITS);
+    c->prev = malloc(sizeof(int32_t) * (len ? len : 1));
+    memset(c->head, 0xFF, sizeof(int32_t) << HASH_BITS);
+}
+
+static void chains_insert(chains_t *c, const uint8_t *data, size_t len, size_t pos)
+{
+    if (pos + MIN_MATCH > len)
+        return;
+    uint32_t h = hash(data + pos);
+    c->prev[pos] = c->head[h];
+    c->head[h] = (int32_t)pos;
+}
+
+// Encoder ---------------------------------------------------------------------------------
+
+static const uint8_t *src, *dst;
+static size_t src_len, dst_len;
+
+typedef struct {
+    int op;
+    size_t len;
+    size_t from;        // Source offset (ADD) or target offset (COPY)
+    long gain;          // Bytes saved over literals
+} match_t;
+
+/*
+ * @brief ADD candidate: extends while matching bytes outweigh the diff bytes, bsdiff
+ *        style, so code shifted by a few bytes still patches from the old image.
+ */
+static void try_add(size_t pos, size_t from, size_t src_end, match_t *best)
+{
+    long score = 0, best_score = 0;
+    size_t best_len = 0;
+    for (size_t i = 0; pos + i < dst_len && from + i < src_len; i++) {
+        score += dst[pos + i] == src[from + i] ? 1 : -2;
+        if (score > best_score) {
+            best_score = score;
+            best_len = i + 1;
+        } else if (score < best_score - GIVE_UP) {
+            break;
+        }
+    }
+    long cost = 1 + varint_len(zigzag((int64_t)from - (int64_t)src_end)) + varint_len(best_len) + 1;
+    if (best_len >= MIN_MATCH && best_score - cost > best->gain)
+        *best = (match_t){OTAPATCH_OP_ADD, best_len, from, best_score - cost};
+}
+
+static void try_copy(size_t pos, size_t from, match_t *best)
+{
+    size_t len = 0;
+    while (pos + len < dst_len && dst[from + len] == dst[pos + len])
+        len++;
+    long cost = 1 + varint_len(pos - from) + varint_len(len);
+    if (len >= MIN_MATCH && (long)len - cost > best->gain)
+        *best = (match_t){OTAPATCH_OP_COPY, len, from, (long)len - cost};
+}
+
+static void emit_literal(buf_t *out, size_t start, size_t end)
+{
+    if (end == start)
+        return;
+    put_byte(out, OTAPATCH_OP_LITERAL);
+    put_varint(out, end - start);
+    put_bytes(out, dst + start, end - start);
+}
+
+// Zero runs shorter than this stay inside the diff run: splitting costs two varints
+#define MIN_ZERO_RUN 3
+
+static void emit_add(buf_t *out, size_t pos, size_t from, size_t len, size_t src_end)
+{
+    put_byte(out, OTAPATCH_OP_ADD);
+    put_varint(out, zigzag((int64_t)from - (int64_t)src_end));
+    put_varint(out, len);
+
+    size_t i = 0;
+    while (i < len) {
+        size_t zeros = 0;
+        while (i + zeros < len && dst[pos + i + zeros] == src[from + i + zeros])
+            zeros++;
+        put_varint(out, zeros);
+        i += zeros;
+        if (i == len)
+            break;
+
+        size_t n = 0, same = 0;
+        while (i + n < len && same < MIN_ZERO_RUN) {
+            same = dst[pos + i + n] == src[from + i + n] ? same + 1 : 0;
+            n++;
+        }
+        if (same == MIN_ZERO_RUN)
+            n -= same;
+        put_varint(out, n);
+        for (size_t k = 0; k < n; k++)
+            put_byte(out, (uint8_t)(dst[pos + i + k] - src[from + i + k]));
+        i += n;
+    }
+}
+
+static void encode(buf_t *out)
+{
+    chains_t sc, tc;
+    chains_init(&sc, src_len);
+    chains_init(&tc, dst_len);
+    for (size_t i = 0; i + MIN_MATCH <= src_len; i++)
+        chains_insert(&sc, src, src_len, i);
+
+    size_t pos = 0, lit = 0, inserted = 0;
+    size_t src_end = 0, dst_end = 0;    // Where the previous ADD ended, in both images
+
+    while (pos < dst_len) {
+        match_t best = {0, 0, 0, 0};
+
+        if (pos + MIN_MATCH <= dst_len) {
+            // Same displacement as the previous ADD: catches edited regions with no exact seed
+            size_t expected = src_end + (pos - dst_end);
+            if (src_len && expected < src_len)
+                try_add(pos, expected, src_end, &best);
+
+            uint32_t h = hash(dst + pos);
+            int chain = 0;
+            for (int32_t c = sc.head[h]; c >= 0 && chain < MAX_CHAIN; c = sc.prev[c], chain++)
+                if ((size_t)c != expected && !memcmp(src + c, dst + pos, MIN_MATCH))
+                    try_add(pos, c, src_end, &best);
+            chain = 0;
+            for (int32_t c = tc.head[h]; c >= 0 && chain < MAX_CHAIN; c = tc.prev[c], chain++)
+                if (!memcmp(dst + c, dst + pos, MIN_MATCH))
+                    try_copy(pos, c, &best);
+        }
+
+        if (best.len == 0) {
+            chains_insert(&tc, dst, dst_len, pos);
+            inserted = ++pos;
+            continue;
+        }
+
+        emit_literal(out, lit, pos);
+        if (best.op == OTAPATCH_OP_ADD) {
+            emit_add(out, pos, best.from, best.len, src_end);
+            src_end = best.from + best.len;
+            dst_end = pos + best.len;
+        } else {
+            put_byte(out, OTAPATCH_OP_COPY);
+            put_varint(out, pos - best.from);
+            put_varint(out, best.len);
+        }
+        pos += best.len;
+        for (; inserted < pos; inserted++)
+            chains_insert(&tc, dst, dst_len, inserted);
+        lit = pos;
+    }
+    emit_literal(out, lit, pos);
+}
+
+// Check with the device decoder -------------------------------------------------------
+
+static buf_t decoded;
+
+static int check_read_source(void *ctx, uint32_t offset, void *out, uint32_t len)
+{
+    if (offset + len > src_len)
+        return -1;
+    memcpy(out, src + offset, len);
+    return 0;
+}
+
+static int check_read_target(void *ctx, uint32_t offset, void *out, uint32_t len)
+{
+    if (offset + len > decoded.len)
+        return -1;
+    memcpy(out, decoded.data + offset, len);
+    return 0;
+}
+
+static int check_write_target(void *ctx, const void *data, uint32_t len)
+{
+    put_bytes(&decoded, data, len);
+    return 0;
+}
+
+static bool check(const buf_t *payload)
+{
+    static otapatch_t patch;
+    const otapatch_io_t io = {NULL, check_read_source, check_read_target, check_write_target};
+    decoded.len = 0;
+    otapatch_init(&patch, &io);
+
+    // Odd piece sizes, as a TCP stream would deliver them
+    int err = OTAPATCH_OK;
+    for (size_t i = 0, n = 1; i < payload->len && err == OTAPATCH_OK; i += n, n = n * 7 % 1531 + 1) {
+        if (n > payload->len - i)
+            n = payload->len - i;
+        err = otapatch_feed(&patch, payload->data + i, n);
+    }
+    if (err == OTAPATCH_OK)
+        err = otapatch_finish(&patch);
+    if (err != OTAPATCH_OK) {
+        fprintf(stderr, "decoder error %d\n", err);
+        return false;
+    }
+    return decoded.len == dst_len && !memcmp(decoded.data, dst, dst_len);
+}
+
+int main(int argc, char **argv)
+{
+    const char *source_path = NULL;
+    int arg = 1;
+    if (argc > 2 && !strcmp(argv[1], "-s")) {
+        source_path = argv[2];
+        arg = 3;
+    }
+    if (argc - arg != 2) {
+        fprintf(stderr, "usage: %s [-s running.bin] new.bin payload.otap\n", argv[0]);
+        return 2;
+    }
+
+    if (source_path)
+        src = load(source_path, &src_len);
+    dst = load(argv[arg], &dst_len);
+
+    otapatch_header_t header = {
+        .magic = OTAPATCH_MAGIC,
+        .version = OTAPATCH_VERSION,
+        .source_size = (uint32_t)src_len,
+        .target_size = (uint32_t)dst_len,
+    };
+    if (src_len >= 32)
+        memcpy(header.source_sha256, src + src_len - 32, 32);
+    if (dst_len >= 32)
+        memcpy(header.target_sha256, dst + dst_len - 32, 32);
+
+    buf_t out = {0};
+    put_bytes(&out, &header, sizeof(header));
+    encode(&out);
+
+    if (!check(&out)) {
+        fprintf(stderr, "payload does not decode to %s, not written\n", argv[arg]);
+        return 1;
+    }
+
+    FILE *f = fopen(argv[arg + 1], "wb");
+    if (f == NULL || fwrite(out.data, 1, out.len, f) != out.len || fclose(f) != 0) {
+        perror(argv[arg + 1]);
+        return 1;
+    }
+    printf("%s: %zu bytes for a %zu byte image (%.1f%%), %s\n", argv[arg + 1], out.len, dst_len,
+           100.0 * out.len / dst_len, source_path ? "delta" : "compressed");
+    return 0;
+}
@@ -0,0 +1,55 @@
+#!/usr/bin/env python3
+"""Serves one file over HTTP/1.1 with Range and If-Range support, and closes every response
+after DROP bytes of body (0: never), like a link that keeps going down mid-download.
+
+    flaky_server.py FILE DROP PORT
+"""
+import hashlib
+import http.server
+import re
+import socketserver
+import sys
+
+path, drop, port = sys.argv[1], int(sys.argv[2]), int(sys.argv[3])
+data = open(path, 'rb').read()
+etag = '"%s"' % hashlib.sha256(data).hexdigest()[:16]
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+
+    def do_GET(self):
+        start = 0
+        range_header = self.headers.get('Range')
+        if_range = self.headers.get('If-Range')
+        partial = range_header is not None and (if_range is None or if_range == etag)
+        if partial:
+            start = int(re.match(r'bytes=(\d+)-', range_header).group(1))
+            self.send_response(206)
+            self.send_header('Content-Range', 'bytes %d-%d/%d' % (start, len(data) - 1, len(data)))
+        else:
+            self.send_response(200)
+        self.send_header('Content-Length', str(len(data) - start))
+        self.send_header('ETag', etag)
+        self.end_headers()
+        sys.stderr.write('GET Range=%s If-Range=%s -> %d from %d\n' %
+                         (range_header, if_range, 206 if partial else 200, start))
+
+        body = data[start:]
+        if drop and len(body) > drop:
+            self.wfile.write(body[:drop])
+            self.wfile.flush()
+            self.close_connection = True
+            self.connection.shutdown(2)
+            return
+        self.wfile.write(body)
+
+    def log_message(self, *args):
+        pass
+
+
+class Server(socketserver.ThreadingMixIn, http.server.HTTPServer):
+    allow_reuse_address = True
+
+
+Server(('127.0.0.1', port), Handler).serve_forever()
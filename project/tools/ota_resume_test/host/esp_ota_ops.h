@@ -0,0 +1,14 @@
+#pragma once
+#include "esp_partition.h"
+
+typedef struct {
+    uint32_t magic_word;
+    char version[32];
+    char project_name[32];
+    uint8_t app_elf_sha256[32];
+} esp_app_desc_t;
+
+const esp_partition_t *esp_ota_get_running_partition(void);
+const esp_partition_t *esp_ota_get_next_update_partition(const esp_partition_t *start);
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t *part);
+const esp_app_desc_t *esp_app_get_description(void);
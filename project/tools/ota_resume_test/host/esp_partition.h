@@ -0,0 +1,19 @@
+#pragma once
+#include "esp_err.h"
+
+#define ESP_BOOTLOADER_OFFSET 0
+#define ESP_PARTITION_TABLE_OFFSET 0x8000
+
+typedef enum { ESP_PARTITION_TYPE_APP = 0, ESP_PARTITION_TYPE_DATA = 1 } esp_partition_type_t;
+
+typedef struct {
+    esp_partition_type_t type;
+    uint32_t address;
+    uint32_t size;
+    uint32_t erase_size;
+} esp_partition_t;
+
+esp_err_t esp_partition_read(const esp_partition_t *part, size_t offset, void *dst, size_t len);
+esp_err_t esp_partition_write(const esp_partition_t *part, size_t offset, const void *src, size_t len);
+esp_err_t esp_partition_erase_range(const esp_partition_t *part, size_t offset, size_t len);
+esp_err_t esp_partition_get_sha256(const esp_partition_t *part, uint8_t *sha256);
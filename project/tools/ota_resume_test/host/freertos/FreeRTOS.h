@@ -0,0 +1,14 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+
+#define portMAX_DELAY 0xffffffff
+#define portTICK_PERIOD_MS 10
+#define pdMS_TO_TICKS(ms) ((ms) / portTICK_PERIOD_MS)
+#define pdTRUE 1
+#define pdFALSE 0
+#define tskIDLE_PRIORITY 0
@@ -0,0 +1,8 @@
+// The OTA options of main/Kconfig.projbuild. Unthrottled, with small checkpoints so a
+// test image crosses several of them between dropped connections.
+#pragma once
+#define CONFIG_OTA_MAX_KBPS 0
+#define CONFIG_OTA_PROGRESS_STEP 10
+#define CONFIG_OTA_CHECKPOINT_KB 4
+#define CONFIG_OTA_RETRIES 5
+#define CONFIG_PROJECT_USE_CERT_BUNDLE 1
@@ -0,0 +1,374 @@
+/*
+ * Host test of the resumable OTA download in main/ota/ota.c: the download runs against
+ * flaky_server.py, which cuts every response after a set number of bytes, with the update
+ * slot and NVS emulated in RAM. run.sh builds the test and goes through the cases.
+ *
+ *  gcc -O1 -g -fsanitize=address,undefined -Ihost -include host/sdkconfig.h -I../../main \
+ *      -o ota_resume_test ota_resume_test.c ../../main/otapatch/otapatch.c -lcrypto
+ *
+ *  ./ota_resume_test url running.bin expected.bin retry|reboot
+ *  ./ota_resume_test url running.bin - overflow
+ *
+ * "retry" resumes in the same boot, as ota_task() does, "reboot" resets all RAM state and
+ * picks the download up again from NVS through ota_init() before each attempt. "overflow"
+ * serves an image larger than the slot, which must fail once and not stay queued.
+ * The flash programs in SLOT_ALIGN units, and a program that would need an erase counts as
+ * a NOR violation.
+ */
+#define _GNU_SOURCE
+#include <time.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <openssl/sha.h>
+
+#include "ota/ota.c"
+
+#define PART_SIZE (1024 * 1024)
+#define MAX_ATTEMPTS 100
+
+// ---------------------------------------------------------------------------------------
+// Flash: the running image and the update slot
+
+static uint8_t running_mem[PART_SIZE], slot_mem[PART_SIZE];
+static uint32_t slot_end;
+static uint32_t nor_violations, erases;
+static esp_partition_t running_part = {ESP_PARTITION_TYPE_APP, 0x10000, PART_SIZE, 4096};
+static esp_partition_t update_part = {ESP_PARTITION_TYPE_APP, 0x110000, PART_SIZE, 4096};
+static const esp_partition_t *boot_part;
+
+static uint8_t *part_mem(const esp_partition_t *part)
+{
+    return part == &running_part ? running_mem : slot_mem;
+}
+
+const esp_partition_t *esp_ota_get_running_partition(void) { return &running_part; }
+const esp_partition_t *esp_ota_get_next_update_partition(const esp_partition_t *start) { return &update_part; }
+
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t *part)
+{
+    boot_part = part;
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *part, size_t offset, void *dst, size_t len)
+{
+    if (offset + len > part->size)
+        return ESP_ERR_INVALID_ARG;
+    memcpy(dst, part_mem(part) + offset, len);
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t *part, size_t offset, const void *src, size_t len)
+{
+    const uint8_t *p = src;
+    assert(part == &update_part && offset % SLOT_ALIGN == 0 && len % SLOT_ALIGN == 0);
+    if (offset + len > part->size)
+        return ESP_ERR_INVALID_ARG;
+    for (size_t i = 0; i < len; i++) {
+        if (p[i] & ~slot_mem[offset + i])
+            nor_violations++;
+        slot_mem[offset + i] &= p[i];
+    }
+    if (offset + len > slot_end)
+        slot_end = offset + len;
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *part, size_t offset, size_t len)
+{
+    assert(part == &update_part && offset % part->erase_size == 0 && len % part->erase_size == 0);
+    if (offset + len > part->size)
+        return ESP_ERR_INVALID_ARG;
+    memset(slot_mem + offset, 0xFF, len);
+    erases++;
+    return ESP_OK;
+}
+
+// The image ends with the SHA-256 of what precedes it, as the bootloader checks. The
+// bootloader itself is not emulated.
+esp_err_t esp_partition_get_sha256(const esp_partition_t *part, uint8_t *sha256)
+{
+    if (part != &running_part && part != &update_part)
+        return ESP_ERR_NOT_SUPPORTED;
+    uint32_t end = part == &running_part ? running_part.size : slot_end;
+    if (end < HASH_LEN)
+        return ESP_ERR_INVALID_SIZE;
+    SHA256(part_mem(part), end - HASH_LEN, sha256);
+    return memcmp(sha256, part_mem(part) + end - HASH_LEN, HASH_LEN) ? ESP_ERR_INVALID_CRC : ESP_OK;
+}
+
+// ---------------------------------------------------------------------------------------
+// NVS: the one resume blob
+
+static uint8_t nvs_blob[4096];
+static size_t nvs_len;
+static int nvs_writes;
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t mode, nvs_handle_t *handle)
+{
+    *handle = 1;
+    return ESP_OK;
+}
+
+void nvs_close(nvs_handle_t handle) {}
+esp_err_t nvs_commit(nvs_handle_t handle) { return ESP_OK; }
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *dst, size_t *len)
+{
+    if (nvs_len == 0)
+        return ESP_ERR_NVS_NOT_FOUND;
+    if (*len < nvs_len)
+        return ESP_ERR_INVALID_SIZE;
+    memcpy(dst, nvs_blob, nvs_len);
+    *len = nvs_len;
+    return ESP_OK;
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *src, size_t len)
+{
+    assert(len <= sizeof(nvs_blob));
+    memcpy(nvs_blob, src, len);
+    nvs_len = len;
+    nvs_writes++;
+    return ESP_OK;
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key)
+{
+    nvs_len = 0;
+    return ESP_OK;
+}
+
+// ---------------------------------------------------------------------------------------
+// HTTP client: plain HTTP/1.1 over a socket, one request per connection
+
+struct esp_http_client {
+    char host[64];
+    int port;
+    char path[256];
+    http_event_handle_cb handler;
+    char headers[4][2][80];
+    int header_count;
+    int fd;
+    int status;
+    int64_t content_length, received;
+};
+
+esp_http_client_handle_t esp_http_client_init(const esp_http_client_config_t *config)
+{
+    struct esp_http_client *client = calloc(1, sizeof(*client));
+    if (sscanf(config->url, "http://%63[^:]:%d%255s", client->host, &client->port, client->path) != 3) {
+        free(client);
+        return NULL;
+    }
+    client->handler = config->event_handler;
+    client->fd = -1;
+    return client;
+}
+
+esp_err_t esp_http_client_set_header(esp_http_client_handle_t client, const char *key, const char *value)
+{
+    assert(client->header_count < 4);
+    snprintf(client->headers[client->header_count][0], 80, "%s", key);
+    snprintf(client->headers[client->header_count][1], 80, "%s", value);
+    client->header_count++;
+    return ESP_OK;
+}
+
+esp_err_t esp_http_client_open(esp_http_client_handle_t client, int write_len)
+{
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(client->port)};
+    inet_pton(AF_INET, client->host, &addr.sin_addr);
+    client->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(client->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+        return ESP_ERR_HTTP_CONNECT;
+
+    esp_http_client_event_t event = {.event_id = HTTP_EVENT_ON_CONNECTED, .client = client};
+    client->handler(&event);
+
+    char request[1024];
+    int n = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %s\r\n", client->path, client->host);
+    for (int i = 0; i < client->header_count; i++)
+        n += snprintf(request + n, sizeof(request) - n, "%s: %s\r\n", client->headers[i][0], client->headers[i][1]);
+    n += snprintf(request + n, sizeof(request) - n, "Connection: close\r\n\r\n");
+    return write(client->fd, request, n) == n ? ESP_OK : ESP_ERR_HTTP_CONNECT;
+}
+
+int64_t esp_http_client_fetch_headers(esp_http_client_handle_t client)
+{
+    char line[512];
+    int n = 0;
+    bool status_line = true;
+    char c;
+
+    client->content_length = -1;
+    while (read(client->fd, &c, 1) == 1) {
+        if (c != '\n') {
+            if (n < (int)sizeof(line) - 1)
+                line[n++] = c;
+            continue;
+        }
+        line[n > 0 && line[n - 1] == '\r' ? n - 1 : n] = '\0';
+        n = 0;
+        if (line[0] == '\0')
+            return client->content_length;
+        if (status_line) {
+            if (sscanf(line, "HTTP/1.%*d %d", &client->status) != 1)
+                return ESP_ERR_HTTP_FETCH_HEADER;
+            status_line = false;
+            continue;
+        }
+        char *value = strchr(line, ':');
+        if (value == NULL)
+            continue;
+        *value++ = '\0';
+        while (*value == ' ')
+            value++;
+        if (!strcasecmp(line, "Content-Length"))
+            client->content_length = atoll(value);
+        esp_http_client_event_t event = {.event_id = HTTP_EVENT_ON_HEADER, .client = client,
+                                         .header_key = line, .header_value = value};
+        client->handler(&event);
+    }
+    return ESP_ERR_HTTP_FETCH_HEADER;
+}
+
+int esp_http_client_get_status_code(esp_http_client_handle_t client) { return client->status; }
+
+int esp_http_client_read(esp_http_client_handle_t client, char *buf, int len)
+{
+    if (client->content_length >= 0 && len > client->content_length - client->received)
+        len = client->content_length - client->received;
+    if (len == 0)
+        return 0;
+    int n = read(client->fd, buf, len);
+    if (n > 0)
+        client->received += n;
+    return n;
+}
+
+bool esp_http_client_is_complete_data_received(esp_http_client_handle_t client)
+{
+    return client->received == client->content_length;
+}
+
+esp_err_t esp_http_client_cleanup(esp_http_client_handle_t client)
+{
+    if (client->fd >= 0)
+        close(client->fd);
+    free(client);
+    return ESP_OK;
+}
+
+// ---------------------------------------------------------------------------------------
+// The rest of the firmware
+
+static esp_app_desc_t app_desc;
+const esp_app_desc_t *esp_app_get_description(void) { return &app_desc; }
+
+int64_t esp_timer_get_time(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000LL + t.tv_nsec / 1000;
+}
+
+const char *esp_err_to_name(esp_err_t err)
+{
+    static char name[16];
+    snprintf(name, sizeof(name), "0x%x", err);
+    return name;
+}
+
+size_t strlcpy(char *dst, const char *src, size_t size)
+{
+    size_t len = strlen(src);
+    if (size > 0) {
+        size_t n = len < size - 1 ? len : size - 1;
+        memcpy(dst, src, n);
+        dst[n] = '\0';
+    }
+    return len;
+}
+
+void esp_restart(void) { abort(); }
+esp_err_t esp_crt_bundle_attach(void *conf) { return ESP_OK; }
+void vTaskDelay(TickType_t ticks) {}
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack, void *arg,
+                       UBaseType_t priority, TaskHandle_t *handle) { return pdTRUE; }
+BaseType_t xTaskNotify(TaskHandle_t task, uint32_t value, eNotifyAction action) { return pdTRUE; }
+BaseType_t xTaskNotifyWait(uint32_t clear_on_entry, uint32_t clear_on_exit, uint32_t *value, TickType_t wait) { return pdTRUE; }
+bool boot_wait(boot_phase_t phase, TickType_t timeout) { return true; }
+void radio_hold(void) {}
+void radio_release(void) {}
+bool mqtt_is_connected() { return false; }
+int mqtt_enqueue_qos(const char *topic, const char *data, int len, int qos) { return 0; }
+void tls_session_record(const char *server_name, uint32_t handshake_ms, bool resumed) {}
+
+// ---------------------------------------------------------------------------------------
+
+static size_t load(const char *path, uint8_t *dst, size_t size)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        perror(path);
+        exit(2);
+    }
+    size_t len = fread(dst, 1, size, f);
+    fclose(f);
+    return len;
+}
+
+static uint8_t expected[PART_SIZE];
+
+int main(int argc, char **argv)
+{
+    if (argc != 5) {
+        fprintf(stderr, "usage: %s url running.bin expected.bin|- retry|reboot|overflow\n", argv[0]);
+        return 2;
+    }
+    const char *mode = argv[4];
+    bool reboot = !strcmp(mode, "reboot");
+    bool overflow = !strcmp(mode, "overflow");
+
+    memset(running_mem, 0xFF, sizeof(running_mem));
+    running_part.size = load(argv[2], running_mem, sizeof(running_mem));
+    size_t expected_len = overflow ? 0 : load(argv[3], expected, sizeof(expected));
+    memset(slot_mem, 0x5A, sizeof(slot_mem));     // Whatever the previous update left
+    strcpy(pending_url, argv[1]);
+    get_sha256_of_partitions();
+
+    int attempts = 0;
+    esp_err_t ret;
+    do {
+        attempts++;
+        if (reboot) {
+            memset(&resume, 0, sizeof(resume));
+            memset(&slot, 0, sizeof(slot));
+            busy = false;
+            ota_init();
+            assert(attempts == 1 || busy);
+        }
+        ret = download(pending_url);
+        printf("== attempt %d: %s, saved offset %" PRIu32 " of %" PRIu32 "\n", attempts,
+               esp_err_to_name(ret), resume.offset, resume.total);
+    } while (resumable(ret) && attempts < MAX_ATTEMPTS);
+
+    bool ok;
+    if (overflow) {
+        // Fails at once, nothing left in NVS for the next boot to queue
+        memset(&resume, 0, sizeof(resume));
+        busy = false;
+        ota_init();
+        ok = ret == ESP_ERR_INVALID_ARG && attempts == 1 && boot_part == NULL && nvs_len == 0 && !busy;
+    } else {
+        ok = ret == ESP_OK && boot_part == &update_part && !memcmp(slot_mem, expected, expected_len) &&
+             nor_violations == 0 && nvs_len == 0;
+    }
+    printf("RESULT %s: attempts=%d nvs_writes=%d erases=%" PRIu32 " nor_violations=%" PRIu32 "\n",
+           ok ? "PASS" : "FAIL", attempts, nvs_writes, erases, nor_violations);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,61 @@
+#!/bin/sh
+# Builds ota_resume_test and tools/ota_patch, makes test images and downloads each of them
+# through flaky_server.py. Needs gcc, libcrypto and python3. Exits non-zero on a failure.
+set -e
+cd "$(dirname "$0")"
+PORT=${PORT:-8099}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+gcc -O1 -g -fsanitize=address,undefined -Ihost -include host/sdkconfig.h -I../../main \
+    -o "$WORK/ota_resume_test" ota_resume_test.c ../../main/otapatch/otapatch.c -lcrypto
+gcc -O2 -I../../main -o "$WORK/ota_patch" ../ota_patch.c ../../main/otapatch/otapatch.c
+
+# Plain images: image header magic, padded to 16 bytes, SHA-256 appended as by esptool
+python3 - "$WORK" <<'PY'
+import hashlib, random, sys
+def image(name, body):
+    body = bytes([0xE9]) + body[1:]
+    body += b'\xff' * (-len(body) % 16)
+    open('%s/%s' % (sys.argv[1], name), 'wb').write(body + hashlib.sha256(body).digest())
+rng = random.Random(1)
+running = bytearray(rng.randbytes(300 * 1024))
+update = bytearray(running)
+for _ in range(200):
+    at = rng.randrange(len(update) - 64)
+    update[at:at + 64] = rng.randbytes(64)
+image('running.bin', running)
+image('update.bin', update)
+image('oversized.bin', rng.randbytes(1100 * 1024))
+PY
+"$WORK/ota_patch" -s "$WORK/running.bin" "$WORK/update.bin" "$WORK/delta.otap" >/dev/null
+"$WORK/ota_patch" "$WORK/update.bin" "$WORK/full.otap" >/dev/null
+
+failed=0
+run() {  # name, served file, bytes per connection, expected image, mode
+    python3 flaky_server.py "$WORK/$2" "$3" "$PORT" 2>"$WORK/server.log" &
+    server=$!
+    sleep 0.5
+    if "$WORK/ota_resume_test" "http://127.0.0.1:$PORT/fw" "$WORK/running.bin" "$4" "$5" >"$WORK/test.log" 2>&1; then
+        status=ok
+    else
+        status=FAILED
+        failed=1
+    fi
+    kill $server
+    wait $server 2>/dev/null || true
+    printf '%-16s %-6s %s, %d requests\n' "$1" "$status" "$(grep RESULT "$WORK/test.log" | cut -d: -f2)" \
+        "$(grep -c GET "$WORK/server.log")"
+    [ $status = ok ] || tail -20 "$WORK/test.log"
+}
+
+# Each connection carries more than CONFIG_OTA_CHECKPOINT_KB, or no progress is ever saved
+run plain-retry    update.bin 100000 "$WORK/update.bin" retry
+run plain-reboot   update.bin 100000 "$WORK/update.bin" reboot
+run delta-retry    delta.otap 6000   "$WORK/update.bin" retry
+run delta-reboot   delta.otap 6000   "$WORK/update.bin" reboot
+run full-retry     full.otap  50000  "$WORK/update.bin" retry
+run full-reboot    full.otap  50000  "$WORK/update.bin" reboot
+run plain-no-drop  update.bin 0      "$WORK/update.bin" retry
+run oversized      oversized.bin 100000 - overflow
+exit $failed
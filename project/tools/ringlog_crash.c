@@ -0,0 +1,296 @@
+/*
+ * Crash-consistency check of the raw partition log (main/ringlog): appends records on an
+ * emulated NOR flash and, at every program and erase step, cuts the power on a copy of
+ * the flash, mounts it, checks what survived, appends again and checks once more.
+ *
+ *  gcc -O2 -I../main -o ringlog_crash ringlog_crash.c ../main/ringlog/ringlog.c
+ *  ./ringlog_crash
+ *
+ * A program is cut after every byte, and once more with the next byte half programmed.
+ * An erase is cut before it starts, with either half of the sector erased, once complete
+ * and with only some bits of the sector set. After a cut, every record whose append
+ * returned RINGLOG_OK must read back intact and in order, except those of a sector the
+ * cut caught being recycled; the record being appended may or may not survive, and no
+ * other record may appear. Exits non-zero on the first violation.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "ringlog/ringlog.h"
+
+#define MAX_SECTORS 3
+#define FLASH_SIZE (MAX_SECTORS * RINGLOG_SECTOR_SIZE)
+#define NO_ID UINT32_MAX
+#define ERASE_CUTS 6
+
+// An emulated flash and the records it is expected to hold
+typedef struct {
+    uint8_t data[FLASH_SIZE];
+    uint32_t size;
+    uint32_t record_size;
+    uint32_t lo[MAX_SECTORS], hi[MAX_SECTORS];  // Acknowledged ids held by each sector
+    uint32_t next_id;                           // Id of the record being appended
+    uint32_t next_sector;                       // Sector it is being written to
+    uint32_t lost_lo, lost_hi;                  // Ids of a sector caught being recycled
+    uint32_t torn;                              // Id of a record caught being appended
+    bool reference;                             // Cut the power on a copy at every step
+} nor_t;
+
+static struct {
+    uint32_t program_steps, erase_steps, cuts;
+} stats;
+
+static void crash_program(const nor_t *ref, uint32_t offset, const uint8_t *src, uint32_t len);
+static void crash_erase(const nor_t *ref, uint32_t offset, uint32_t len);
+
+static int nor_read(void *ctx, uint32_t offset, void *dst, uint32_t len)
+{
+    nor_t *nor = ctx;
+    if (offset + len > nor->size)
+        return -1;
+    memcpy(dst, nor->data + offset, len);
+    return 0;
+}
+
+static int nor_write(void *ctx, uint32_t offset, const void *src, uint32_t len)
+{
+    nor_t *nor = ctx;
+    const uint8_t *p = src;
+    if (offset + len > nor->size)
+        return -1;
+    if (offset % RINGLOG_SECTOR_SIZE != 0 && len == nor->record_size - 1)
+        nor->next_sector = offset / RINGLOG_SECTOR_SIZE;
+    if (nor->reference)
+        crash_program(nor, offset, p, len);
+    for (uint32_t i = 0; i < len; i++)
+        nor->data[offset + i] &= p[i];
+    return 0;
+}
+
+static void forget_sector(nor_t *nor, uint32_t sector)
+{
+    nor->lo[sector] = nor->hi[sector] = 0;
+}
+
+static int nor_erase(void *ctx, uint32_t offset, uint32_t len)
+{
+    nor_t *nor = ctx;
+    if (offset % RINGLOG_SECTOR_SIZE || len % RINGLOG_SECTOR_SIZE || offset + len > nor->size)
+        return -1;
+    if (nor->reference)
+        crash_erase(nor, offset, len);
+    for (uint32_t sector = offset / RINGLOG_SECTOR_SIZE; sector < (offset + len) / RINGLOG_SECTOR_SIZE; sector++)
+        forget_sector(nor, sector);
+    memset(nor->data + offset, 0xFF, len);
+    return 0;
+}
+
+static void fail(const nor_t *nor, const char *what, uint32_t id)
+{
+    printf("FAIL record size %u, %u sectors, after %u program and %u erase steps: %s (id %u)\n",
+           nor->record_size, nor->size / RINGLOG_SECTOR_SIZE, stats.program_steps, stats.erase_steps,
+           what, id);
+    exit(1);
+}
+
+static void fill(uint8_t *data, uint32_t len, uint32_t id)
+{
+    memcpy(data, &id, sizeof(id));
+    for (uint32_t i = sizeof(id); i < len; i++)
+        data[i] = (uint8_t)(id * 31 + i);
+}
+
+static int append(nor_t *nor, ringlog_t *log)
+{
+    uint8_t data[RINGLOG_MAX_RECORD_SIZE];
+    uint32_t id = nor->next_id;
+
+    fill(data, nor->record_size - 1, id);
+    int err = ringlog_append(log, data);
+    nor->next_id = id + 1;
+    if (err == RINGLOG_OK) {
+        uint32_t s = nor->next_sector;
+        if (nor->lo[s] == nor->hi[s])
+            nor->lo[s] = id;
+        nor->hi[s] = id + 1;
+    }
+    return err;
+}
+
+static bool expected(const nor_t *nor, uint32_t id)
+{
+    for (uint32_t s = 0; s < nor->size / RINGLOG_SECTOR_SIZE; s++)
+        if (id >= nor->lo[s] && id < nor->hi[s])
+            return true;
+    return false;
+}
+
+static bool may_survive(const nor_t *nor, uint32_t id)
+{
+    return id == nor->torn || (id >= nor->lost_lo && id < nor->lost_hi);
+}
+
+/*
+ * @brief Reads the whole log back: records in id order, none unexpected, none missing
+ *        except those the cut was allowed to take.
+ */
+static void check(const nor_t *nor, const ringlog_t *log)
+{
+    uint8_t data[RINGLOG_MAX_RECORD_SIZE], want[RINGLOG_MAX_RECORD_SIZE];
+    uint32_t len = nor->record_size - 1;
+    uint32_t found = 0, last = NO_ID;
+    bool torn_found = false;
+
+    if (ringlog_count(log) > ringlog_capacity(log))
+        fail(nor, "more records than slots", ringlog_count(log));
+    for (uint32_t position = 0; position < ringlog_count(log); position++) {
+        int err = ringlog_read(log, position, data);
+        if (err == RINGLOG_ERR_CRC)
+            continue;
+        if (err != RINGLOG_OK)
+            fail(nor, "read error", position);
+
+        uint32_t id;
+        memcpy(&id, data, sizeof(id));
+        fill(want, len, id);
+        if (memcmp(data, want, len))
+            fail(nor, "record corrupted", id);
+        if (last != NO_ID && id <= last)
+            fail(nor, "record out of order", id);
+        torn_found |= id == nor->torn;
+        if (expected(nor, id))
+            found++;
+        else if (!may_survive(nor, id))
+            fail(nor, "record that was never acknowledged or was recycled", id);
+        last = id;
+    }
+
+    uint32_t acked = 0;
+    for (uint32_t s = 0; s < nor->size / RINGLOG_SECTOR_SIZE; s++)
+        acked += nor->hi[s] - nor->lo[s];
+    // Appends after the cut extend a sector's id range over the torn record
+    if (!torn_found && expected(nor, nor->torn))
+        acked--;
+    if (found != acked)
+        fail(nor, "acknowledged records lost", acked - found);
+}
+
+/*
+ * @brief What happens after a power cut: mount and check, then append until a new sector
+ *        has been started, mount again and check again.
+ */
+static void recover(nor_t *nor)
+{
+    ringlog_flash_t flash = {nor, nor->size, nor_read, nor_write, nor_erase};
+    ringlog_t log;
+
+    stats.cuts++;
+    nor->reference = false;
+    if (ringlog_mount(&log, &flash, nor->record_size) != RINGLOG_OK)
+        fail(nor, "mount failed after the cut", 0);
+    check(nor, &log);
+
+    for (uint32_t i = 0; i < log.per_sector + 2; i++)
+        if (append(nor, &log) != RINGLOG_OK)
+            fail(nor, "append failed after the cut", nor->next_id - 1);
+    if (ringlog_mount(&log, &flash, nor->record_size) != RINGLOG_OK)
+        fail(nor, "mount failed after recovery", 0);
+    check(nor, &log);
+}
+
+static nor_t victim;
+
+static void crash_program(const nor_t *ref, uint32_t offset, const uint8_t *src, uint32_t len)
+{
+    stats.program_steps++;
+    for (uint32_t cut = 0; cut <= 2 * len; cut++) {
+        victim = *ref;
+        victim.torn = ref->next_id;
+        victim.next_id = ref->next_id + 1;
+        for (uint32_t i = 0; i < cut / 2; i++)
+            victim.data[offset + i] &= src[i];
+        // Half the bits of the next byte programmed
+        if (cut % 2)
+            victim.data[offset + cut / 2] &= src[cut / 2] | 0xF0;
+        recover(&victim);
+    }
+}
+
+static void crash_erase(const nor_t *ref, uint32_t offset, uint32_t len)
+{
+    stats.erase_steps++;
+    for (int cut = 0; cut < ERASE_CUTS; cut++) {
+        victim = *ref;
+        victim.torn = ref->next_id;
+        victim.next_id = ref->next_id + 1;
+        uint32_t sector = offset / RINGLOG_SECTOR_SIZE;
+        victim.lost_lo = ref->lo[sector];
+        victim.lost_hi = ref->hi[sector];
+        forget_sector(&victim, sector);
+
+        uint8_t *p = victim.data + offset;
+        switch (cut) {
+        case 0:     // Not started
+            break;
+        case 1:
+            memset(p, 0xFF, len / 2);
+            break;
+        case 2:
+            memset(p + len / 2, 0xFF, len - len / 2);
+            break;
+        case 3:     // Complete, power lost before the header was written
+            memset(p, 0xFF, len);
+            break;
+        case 4:     // Some cells of the whole sector erased
+            for (uint32_t i = 0; i < len; i++)
+                p[i] |= 0x5A;
+            break;
+        case 5:
+            for (uint32_t i = 0; i < len; i++)
+                p[i] |= i % 7 ? 0x00 : 0xFF;
+            break;
+        }
+        recover(&victim);
+    }
+}
+
+static void run(uint32_t sectors, uint32_t record_size)
+{
+    static nor_t ref;
+    memset(&ref, 0, sizeof(ref));
+    memset(ref.data, 0xFF, sizeof(ref.data));
+    ref.size = sectors * RINGLOG_SECTOR_SIZE;
+    ref.record_size = record_size;
+    ref.torn = NO_ID;
+    ref.lost_lo = ref.lost_hi = NO_ID;
+
+    ringlog_flash_t flash = {&ref, ref.size, nor_read, nor_write, nor_erase};
+    ringlog_t log;
+    memset(&stats, 0, sizeof(stats));
+    if (ringlog_mount(&log, &flash, record_size) != RINGLOG_OK)
+        fail(&ref, "mount of the erased flash failed", 0);
+
+    // From an erased flash around the ring twice
+    uint32_t appends = 2 * sectors * log.per_sector + 1;
+    for (uint32_t i = 0; i < appends; i++) {
+        ref.reference = true;
+        if (append(&ref, &log) != RINGLOG_OK)
+            fail(&ref, "append failed", ref.next_id - 1);
+    }
+    printf("record size %4u, %u sectors: %6u appends, %6u program and %2u erase steps, %8u cuts recovered\n",
+           record_size, sectors, appends, stats.program_steps, stats.erase_steps, stats.cuts);
+}
+
+int main(void)
+{
+    static const uint32_t record_sizes[] = {16, 64, 1024};
+
+    for (uint32_t sectors = 2; sectors <= MAX_SECTORS; sectors++)
+        for (size_t i = 0; i < sizeof(record_sizes) / sizeof(record_sizes[0]); i++)
+            run(sectors, record_sizes[i]);
+    printf("PASS\n");
+    return 0;
+}
@@ -0,0 +1,16 @@
+#!/bin/sh
+# Checks out the file system sources for the (still unverified) SPIFFS and LittleFS adapters
+# of storage_bench.c, at the versions the ESP-IDF components are based on, into SPIFFS/ and
+# LFS/ next to this script.
+set -e
+cd "$(dirname "$0")"
+SPIFFS_VERSION=0.3.7        # pellepl/spiffs, the core of the ESP-IDF spiffs component
+LITTLEFS_VERSION=v2.9.3     # littlefs-project/littlefs, as in the esp_littlefs component
+
+[ -d SPIFFS ] || git clone --depth 1 --branch "$SPIFFS_VERSION" https://github.com/pellepl/spiffs.git SPIFFS
+[ -d LFS ] || git clone --depth 1 --branch "$LITTLEFS_VERSION" https://github.com/littlefs-project/littlefs.git LFS
+
+gcc -O2 -I../../main -I. -ISPIFFS/src -ILFS -DBENCH_SPIFFS -DBENCH_LITTLEFS \
+    -o storage_bench storage_bench.c ../../main/ringlog/ringlog.c ../../main/tscodec/tscodec.c \
+    SPIFFS/src/spiffs_*.c LFS/lfs.c LFS/lfs_util.c
+echo "built ./storage_bench with SPIFFS $SPIFFS_VERSION and LittleFS $LITTLEFS_VERSION"
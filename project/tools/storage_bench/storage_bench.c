@@ -0,0 +1,525 @@
+/*
+ * Storage benchmark: runs the one-sample-a-minute logging workload against the raw
+ * partition log (main/ringlog) on an emulated NOR flash with the erase and program timings
+ * of the ESP32-C3 module flash, and reports write latency percentiles, flash bytes
+ * programmed per sample, erases, mount time and what happens when the partition fills up.
+ *
+ *  gcc -O2 -I../../main -o storage_bench storage_bench.c \
+ *      ../../main/ringlog/ringlog.c ../../main/tscodec/tscodec.c
+ *
+ * The SPIFFS and LittleFS adapters below (BENCH_SPIFFS, BENCH_LITTLEFS) are unverified:
+ * they were never compiled against the upstream sources nor run, see README.md. With SPIFFS
+ * (https://github.com/pellepl/spiffs, the core of the ESP-IDF spiffs component) and
+ * LittleFS (https://github.com/littlefs-project/littlefs) checked out next to it, which
+ * fetch.sh does at pinned versions, they would build with:
+ *  gcc -O2 -I../../main -I. -ISPIFFS/src -ILFS -DBENCH_SPIFFS -DBENCH_LITTLEFS \
+ *      -o storage_bench storage_bench.c ../../main/ringlog/ringlog.c \
+ *      ../../main/tscodec/tscodec.c SPIFFS/src/spiffs_*.c LFS/lfs.c LFS/lfs_util.c
+ *  (the spiffs_config.h in this directory replaces the upstream test configuration)
+ *
+ *  ./storage_bench [partition KB] [samples]      defaults: 960 KB and 100000 samples
+ *
+ * Latencies are emulated flash time, CPU time is not counted. "record" writes one 40 byte
+ * backlog record per sample (open, append, close); "staged" writes them two SPIFFS pages at
+ * a time as the backlog does since CONFIG_BACKLOG_STAGE_PAGES.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "ringlog/ringlog.h"
+#include "tscodec/tscodec.h"
+#include "payload/payload.h"
+
+#ifdef BENCH_SPIFFS
+#include "spiffs.h"
+#endif
+#ifdef BENCH_LITTLEFS
+#include "lfs.h"
+#endif
+
+// Typical figures of the 4 MB SPI NOR flash of ESP32-C3 modules at 80 MHz
+#define SECTOR_SIZE 4096
+#define PAGE_SIZE 256
+#define ERASE_US 45000.0            // 4 KB sector erase
+#define PROGRAM_BASE_US 100.0       // Per page program command
+#define PROGRAM_PAGE_US 600.0       // Added for a full 256 byte page, pro rata
+#define READ_BASE_US 1.0
+#define READ_BYTE_US 0.025          // Quad I/O, 40 MB/s
+
+#define RECORD_SIZE 40              // backlog_record_t
+#define STAGE_SIZE (2 * (PAGE_SIZE - 5))
+
+// ---------------------------------------------------------------------------------------
+// Emulated NOR flash
+
+static struct {
+    uint8_t *data;
+    uint32_t size;
+    double now_us;
+    uint64_t programmed;
+    uint32_t erases;
+    uint32_t *sector_erases;
+    uint32_t violations;        // Programs that tried to set a bit (would need an erase)
+} nor;
+
+static void nor_init(uint32_t size)
+{
+    free(nor.data);
+    free(nor.sector_erases);
+    memset(&nor, 0, sizeof(nor));
+    nor.size = size;
+    nor.data = malloc(size);
+    nor.sector_erases = calloc(size / SECTOR_SIZE, sizeof(uint32_t));
+    memset(nor.data, 0xFF, size);
+}
+
+static int nor_read(uint32_t offset, void *dst, uint32_t len)
+{
+    if (offset + len > nor.size)
+        return -1;
+    memcpy(dst, nor.data + offset, len);
+    nor.now_us += READ_BASE_US + READ_BYTE_US * len;
+    return 0;
+}
+
+static int nor_program(uint32_t offset, const void *src, uint32_t len)
+{
+    const uint8_t *p = src;
+    if (offset + len > nor.size)
+        return -1;
+    while (len > 0) {
+        // A program command never crosses a page boundary
+        uint32_t chunk = PAGE_SIZE - offset % PAGE_SIZE;
+        if (chunk > len)
+            chunk = len;
+        for (uint32_t i = 0; i < chunk; i++) {
+            if (p[i] & ~nor.data[offset + i])
+                nor.violations++;
+            nor.data[offset + i] &= p[i];
+        }
+        nor.now_us += PROGRAM_BASE_US + PROGRAM_PAGE_US * chunk / PAGE_SIZE;
+        nor.programmed += chunk;
+        offset += chunk;
+        p += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+static int nor_erase(uint32_t offset, uint32_t len)
+{
+    if (offset % SECTOR_SIZE || len % SECTOR_SIZE || offset + len > nor.size)
+        return -1;
+    for (; len > 0; offset += SECTOR_SIZE, len -= SECTOR_SIZE) {
+        memset(nor.data + offset, 0xFF, SECTOR_SIZE);
+        nor.now_us += ERASE_US;
+        nor.erases++;
+        nor.sector_erases[offset / SECTOR_SIZE]++;
+    }
+    return 0;
+}
+
+// ---------------------------------------------------------------------------------------
+// Backends
+
+typedef struct {
+    const char *name;
+    int (*format)(void);
+    int (*mount)(void);
+    int (*check)(void);                 // Optional consistency check run after mount
+    int (*write)(const sample_t *s);    // 0, or -1 when the partition is full
+    int (*flush)(void);
+    void (*unmount)(void);
+    double (*fill)(void);               // Used fraction, -1 for a ring that never fills
+} backend_t;
+
+#if defined(BENCH_SPIFFS) || defined(BENCH_LITTLEFS)
+static uint8_t stage[STAGE_SIZE + RECORD_SIZE];
+static uint32_t stage_len, file_len;
+static int (*append_bytes)(const void *data, uint32_t len);
+
+static void encode_record(const sample_t *s, uint8_t *out)
+{
+    uint32_t magic = 0x53414D50;
+    memset(out, 0, RECORD_SIZE);
+    memcpy(out, &magic, 4);
+    memcpy(out + 8, s, sizeof(*s) < RECORD_SIZE - 8 ? sizeof(*s) : RECORD_SIZE - 8);
+}
+
+static int write_record(const sample_t *s)
+{
+    uint8_t record[RECORD_SIZE];
+    encode_record(s, record);
+    return append_bytes(record, RECORD_SIZE);
+}
+
+// Same policy as backlog_push(): write once STAGE_SIZE is reached, ending on a page boundary
+static int write_staged(const sample_t *s)
+{
+    encode_record(s, stage + stage_len);
+    stage_len += RECORD_SIZE;
+    if (stage_len < STAGE_SIZE)
+        return 0;
+    uint32_t n = stage_len - (file_len + stage_len) % (PAGE_SIZE - 5);
+    if (append_bytes(stage, n) != 0)
+        return -1;
+    memmove(stage, stage + n, stage_len - n);
+    stage_len -= n;
+    file_len += n;
+    return 0;
+}
+
+static int flush_staged(void)
+{
+    int err = stage_len ? append_bytes(stage, stage_len) : 0;
+    file_len += stage_len;
+    stage_len = 0;
+    return err;
+}
+#endif
+
+static int flush_none(void)
+{
+    return 0;
+}
+
+// Raw partition log ----------------------------------------------------------------------
+
+static ringlog_t ring;
+static tscodec_block_t block;
+static uint32_t ring_record_size;
+
+static int ring_read(void *ctx, uint32_t offset, void *dst, uint32_t len) { return nor_read(offset, dst, len); }
+static int ring_write(void *ctx, uint32_t offset, const void *src, uint32_t len) { return nor_program(offset, src, len); }
+static int ring_erase(void *ctx, uint32_t offset, uint32_t len) { return nor_erase(offset, len); }
+
+static int ring_mount(void)
+{
+    ringlog_flash_t flash = {NULL, nor.size, ring_read, ring_write, ring_erase};
+    tscodec_block_init(&block);
+    return ringlog_mount(&ring, &flash, ring_record_size);
+}
+
+static int ring_format_records(void) { ring_record_size = TSCODEC_RECORD_SIZE + 1; return 0; }
+static int ring_format_blocks(void) { ring_record_size = TSCODEC_BLOCK_SIZE + 1; return 0; }
+
+static int ring_write_record(const sample_t *s)
+{
+    uint8_t record[TSCODEC_RECORD_SIZE];
+    tscodec_pack_record(s, record);
+    return ringlog_append(&ring, record) == RINGLOG_OK ? 0 : -1;
+}
+
+static int ring_write_block(const sample_t *s)
+{
+    if (tscodec_block_add(&block, s) == 0)
+        return 0;
+    int err = ringlog_append(&ring, block.data);
+    tscodec_block_init(&block);
+    tscodec_block_add(&block, s);
+    return err == RINGLOG_OK ? 0 : -1;
+}
+
+static int ring_flush_block(void)
+{
+    if (block.count == 0)
+        return 0;
+    int err = ringlog_append(&ring, block.data);
+    tscodec_block_init(&block);
+    return err == RINGLOG_OK ? 0 : -1;
+}
+
+static void ring_unmount(void) {}
+static double ring_fill(void) { return -1; }
+
+// SPIFFS ----------------------------------------------------------------------------------
+
+#ifdef BENCH_SPIFFS
+static spiffs fs;
+static uint8_t spiffs_work[2 * PAGE_SIZE];
+static uint8_t spiffs_fds[32 * 4];
+static uint8_t spiffs_cache[(PAGE_SIZE + 32) * 4 + 40];
+
+static s32_t spiffs_hal_read(u32_t addr, u32_t size, u8_t *dst) { return nor_read(addr, dst, size); }
+static s32_t spiffs_hal_write(u32_t addr, u32_t size, u8_t *src) { return nor_program(addr, src, size); }
+static s32_t spiffs_hal_erase(u32_t addr, u32_t size) { return nor_erase(addr, size); }
+
+static int spiffs_bench_mount(void)
+{
+    spiffs_config cfg = {
+        .hal_read_f = spiffs_hal_read,
+        .hal_write_f = spiffs_hal_write,
+        .hal_erase_f = spiffs_hal_erase,
+        .phys_size = nor.size,
+        .phys_addr = 0,
+        .phys_erase_block = SECTOR_SIZE,
+        .log_block_size = SECTOR_SIZE,
+        .log_page_size = PAGE_SIZE,
+    };
+    return SPIFFS_mount(&fs, &cfg, spiffs_work, spiffs_fds, sizeof(spiffs_fds),
+                        spiffs_cache, sizeof(spiffs_cache), NULL);
+}
+
+static int spiffs_bench_format(void)
+{
+    // As esp_vfs_spiffs_register() with format_if_mount_failed: mount, format, unmount
+    spiffs_bench_mount();
+    SPIFFS_unmount(&fs);
+    return SPIFFS_format(&fs);
+}
+
+static int spiffs_bench_check(void)
+{
+    return SPIFFS_check(&fs);
+}
+
+static int spiffs_append(const void *data, uint32_t len)
+{
+    spiffs_file fd = SPIFFS_open(&fs, "/backlog.bin", SPIFFS_O_CREAT | SPIFFS_O_WRONLY | SPIFFS_O_APPEND, 0);
+    if (fd < 0)
+        return -1;
+    s32_t written = SPIFFS_write(&fs, fd, (void *)data, len);
+    SPIFFS_close(&fs, fd);
+    return written == (s32_t)len ? 0 : -1;
+}
+
+static void spiffs_bench_unmount(void)
+{
+    SPIFFS_unmount(&fs);
+}
+
+static double spiffs_fill(void)
+{
+    u32_t total = 0, used = 0;
+    SPIFFS_info(&fs, &total, &used);
+    return total ? (double)used / total : 1;
+}
+
+static int spiffs_setup(void) { append_bytes = spiffs_append; stage_len = file_len = 0; return spiffs_bench_format(); }
+#endif
+
+// LittleFS --------------------------------------------------------------------------------
+
+#ifdef BENCH_LITTLEFS
+static lfs_t lfs;
+static struct lfs_config lfs_cfg;
+
+static int lfs_hal_read(const struct lfs_config *c, lfs_block_t b, lfs_off_t off, void *buf, lfs_size_t size)
+{
+    return nor_read(b * SECTOR_SIZE + off, buf, size) ? LFS_ERR_IO : 0;
+}
+
+static int lfs_hal_prog(const struct lfs_config *c, lfs_block_t b, lfs_off_t off, const void *buf, lfs_size_t size)
+{
+    return nor_program(b * SECTOR_SIZE + off, buf, size) ? LFS_ERR_IO : 0;
+}
+
+static int lfs_hal_erase(const struct lfs_config *c, lfs_block_t b)
+{
+    return nor_erase(b * SECTOR_SIZE, SECTOR_SIZE) ? LFS_ERR_IO : 0;
+}
+
+static int lfs_hal_sync(const struct lfs_config *c)
+{
+    return 0;
+}
+
+// Settings of the esp_littlefs component defaults
+static void lfs_configure(void)
+{
+    memset(&lfs_cfg, 0, sizeof(lfs_cfg));
+    lfs_cfg.read = lfs_hal_read;
+    lfs_cfg.prog = lfs_hal_prog;
+    lfs_cfg.erase = lfs_hal_erase;
+    lfs_cfg.sync = lfs_hal_sync;
+    lfs_cfg.read_size = 128;
+    lfs_cfg.prog_size = 128;
+    lfs_cfg.block_size = SECTOR_SIZE;
+    lfs_cfg.block_count = nor.size / SECTOR_SIZE;
+    lfs_cfg.cache_size = 512;
+    lfs_cfg.lookahead_size = 128;
+    lfs_cfg.block_cycles = 512;
+}
+
+static int lfs_bench_format(void)
+{
+    lfs_configure();
+    return lfs_format(&lfs, &lfs_cfg);
+}
+
+static int lfs_bench_mount(void)
+{
+    return lfs_mount(&lfs, &lfs_cfg);
+}
+
+static int lfs_append(const void *data, uint32_t len)
+{
+    lfs_file_t file;
+    if (lfs_file_open(&lfs, &file, "backlog.bin", LFS_O_WRONLY | LFS_O_CREAT | LFS_O_APPEND) < 0)
+        return -1;
+    lfs_ssize_t written = lfs_file_write(&lfs, &file, data, len);
+    int err = lfs_file_close(&lfs, &file);
+    return written == (lfs_ssize_t)len && err == 0 ? 0 : -1;
+}
+
+static void lfs_bench_unmount(void)
+{
+    lfs_unmount(&lfs);
+}
+
+static double lfs_fill(void)
+{
+    lfs_ssize_t used = lfs_fs_size(&lfs);
+    return used < 0 ? 1 : (double)used / lfs_cfg.block_count;
+}
+
+static int lfs_setup(void) { append_bytes = lfs_append; stage_len = file_len = 0; return lfs_bench_format(); }
+#endif
+
+static const backend_t backends[] = {
+#ifdef BENCH_SPIFFS
+    {"spiffs/record", spiffs_setup, spiffs_bench_mount, spiffs_bench_check, write_record, flush_none, spiffs_bench_unmount, spiffs_fill},
+    {"spiffs/staged", spiffs_setup, spiffs_bench_mount, spiffs_bench_check, write_staged, flush_staged, spiffs_bench_unmount, spiffs_fill},
+#endif
+#ifdef BENCH_LITTLEFS
+    {"littlefs/record", lfs_setup, lfs_bench_mount, NULL, write_record, flush_none, lfs_bench_unmount, lfs_fill},
+    {"littlefs/staged", lfs_setup, lfs_bench_mount, NULL, write_staged, flush_staged, lfs_bench_unmount, lfs_fill},
+#endif
+    {"raw/record", ring_format_records, ring_mount, NULL, ring_write_record, flush_none, ring_unmount, ring_fill},
+    {"raw/block", ring_format_blocks, ring_mount, NULL, ring_write_block, ring_flush_block, ring_unmount, ring_fill},
+};
+
+// ---------------------------------------------------------------------------------------
+// Workload and report
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(double *sorted, uint32_t n, double p)
+{
+    if (n == 0)
+        return 0;
+    uint32_t i = (uint32_t)(p * (n - 1) + 0.5);
+    return sorted[i];
+}
+
+// Weather-like random walk, one sample a minute with a little timer jitter
+static void next_sample(sample_t *s, uint32_t i)
+{
+    if (i == 0) {
+        *s = (sample_t){1760000000000LL, 0, 21.0f, 1013.0f, 50.0f, 12};
+        return;
+    }
+    s->timestamp += 60000 + rand() % 21 - 10;
+    s->seq++;
+    s->temperature += (rand() % 21 - 10) / 100.0f;
+    s->pressure += (rand() % 11 - 5) / 100.0f;
+    s->humidity += (rand() % 41 - 20) / 100.0f;
+    if (rand() % 180 == 0)
+        s->forecast = rand() % 26;
+}
+
+static void run(const backend_t *b, uint32_t size, uint32_t samples)
+{
+    double *latency = malloc(samples * sizeof(double));
+    double *sorted = malloc(samples * sizeof(double));
+    uint32_t written = 0;
+    double full_at = -1;
+    sample_t s;
+
+    srand(1);
+    nor_init(size);
+    if (b->format() != 0 || b->mount() != 0) {
+        printf("%-16s format/mount failed\n", b->name);
+        goto out;
+    }
+
+    for (uint32_t i = 0; i < samples; i++) {
+        next_sample(&s, i);
+        double start = nor.now_us;
+        if (b->write(&s) != 0) {
+            full_at = b->fill();
+            break;
+        }
+        latency[written++] = nor.now_us - start;
+    }
+    b->flush();
+    double fill = b->fill();
+    uint64_t programmed = nor.programmed;
+    uint32_t erases = nor.erases;
+    b->unmount();
+
+    double start = nor.now_us;
+    if (b->mount() != 0)
+        printf("%-16s remount failed\n", b->name);
+    double mount_ms = (nor.now_us - start) / 1000;
+    double check_ms = 0;
+    if (b->check) {
+        start = nor.now_us;
+        b->check();
+        check_ms = (nor.now_us - start) / 1000;
+    }
+    b->unmount();
+
+    uint32_t max_sector = 0;
+    for (uint32_t i = 0; i < size / SECTOR_SIZE; i++)
+        if (nor.sector_erases[i] > max_sector)
+            max_sector = nor.sector_erases[i];
+
+    memcpy(sorted, latency, written * sizeof(double));
+    qsort(sorted, written, sizeof(double), compare_double);
+
+    // Tail: last 10% before the partition filled up, or after the ring wrapped
+    uint32_t tail = written / 10;
+    memcpy(sorted, latency + written - tail, tail * sizeof(double));
+    qsort(sorted, tail, sizeof(double), compare_double);
+    double tail_p99 = percentile(sorted, tail, 0.99), tail_max = tail ? sorted[tail - 1] : 0;
+    memcpy(sorted, latency, written * sizeof(double));
+    qsort(sorted, written, sizeof(double), compare_double);
+
+    printf("%-16s %8u %8.2f %8.2f %8.2f %9.1f %9.1f %9.1f %7.1f %6u %5u %8.1f %8.1f %s",
+           b->name, written,
+           percentile(sorted, written, 0.5) / 1000, percentile(sorted, written, 0.9) / 1000,
+           percentile(sorted, written, 0.99) / 1000, written ? sorted[written - 1] / 1000 : 0,
+           tail_p99 / 1000, tail_max / 1000,
+           written ? (double)programmed / written : 0, erases, max_sector,
+           mount_ms, check_ms,
+           full_at >= 0 ? "full" : fill >= 0 ? "" : "ring");
+    if (full_at >= 0)
+        printf(" at %.0f%%", full_at * 100);
+    if (nor.violations)
+        printf(" (%u programs over unerased bits)", nor.violations);
+    printf("\n");
+
+out:
+    free(latency);
+    free(sorted);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t size = (argc > 1 ? atoi(argv[1]) : 960) * 1024;
+    uint32_t samples = argc > 2 ? atoi(argv[2]) : 100000;
+
+    if (size % SECTOR_SIZE || size < 2 * SECTOR_SIZE) {
+        fprintf(stderr, "partition size must be a multiple of 4 KB\n");
+        return 2;
+    }
+
+    printf("%u KB partition, %u samples, latencies in ms of emulated flash time\n\n", size / 1024, samples);
+    printf("%-16s %8s %8s %8s %8s %9s %9s %9s %7s %6s %5s %8s %8s\n",
+           "backend", "samples", "p50", "p90", "p99", "max", "tail p99", "tail max",
+           "B/smpl", "erases", "wear", "mount", "check");
+    for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++)
+        run(&backends[i], size, samples);
+
+    printf("\nB/smpl: flash bytes programmed per sample. wear: erases of the most erased sector.\n"
+           "tail: last 10%% of the samples, i.e. close to full for file systems, wrapped for rings.\n");
+    return 0;
+}
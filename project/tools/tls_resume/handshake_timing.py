@@ -0,0 +1,68 @@
+#!/usr/bin/env python3
+"""Times TLS 1.2 handshakes against a broker listener: ROUNDS full handshakes, then ROUNDS
+that offer the session of the previous connection, the way tls_session.c does. Only the
+handshake is timed, after the TCP connect. A resumption counts when the server accepted the
+offered session; a rejected offer counts as a full handshake, as in tls_session_record().
+
+    handshake_timing.py HOST PORT CA [ROUNDS]
+"""
+import socket
+import ssl
+import statistics
+import sys
+import time
+
+host, port, ca = sys.argv[1], int(sys.argv[2]), sys.argv[3]
+rounds = int(sys.argv[4]) if len(sys.argv) > 4 else 200
+
+ctx = ssl.SSLContext(ssl.PROTOCOL_TLS_CLIENT)
+ctx.load_verify_locations(ca)
+ctx.minimum_version = ctx.maximum_version = ssl.TLSVersion.TLSv1_2
+# The suite mbedTLS picks against a P-256 certificate
+ctx.set_ciphers('ECDHE-ECDSA-AES128-GCM-SHA256')
+
+
+def handshake(session):
+    """Returns (ms, resumed, session) for one connection."""
+    raw = socket.create_connection((host, port))
+    raw.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    tls = ctx.wrap_socket(raw, server_hostname=host, session=session, do_handshake_on_connect=False)
+    start = time.perf_counter()
+    tls.do_handshake()
+    ms = (time.perf_counter() - start) * 1000
+    # TLS 1.2 tickets arrive within the handshake, the session is complete here
+    global cipher
+    cipher = tls.cipher()[0]
+    result = ms, tls.session_reused, tls.session
+    tls.close()
+    return result
+
+
+def report(name, times):
+    if not times:
+        print('%-8s %5d' % (name, 0))
+        return
+    times = sorted(times)
+    print('%-8s %5d  p50 %6.2f  p95 %6.2f  max %6.2f ms' % (
+        name, len(times), statistics.median(times), times[int(len(times) * 0.95) - 1], times[-1]))
+
+
+full, resumed = [], []
+rejected = 0
+cipher = None
+for _ in range(rounds):
+    full.append(handshake(None)[0])
+_, _, session = handshake(None)
+for _ in range(rounds):
+    ms, reused, session = handshake(session)
+    if reused:
+        resumed.append(ms)
+    else:
+        full.append(ms)
+        rejected += 1
+
+print('%s:%d, TLS 1.2, %s' % (host, port, cipher))
+report('full', full)
+report('resumed', resumed)
+print('rejected %d of %d offered sessions' % (rejected, rounds))
+sys.exit(0 if resumed else 1)
@@ -0,0 +1,32 @@
+#!/bin/sh
+# Full vs resumed TLS 1.2 handshake times against a local broker listener. Generates a P-256
+# CA and server certificate, starts mosquitto with mosquitto.conf, or openssl s_server when
+# mosquitto is not installed, and runs handshake_timing.py. Needs openssl and python3.
+set -e
+cd "$(dirname "$0")"
+PORT=${PORT:-8883}
+ROUNDS=${ROUNDS:-200}
+WORK=$(mktemp -d)
+trap 'kill $server 2>/dev/null; rm -rf "$WORK"' EXIT
+
+openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:P-256 -nodes -days 1 \
+    -subj /CN=test-ca -keyout "$WORK/ca.key" -out "$WORK/ca.pem" 2>/dev/null
+openssl req -newkey ec -pkeyopt ec_paramgen_curve:P-256 -nodes -subj /CN=localhost \
+    -keyout "$WORK/server.key" -out "$WORK/server.csr" 2>/dev/null
+printf 'subjectAltName=DNS:localhost\n' >"$WORK/san.ext"
+openssl x509 -req -in "$WORK/server.csr" -CA "$WORK/ca.pem" -CAkey "$WORK/ca.key" -CAcreateserial \
+    -days 1 -extfile "$WORK/san.ext" -out "$WORK/server.pem" 2>/dev/null
+
+if command -v mosquitto >/dev/null; then
+    sed -e "s|@DIR@|$WORK|g" -e "s|@PORT@|$PORT|g" mosquitto.conf >"$WORK/mosquitto.conf"
+    mosquitto -c "$WORK/mosquitto.conf" >"$WORK/server.log" 2>&1 &
+    echo "listener: $(mosquitto -h 2>/dev/null | head -1)"
+else
+    openssl s_server -accept "$PORT" -cert "$WORK/server.pem" -key "$WORK/server.key" \
+        -tls1_2 -quiet >"$WORK/server.log" 2>&1 </dev/null &
+    echo "listener: openssl s_server ($(openssl version)), mosquitto not installed"
+fi
+server=$!
+sleep 0.5
+
+python3 handshake_timing.py localhost "$PORT" "$WORK/ca.pem" "$ROUNDS"